@@ -0,0 +1,90 @@
+/**
+ * @file bitmap_bench.c
+ *
+ * Microbenchmark for free-bit searches on nearly-full bitmaps.
+ *
+ * Compares the per-bit bitmap_get() loop the allocators used to run against
+ * bitmap_next_zero(), for a bitmap the size of a 4GB image's block bitmap.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+#define BITS (1 << 20) // one bit per 4K block of a 4GB image
+#define ROUNDS 200
+
+static uint64_t words[BITS / 64];
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The old allocator loop: test one bit at a time from index 1.
+static int per_bit_first_zero(void *bm, int size) {
+  for (int ii = 1; ii < size; ++ii) {
+    if (!bitmap_get(bm, ii)) {
+      return ii;
+    }
+  }
+  return -1;
+}
+
+// Fill the bitmap, leaving `holes` clear bits at random positions past
+// `from` (percent of the bitmap).
+static void fill(int from, int holes) {
+  memset(words, 0xff, sizeof(words));
+  srand(42);
+  int base = (long) BITS * from / 100;
+  for (int ii = 0; ii < holes; ++ii) {
+    bitmap_put(words, base + rand() % (BITS - base), 0);
+  }
+}
+
+// Time `ROUNDS` searches of the current bitmap with both methods and print
+// the cost of one search.
+static void run(const char *label) {
+  volatile int sink = 0;
+
+  double t0 = now();
+  for (int ii = 0; ii < ROUNDS; ++ii) {
+    sink += per_bit_first_zero(words, BITS);
+  }
+  double per_bit = (now() - t0) / ROUNDS;
+
+  double t1 = now();
+  for (int ii = 0; ii < ROUNDS; ++ii) {
+    sink += bitmap_next_zero(words, BITS, 1);
+  }
+  double word = (now() - t1) / ROUNDS;
+
+  int a = per_bit_first_zero(words, BITS);
+  int b = bitmap_next_zero(words, BITS, 1);
+  if (a != b) {
+    fprintf(stderr, "%s: mismatch %d != %d\n", label, a, b);
+    exit(1);
+  }
+
+  printf("%-28s per-bit %9.1f us   word %7.2f us   %6.0fx\n", label,
+         per_bit * 1e6, word * 1e6, per_bit / word);
+}
+
+int main() {
+  printf("bitmap of %d bits, first free bit found by each search\n", BITS);
+  fill(90, 64);
+  run("free bits in last 10%");
+  fill(99, 16);
+  run("free bits in last 1%");
+  fill(100, 0);
+  bitmap_put(words, BITS - 1, 0);
+  run("single free bit at the end");
+  fill(100, 0);
+  run("completely full");
+  return 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * @file fault_bench.c
+ *
+ * Page faults taken through the image mapping under each mapping option.
+ *
+ * Fills an image with small files, then mounts it cold (its page cache
+ * dropped) once per option set and runs the same three phases: stat every
+ * file (metadata), read 4K at random offsets, and read a run of files front
+ * to back. Each phase reports its minor and major faults and its time; the
+ * "default" row is the mapping without any option.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "storage.h"
+
+#define FILES 16384
+#define FILE_SIZE (32 << 10)
+#define RANDOM_READS 32768
+#define SEQUENTIAL_FILES 2048
+
+typedef struct sample {
+  long minor;
+  long major;
+  double time;
+} sample_t;
+
+static sample_t sample() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sample_t) {ru.ru_minflt, ru.ru_majflt, ts.tv_sec + ts.tv_nsec / 1e9};
+}
+
+static void report(const char *phase, sample_t before) {
+  sample_t after = sample();
+  printf("  %-10s %8ld minor %6ld major %8.3f s\n", phase,
+         after.minor - before.minor, after.major - before.major,
+         after.time - before.time);
+}
+
+static void name(char *buf, int ii) {
+  sprintf(buf, "/d%d/f%d", ii % 64, ii);
+}
+
+// Drop the image's page cache, so the next mount starts cold.
+static void drop_cache(const char *image) {
+  int fd = open(image, O_RDONLY);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void run(const char *image, const char *label, int flags) {
+  drop_cache(image);
+  if (storage_init(image, 0, 0) < 0) {
+    exit(1);
+  }
+  printf("%s\n", label);
+  sample_t before = sample();
+  if (storage_mapping(flags) < 0) {
+    printf("  (not fully applied)\n");
+  }
+  report("mapping", before);
+
+  char path[64];
+  struct stat st;
+  before = sample();
+  for (int ii = 0; ii < FILES; ++ii) {
+    name(path, ii);
+    storage_stat(path, &st);
+  }
+  report("stat", before);
+
+  static char buf[FILE_SIZE];
+  srand(1);
+  before = sample();
+  for (int ii = 0; ii < RANDOM_READS; ++ii) {
+    name(path, rand() % FILES);
+    storage_read(path, buf, 4096, (rand() % (FILE_SIZE / 4096)) * 4096);
+  }
+  report("random", before);
+
+  before = sample();
+  for (int ii = 0; ii < SEQUENTIAL_FILES; ++ii) {
+    name(path, ii);
+    storage_read(path, buf, FILE_SIZE, 0);
+  }
+  report("sequential", before);
+  storage_destroy();
+}
+
+int main(int argc, char **argv) {
+  const char *image = argc > 1 ? argv[1] : "fault_bench.nufs";
+  unlink(image);
+  if (storage_init(image, (size_t) FILES * FILE_SIZE * 2, 0) < 0) {
+    return 1;
+  }
+  static char buf[FILE_SIZE];
+  char path[64];
+  for (int ii = 0; ii < 64; ++ii) {
+    sprintf(path, "/d%d", ii);
+    storage_mknod(path, 040755);
+  }
+  for (int ii = 0; ii < FILES; ++ii) {
+    name(path, ii);
+    memset(buf, ii, FILE_SIZE);
+    storage_mknod(path, 0100644);
+    storage_write(path, buf, FILE_SIZE, 0);
+    if (ii % 1024 == 1023) {
+      journal_commit();
+    }
+  }
+  storage_destroy();
+
+  run(image, "default", 0);
+  run(image, "populate", BLOCKS_MAP_POPULATE);
+  run(image, "hugepages", BLOCKS_MAP_HUGEPAGE);
+  run(image, "access=random", BLOCKS_MAP_RANDOM);
+  run(image, "access=sequential", BLOCKS_MAP_SEQUENTIAL);
+  run(image, "populate,hugepages", BLOCKS_MAP_POPULATE | BLOCKS_MAP_HUGEPAGE);
+  unlink(image);
+  return 0;
+}
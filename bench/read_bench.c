@@ -0,0 +1,164 @@
+/**
+ * @file read_bench.c
+ *
+ * Throughput of the two ways nufs can hand file data to FUSE.
+ *
+ * "copy" is the read path: storage_read_fh() copies the data into a buffer,
+ * which is then written to the reply channel. "splice" is the read_buf path:
+ * storage_map_fh() locates the extents in the image and the kernel moves the
+ * page cache pages into the channel without a user-space copy. A pipe drained
+ * by a second thread stands in for /dev/fuse.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "storage.h"
+
+#define FILE_SIZE (256L << 20)
+#define CHUNK (128 << 10) // FUSE's default max_read
+#define ROUNDS 4
+
+static int pipe_fds[2];
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Discard everything written to the pipe, the way the kernel consumes
+// replies on /dev/fuse.
+static void *drain(void *arg) {
+  int null = open("/dev/null", O_WRONLY);
+  while (splice(pipe_fds[0], 0, null, 0, CHUNK, SPLICE_F_MOVE) > 0) {
+  }
+  close(null);
+  return 0;
+}
+
+// Write a whole buffer to the pipe.
+static void send_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(pipe_fds[1], buf, len);
+    if (n <= 0) {
+      perror("write");
+      exit(1);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+// Splice a range of the image to the pipe.
+static void splice_all(int fd, off_t pos, size_t len) {
+  while (len > 0) {
+    ssize_t n = splice(fd, &pos, pipe_fds[1], 0, len, SPLICE_F_MOVE);
+    if (n <= 0) {
+      perror("splice");
+      exit(1);
+    }
+    len -= n;
+  }
+}
+
+// Send the whole file through the read path.
+static void read_copy(storage_file_t *fh) {
+  static char buf[CHUNK];
+  for (off_t off = 0; off < FILE_SIZE; off += CHUNK) {
+    int n = storage_read_fh(fh, buf, CHUNK, off);
+    send_all(buf, n);
+  }
+}
+
+// Send the whole file through the read_buf path.
+static void read_splice(storage_file_t *fh) {
+  static storage_run_t runs[STORAGE_MAP_RUNS(CHUNK)];
+  static char zeros[CHUNK];
+  for (off_t off = 0; off < FILE_SIZE; off += CHUNK) {
+    int count = storage_map_fh(fh, CHUNK, off, runs, STORAGE_MAP_RUNS(CHUNK));
+    for (int ii = 0; ii < count; ++ii) {
+      if (runs[ii].pos >= 0) {
+        splice_all(blocks_get_fd(), runs[ii].pos, runs[ii].len);
+      } else {
+        send_all(runs[ii].data ? runs[ii].data : zeros, runs[ii].len);
+      }
+    }
+    storage_map_end(fh);
+  }
+}
+
+// Time ROUNDS passes over the file and print the throughput.
+static double run(const char *label, void (*pass)(storage_file_t *),
+                  storage_file_t *fh) {
+  double t0 = now();
+  for (int ii = 0; ii < ROUNDS; ++ii) {
+    pass(fh);
+  }
+  double mbs = (double) FILE_SIZE * ROUNDS / (1 << 20) / (now() - t0);
+  printf("%-8s %8.0f MB/s\n", label, mbs);
+  return mbs;
+}
+
+int main(int argc, char **argv) {
+  const char *image = argc > 1 ? argv[1] : "read_bench.nufs";
+  unlink(image);
+  if (storage_init(image, FILE_SIZE + (64 << 20), 0) < 0) {
+    return 1;
+  }
+
+  storage_file_t *fh;
+  storage_mknod("/data", 0100644);
+  storage_open("/data", &fh);
+  static char buf[CHUNK];
+  for (off_t off = 0; off < FILE_SIZE; off += CHUNK) {
+    memset(buf, off / CHUNK, CHUNK);
+    storage_write_fh(fh, buf, CHUNK, off);
+  }
+  // only committed blocks can be spliced from the image
+  journal_commit();
+
+  // both paths must see the same bytes
+  storage_run_t runs[STORAGE_MAP_RUNS(CHUNK)];
+  static char check[CHUNK];
+  off_t off = FILE_SIZE / 2 + 12345;
+  int n = storage_read_fh(fh, buf, CHUNK, off);
+  int count = storage_map_fh(fh, CHUNK, off, runs, STORAGE_MAP_RUNS(CHUNK));
+  size_t got = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    got += pread(blocks_get_fd(), check + got, runs[ii].len, runs[ii].pos);
+  }
+  storage_map_end(fh);
+  if (got != n || memcmp(buf, check, n)) {
+    fprintf(stderr, "read and read_buf paths disagree\n");
+    return 1;
+  }
+
+  if (pipe(pipe_fds) < 0) {
+    perror("pipe");
+    return 1;
+  }
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, CHUNK);
+  pthread_t drainer;
+  pthread_create(&drainer, 0, drain, 0);
+
+  printf("%ld MB file read %d times in %d KB requests\n", FILE_SIZE >> 20,
+         ROUNDS, CHUNK >> 10);
+  double copy = run("copy", read_copy, fh);
+  double spliced = run("splice", read_splice, fh);
+  printf("read_buf speedup %.2fx\n", spliced / copy);
+
+  close(pipe_fds[1]);
+  pthread_join(drainer, 0);
+  storage_release(fh);
+  storage_destroy();
+  unlink(image);
+  return 0;
+}
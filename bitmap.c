@@ -8,6 +8,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "bitmap.h"
 
 #define nth_bit_mask(n) (1 << (n))
@@ -35,6 +39,88 @@ void bitmap_put(void *bm, int i, int v) {
   }
 }
 
+// Return the index of the first word at or after wi that differs from fill,
+// or nwords if every remaining word equals it.
+static int skip_words(const uint64_t *words, int wi, int nwords,
+                      uint64_t fill) {
+  while (wi < nwords && words[wi] == fill) {
+    wi++;
+  }
+  return wi;
+}
+
+#if defined(__x86_64__)
+// Same as skip_words, but compares 256 bits at a time.
+__attribute__((target("avx2")))
+static int skip_words_avx2(const uint64_t *words, int wi, int nwords,
+                           uint64_t fill) {
+  const __m256i pattern = _mm256_set1_epi64x(fill);
+  while (wi + 4 <= nwords) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (words + wi));
+    __m256i diff = _mm256_xor_si256(v, pattern);
+    if (!_mm256_testz_si256(diff, diff)) {
+      break;
+    }
+    wi += 4;
+  }
+  return skip_words(words, wi, nwords, fill);
+}
+#endif
+
+static int (*skip)(const uint64_t *, int, int, uint64_t) = skip_words;
+
+// Pick the widest word skip the CPU supports. Runs as the program loads,
+// before any thread can be scanning a bitmap, so skip never changes under
+// one.
+__attribute__((constructor)) static void pick_skip() {
+  skip = skip_words;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    skip = skip_words_avx2;
+  }
+#endif
+}
+
+// Find the first bit at or after start that differs from the bits of flip
+// (all ones to look for a 0, all zeros to look for a 1).
+// Bit i lives in byte i / 8, so on a little-endian machine it is also bit
+// i % 64 of 64-bit word i / 64.
+static int next_bit(void *bm, int size, int start, uint64_t flip) {
+  const uint64_t *words = (const uint64_t *) bm;
+  int nwords = (size + 63) / 64;
+
+  if (start < 0) {
+    start = 0;
+  }
+  if (start >= size) {
+    return -1;
+  }
+
+  int wi = start / 64;
+  uint64_t found = (words[wi] ^ flip) & (UINT64_MAX << (start % 64));
+  while (!found) {
+    wi = skip(words, wi + 1, nwords, flip);
+    if (wi >= nwords) {
+      return -1;
+    }
+    found = words[wi] ^ flip;
+  }
+
+  int i = wi * 64 + __builtin_ctzll(found);
+  return i < size ? i : -1;
+}
+
+// Find the first clear bit at or after start.
+int bitmap_next_zero(void *bm, int size, int start) {
+  return next_bit(bm, size, start, UINT64_MAX);
+}
+
+// Find the first set bit at or after start.
+int bitmap_next_one(void *bm, int size, int start) {
+  return next_bit(bm, size, start, 0);
+}
+
 // Pretty-print the bitmap (with the given no. of bits).
 void bitmap_print(void *bm, int size) {
   for (int i = 0; i < size; i++) {
@@ -27,6 +27,34 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Find the first clear bit at or after the given index.
+ *
+ * The bitmap is scanned a 64-bit word at a time (using AVX2 to skip runs of
+ * full words where the CPU supports it), so a nearly-full bitmap costs about
+ * one instruction per 64 or 256 allocated bits rather than one per bit.
+ *
+ * @param bm Pointer to the start of the bitmap, 8-byte aligned.
+ * @param size The number of bits in the bitmap.
+ * @param start The first bit index to consider.
+ *
+ * @return The index of the first clear bit >= start, or -1 if there is none.
+ */
+int bitmap_next_zero(void *bm, int size, int start);
+
+/**
+ * Find the first set bit at or after the given index.
+ *
+ * Scans the same way as bitmap_next_zero(), skipping empty words.
+ *
+ * @param bm Pointer to the start of the bitmap, 8-byte aligned.
+ * @param size The number of bits in the bitmap.
+ * @param start The first bit index to consider.
+ *
+ * @return The index of the first set bit >= start, or -1 if there is none.
+ */
+int bitmap_next_one(void *bm, int size, int start);
+
 /**
  * Pretty-print a bitmap. 
  *
@@ -11,8 +11,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -20,16 +22,116 @@
 
 #include "blocks.h"
 #include "directory.h"
+#include "inode.h"
+#include "io.h"
+#include "journal.h"
 
 #include "bitmap.h"
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
+static size_t blocks_size = 0;
+
+// first block of the inode bitmap and table being served (0 for the live
+// ones), see blocks_view_inodes()
+static uint32_t inode_view = 0;
+
+// Bounded cache of data blocks (see blocks_set_cache()). A data block is
+// resident from the first time it is handed out until a sweep or a commit
+// drops it; referenced marks the ones used since the sweep last passed.
+static uint64_t *resident = 0;
+static uint64_t *referenced = 0;
+static int cache_limit = 0;    // most resident blocks, 0 for no bound
+static int resident_count = 0;
+static int clock_hand = 0;     // where the next sweep starts
+static int trim_wanted = 0;    // the committer was asked for a sweep
+
+// in-memory state of each block group
+typedef struct group {
+  pthread_mutex_t lock; // guards the group's bits of the bitmap and entries
+                        // of the share table, and the fields below
+  int hint;             // no block of the group below this one is free
+  int free;             // free blocks in the group; read without the lock
+  int longest;          // no free run in the group is longer; read without
+                        // the lock
+} group_t;
+
+static group_t *groups = 0;
+static int group_count = 0;
+
+// blocks freed since the last commit, still marked used in the bitmap: the
+// committed image may still point at them, so they can't be handed out
+// until the commit that frees them (see blocks_release_freed())
+static uint64_t *freeing = 0;
+static int freeing_count = 0;
+
+// blocks the last commit freed, free on disk but still marked used in
+// memory until the next one: a read may have looked them up just before
+// they were freed and still be sending them out of the image file
+static uint64_t *held = 0;
+static int held_count = 0;
+
+// Get the first block of a group.
+static int group_start(int group) { return group * BLOCKS_PER_GROUP; }
+
+// Get the block just past the end of a group.
+static int group_end(int group) {
+  int total = get_superblock()->block_count;
+  int end = group_start(group) + BLOCKS_PER_GROUP;
+  return end < total ? end : total;
+}
+
+// Drop the block groups of the image being closed.
+static void groups_free() {
+  for (int ii = 0; ii < group_count; ++ii) {
+    pthread_mutex_destroy(&groups[ii].lock);
+  }
+  free(groups);
+  free(freeing);
+  free(held);
+  groups = 0;
+  group_count = 0;
+  freeing = 0;
+  freeing_count = 0;
+  held = 0;
+  held_count = 0;
+}
+
+// Set up the block groups of the mapped image, counting their free blocks.
+// Returns 0, or -1 if out of memory.
+static int groups_init() {
+  groups_free();
+  int count = (get_superblock()->block_count + BLOCKS_PER_GROUP - 1) /
+              BLOCKS_PER_GROUP;
+  groups = calloc(count, sizeof(group_t));
+  freeing = calloc((get_superblock()->block_count + 63) / 64, sizeof(uint64_t));
+  held = calloc((get_superblock()->block_count + 63) / 64, sizeof(uint64_t));
+  if (!groups || !freeing || !held) {
+    groups_free();
+    return -1;
+  }
+  group_count = count;
+
+  void *bbm = get_blocks_bitmap();
+  for (int gg = 0; gg < count; ++gg) {
+    group_t *group = &groups[gg];
+    pthread_mutex_init(&group->lock, 0);
+    int end = group_end(gg);
+    group->hint = group_start(gg);
+    group->longest = end - group->hint;
+    for (int bnum = bitmap_next_zero(bbm, end, group->hint); bnum >= 0;) {
+      int used = bitmap_next_one(bbm, end, bnum);
+      group->free += (used < 0 ? end : used) - bnum;
+      bnum = used < 0 ? -1 : bitmap_next_zero(bbm, end, used);
+    }
+  }
+  return 0;
+}
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
-  int rem = bytes % BLOCK_SIZE;
+size_t bytes_to_blocks(size_t bytes) {
+  size_t quo = bytes / BLOCK_SIZE;
+  size_t rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
     return quo;
   } else {
@@ -38,72 +140,725 @@ int bytes_to_blocks(int bytes) {
 }
 
 // Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
+int blocks_init(const char *image_path, size_t size, int inode_count) {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+  if (blocks_fd == -1) {
+    perror(image_path);
+    return -1;
+  }
+  // synchronous until storage_start() sets up the ring
+  io_init(blocks_fd, 0);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
 
-  // map the image to memory
+  // an empty image gets formatted, anything else must already be one of ours
+  int fresh = st.st_size == 0;
+  if (fresh) {
+    if (size == 0) {
+      size = NUFS_DEFAULT_SIZE;
+    }
+    size -= size % BLOCK_SIZE;
+    rv = ftruncate(blocks_fd, size);
+    assert(rv == 0);
+  } else {
+    size = st.st_size - st.st_size % BLOCK_SIZE;
+  }
+
+  // map the image to memory; privately, so nothing reaches the file
+  // before the journal says so
+  blocks_size = size;
+  inode_view = 0;
   blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+      mmap(0, blocks_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, blocks_fd, 0);
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  directory_init();  
-  bitmap_put(bbm, 0, 1);
+  superblock_t *sb = get_superblock();
+  if (fresh) {
+    rv = blocks_format(size / BLOCK_SIZE, inode_count);
+    if (rv == 0) {
+      journal_format();
+    }
+  } else if (sb->magic != NUFS_MAGIC || sb->version != NUFS_VERSION ||
+             sb->block_size != BLOCK_SIZE ||
+             (size_t) sb->block_count * BLOCK_SIZE > blocks_size) {
+    fprintf(stderr, "%s: not a nufs image (or unsupported version)\n",
+            image_path);
+    rv = -1;
+  }
+  if (rv == 0) {
+    rv = journal_open();
+  }
+  // after the journal is replayed, which may change the bitmap
+  if (rv == 0) {
+    rv = groups_init();
+  }
+  if (rv == 0) {
+    rv = inode_init();
+  }
+  if (rv != 0) {
+    blocks_free();
+    return -1;
+  }
+
+  // a new image is written out by the first commit
+  if (fresh) {
+    journal_dirty(sb, (size_t) sb->journal_start * BLOCK_SIZE, 1);
+  }
+  if (directory_init() < 0) {
+    fprintf(stderr, "%s: no room for the root directory\n", image_path);
+    blocks_free();
+    return -1;
+  }
+  return 0;
 }
 
+// Lay out a superblock, bitmaps and inode table for the given geometry.
+int blocks_format(int block_count, int inode_count) {
+  if (inode_count <= 0) {
+    inode_count = (size_t) block_count * BLOCK_SIZE / NUFS_BYTES_PER_INODE;
+  }
+
+  superblock_t *sb = get_superblock();
+  memset(sb, 0, BLOCK_SIZE);
+  sb->block_size = BLOCK_SIZE;
+  sb->block_count = block_count;
+  sb->inode_count = inode_count;
+
+  // block 0 holds the superblock, the rest of the metadata follows it
+  sb->block_bitmap_start = 1;
+  sb->block_bitmap_blocks = bytes_to_blocks(((size_t) block_count + 7) / 8);
+  sb->share_table_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+  sb->share_table_blocks =
+      bytes_to_blocks((size_t) block_count * sizeof(uint16_t));
+  sb->inode_bitmap_start = sb->share_table_start + sb->share_table_blocks;
+  sb->inode_bitmap_blocks = bytes_to_blocks(((size_t) inode_count + 7) / 8);
+  sb->inode_table_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+  sb->inode_table_blocks =
+      bytes_to_blocks((size_t) inode_count * sizeof(inode_t));
+  sb->journal_start = sb->inode_table_start + sb->inode_table_blocks;
+  sb->journal_blocks = block_count / NUFS_JOURNAL_FRACTION;
+  if (sb->journal_blocks < NUFS_JOURNAL_MIN) {
+    sb->journal_blocks = NUFS_JOURNAL_MIN;
+  }
+  if (sb->journal_blocks > NUFS_JOURNAL_MAX) {
+    sb->journal_blocks = NUFS_JOURNAL_MAX;
+  }
+  sb->data_start = sb->journal_start + sb->journal_blocks;
+
+  if (inode_count < 2 || sb->data_start + 1 >= block_count) {
+    fprintf(stderr, "image too small: %d blocks, %d inodes\n", block_count,
+            inode_count);
+    return -1;
+  }
+
+  // start from empty bitmaps, no shares and an empty inode table (the
+  // journal region is written directly by journal_format())
+  memset(blocks_get_block(sb->block_bitmap_start), 0,
+         (size_t) (sb->journal_start - sb->block_bitmap_start) * BLOCK_SIZE);
+
+  // the metadata blocks themselves are never handed out
+  void *bbm = get_blocks_bitmap();
+  for (int ii = 0; ii < sb->data_start; ++ii) {
+    bitmap_put(bbm, ii, 1);
+  }
+
+  sb->free_blocks = block_count - sb->data_start;
+  sb->free_inodes = inode_count - 1; // inode 0 is never handed out
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  return 0;
+}
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  blocks_set_cache(0);
+  groups_free();
+  io_free();
+  int rv = munmap(blocks_base, blocks_size);
   assert(rv == 0);
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_base = 0;
+  blocks_size = 0;
+}
+
+// Bound the memory holding file data.
+int blocks_set_cache(size_t bytes) {
+  free(resident);
+  free(referenced);
+  resident = 0;
+  referenced = 0;
+  cache_limit = 0;
+  resident_count = 0;
+  clock_hand = 0;
+  trim_wanted = 0;
+  if (!bytes) {
+    return 0;
+  }
+
+  int words = (get_superblock()->block_count + 63) / 64;
+  resident = calloc(words, sizeof(uint64_t));
+  referenced = calloc(words, sizeof(uint64_t));
+  if (!resident || !referenced) {
+    blocks_set_cache(0);
+    return -1;
+  }
+  size_t limit = bytes / BLOCK_SIZE;
+  cache_limit = limit > 1 ? (limit < INT32_MAX ? limit : INT32_MAX) : 1;
+  return 0;
+}
+
+// Check a bit in a shared bitmap.
+static int test_bit(uint64_t *bits, int bnum) {
+  uint64_t word = __atomic_load_n(&bits[bnum / 64], __ATOMIC_RELAXED);
+  return (word >> (bnum % 64)) & 1;
+}
+
+// Set a bit in a shared bitmap, returning whether it was clear. Skips the
+// atomic update when it is already set, which is the common case.
+static int set_bit(uint64_t *bits, int bnum) {
+  uint64_t bit = 1ull << (bnum % 64);
+  if (__atomic_load_n(&bits[bnum / 64], __ATOMIC_RELAXED) & bit) {
+    return 0;
+  }
+  return !(__atomic_fetch_or(&bits[bnum / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// Clear a bit in a shared bitmap, returning whether it was set.
+static int clear_bit(uint64_t *bits, int bnum) {
+  uint64_t bit = 1ull << (bnum % 64);
+  return !!(__atomic_fetch_and(&bits[bnum / 64], ~bit, __ATOMIC_RELAXED) &
+            bit);
+}
+
+// Count a run of blocks as used by the cache, asking for a sweep once it
+// holds more than its bound.
+static void cache_use(int bnum, int count) {
+  int start = get_superblock()->data_start;
+  for (int ii = bnum < start ? start : bnum; ii < bnum + count; ++ii) {
+    set_bit(referenced, ii);
+    if (set_bit(resident, ii) &&
+        __atomic_add_fetch(&resident_count, 1, __ATOMIC_RELAXED) >
+            cache_limit &&
+        !__atomic_exchange_n(&trim_wanted, 1, __ATOMIC_RELAXED)) {
+      journal_wake();
+    }
+  }
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) { return blocks_get_blocks(bnum, 1); }
+
+// Get a run of blocks, returning a pointer to the start of the first.
+void *blocks_get_blocks(int bnum, int count) {
+  if (cache_limit) {
+    cache_use(bnum, count);
+  }
+  return blocks_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+// Tune how the image is mapped in.
+int blocks_set_mapping(int flags) {
+  superblock_t *sb = get_superblock();
+  int rv = 0;
+  if ((flags & BLOCKS_MAP_HUGEPAGE) &&
+      madvise(blocks_base, blocks_size, MADV_HUGEPAGE) < 0) {
+    perror("blocks: huge pages");
+    rv = -1;
+  }
+
+  int advice = MADV_NORMAL;
+  if (flags & BLOCKS_MAP_RANDOM) {
+    advice = MADV_RANDOM;
+  } else if (flags & BLOCKS_MAP_SEQUENTIAL) {
+    advice = MADV_SEQUENTIAL;
+  }
+  size_t start = (size_t) sb->data_start * BLOCK_SIZE;
+  if (madvise(blocks_base + start, blocks_size - start, advice) < 0) {
+    perror("blocks: access pattern");
+    rv = -1;
+  }
+
+  if (flags & BLOCKS_MAP_POPULATE) {
+    // the mapping already exists, so MAP_POPULATE is out; this does the
+    // same for just the metadata, without copying it privately
+    size_t len = (size_t) sb->journal_start * BLOCK_SIZE;
+#ifdef MADV_POPULATE_READ
+    if (madvise(blocks_base, len, MADV_POPULATE_READ) == 0) {
+      return rv;
+    }
+#endif
+    // older kernels: at least read it into the page cache
+    madvise(blocks_base, len, MADV_WILLNEED);
+  }
+  return rv;
+}
+
+// Start reading a run of blocks in the background.
+void blocks_prefetch(int bnum, int count) {
+  madvise(blocks_base + (size_t) BLOCK_SIZE * bnum, (size_t) count * BLOCK_SIZE,
+          MADV_WILLNEED);
+}
+
+// Drop the in-memory copies of a run of blocks whose changes are committed.
+void blocks_evict(int bnum, int count) {
+  madvise(blocks_base + (size_t) BLOCK_SIZE * bnum, (size_t) count * BLOCK_SIZE,
+          MADV_DONTNEED);
+  if (!cache_limit) {
+    return;
+  }
+  for (int ii = bnum; ii < bnum + count; ++ii) {
+    if (clear_bit(resident, ii)) {
+      __atomic_sub_fetch(&resident_count, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Drop a run of clean blocks picked by a sweep, and their page cache.
+static void trim_run(int bnum, int count) {
+  if (count) {
+    blocks_evict(bnum, count);
+    posix_fadvise(blocks_fd, (off_t) bnum * BLOCK_SIZE,
+                  (off_t) count * BLOCK_SIZE, POSIX_FADV_DONTNEED);
+  }
+}
+
+// Find the first resident block from bnum on, or -1.
+static int next_resident(int bnum, int total) {
+  for (int ii = bnum / 64; ii * 64 < total; ++ii) {
+    uint64_t word = __atomic_load_n(&resident[ii], __ATOMIC_RELAXED);
+    if (ii == bnum / 64) {
+      word &= ~0ull << (bnum % 64);
+    }
+    if (word) {
+      int found = ii * 64 + __builtin_ctzll(word);
+      return found < total ? found : -1;
+    }
+  }
+  return -1;
+}
+
+// Shrink the cache back to its bound with a CLOCK sweep.
+void blocks_trim() {
+  __atomic_store_n(&trim_wanted, 0, __ATOMIC_RELAXED);
+  if (!cache_limit ||
+      __atomic_load_n(&resident_count, __ATOMIC_RELAXED) <= cache_limit) {
+    return;
+  }
+
+  // down to 7/8 of the bound, so the next sweep isn't due right away
+  int target = cache_limit - cache_limit / 8;
+  int start = get_superblock()->data_start;
+  int total = get_superblock()->block_count;
+  if (clock_hand < start) {
+    clock_hand = start;
+  }
+  int run = 0;
+  int len = 0; // blocks picked in [run, run + len), not yet dropped
+  // at most two laps: the first may only clear reference bits
+  for (int64_t left = 2 * (int64_t) (total - start);
+       left > 0 &&
+       __atomic_load_n(&resident_count, __ATOMIC_RELAXED) - len > target;) {
+    int bnum = next_resident(clock_hand, total);
+    if (bnum < 0) {
+      left -= total - clock_hand;
+      clock_hand = start;
+      continue;
+    }
+    left -= bnum - clock_hand + 1;
+    clock_hand = bnum + 1;
+    if (clear_bit(referenced, bnum) || journal_is_dirty(bnum)) {
+      continue;
+    }
+    if (len && run + len != bnum) {
+      trim_run(run, len);
+      len = 0;
+    }
+    if (!len) {
+      run = bnum;
+    }
+    len++;
+  }
+  trim_run(run, len);
+}
+
+// Return a pointer to the superblock.
+superblock_t *get_superblock() { return (superblock_t *) blocks_base; }
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+// The size is block_count / 8 bytes, rounded up to whole blocks.
+void *get_blocks_bitmap() {
+  return blocks_get_block(get_superblock()->block_bitmap_start);
+}
+
+// Return a pointer to the beginning of the share table.
+uint16_t *get_share_table() {
+  return blocks_get_block(get_superblock()->share_table_start);
+}
 
 // Return a pointer to the beginning of the inode bitmap.
 void *get_inode_bitmap() {
-  void *block = blocks_get_block(0);
-
-  // The inode bitmap is stored immediately after the block bitmap
-  return block + BLOCK_BITMAP_SIZE;
+  if (inode_view) {
+    return blocks_get_block(inode_view);
+  }
+  return blocks_get_block(get_superblock()->inode_bitmap_start);
 }
 
-// Return a pointer to the beginning of the inode table bitmap.
+// Return a pointer to the beginning of the inode table.
 void *get_inode_table() {
-  void *block = blocks_get_block(0);
+  superblock_t *sb = get_superblock();
+  if (inode_view) {
+    return blocks_get_block(inode_view + sb->inode_bitmap_blocks);
+  }
+  return blocks_get_block(sb->inode_table_start);
+}
+
+// Serve the inode bitmap and table from a frozen copy of them.
+void blocks_view_inodes(uint32_t start) { inode_view = start; }
+
+// Get the file descriptor of the open image.
+int blocks_get_fd() { return blocks_fd; }
+
+// Add delta to the superblock's count of free blocks.
+static void count_free_blocks(int delta) {
+  superblock_t *sb = get_superblock();
+  __atomic_fetch_add(&sb->free_blocks, delta, __ATOMIC_RELAXED);
+  journal_dirty(&sb->free_blocks, sizeof(sb->free_blocks), 1);
+}
 
-  // The inode table is stored immediately after the inode bitmap and the block bitmap
-  return block + BLOCK_BITMAP_SIZE + INODE_BITMAP_SIZE;
+// Get the number of block groups.
+int blocks_group_count() { return group_count; }
+
+// Get the number of free blocks in a group.
+int blocks_group_free(int group) {
+  return __atomic_load_n(&groups[group].free, __ATOMIC_RELAXED);
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
+  int got;
+  return alloc_blocks(0, 1, &got);
+}
+
+// Find where to allocate up to count blocks in a locked group: at goal if
+// that block is free, else the first free run that is long enough, or the
+// longest one. Sets *len to the length of the run found (within the group).
+// Returns -1 if the group is full.
+static int find_run(int gg, int goal, int count, int *len) {
   void *bbm = get_blocks_bitmap();
+  group_t *group = &groups[gg];
+  int end = group_end(gg);
+  if (goal > group_start(gg) && goal < end && !bitmap_get(bbm, goal)) {
+    int used = bitmap_next_one(bbm, end, goal);
+    *len = (used < 0 ? end : used) - goal;
+    return goal;
+  }
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      return ii;
+  int best = -1;
+  *len = 0;
+  int start = bitmap_next_zero(bbm, end, group->hint);
+  if (start >= 0) {
+    group->hint = start;
+  }
+  while (start >= 0) {
+    int used = bitmap_next_one(bbm, end, start);
+    int run = (used < 0 ? end : used) - start;
+    if (run >= count) {
+      *len = run;
+      return start;
+    }
+    if (run > *len) {
+      best = start;
+      *len = run;
     }
+    start = used < 0 ? -1 : bitmap_next_zero(bbm, end, used);
+  }
+  // every run was looked at, so this bound is exact for now
+  __atomic_store_n(&group->longest, *len, __ATOMIC_RELAXED);
+  return best;
+}
+
+// Mark up to count free blocks from start as allocated, going on into the
+// groups after gg while the run does. Called with gg locked; unlocks every
+// group it locked. Returns the number of blocks taken.
+static int take_run(int gg, int start, int count) {
+  void *bbm = get_blocks_bitmap();
+  int taken = 0;
+  for (;;) {
+    group_t *group = &groups[gg];
+    int from = start + taken;
+    int end = group_end(gg);
+    int used = bitmap_next_one(bbm, end, from);
+    int len = (used < 0 ? end : used) - from;
+    len = len < count - taken ? len : count - taken;
+    if (len > 0) {
+      for (int ii = from; ii < from + len; ++ii) {
+        bitmap_put(bbm, ii, 1);
+      }
+      journal_dirty((char *) bbm + from / 8, (from + len - 1) / 8 - from / 8 + 1,
+                    1);
+      __atomic_fetch_sub(&group->free, len, __ATOMIC_RELAXED);
+      count_free_blocks(-len);
+      if (from == group->hint) {
+        group->hint = from + len;
+      }
+      taken += len;
+    }
+
+    // groups are only ever locked in ascending order, so holding this one
+    // while waiting for the next can't deadlock
+    int more = taken < count && start + taken == end && gg + 1 < group_count;
+    if (more) {
+      pthread_mutex_lock(&groups[gg + 1].lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+    if (!more) {
+      return taken;
+    }
+    gg++;
+  }
+}
+
+// Allocate a run of up to count contiguous blocks, preferably at goal.
+int alloc_blocks(int goal, int count, int *got) {
+  int total = get_superblock()->block_count;
+  int first = goal > 0 && goal < total ? goal / BLOCKS_PER_GROUP : 0;
+
+  // a run of the full length in any group beats a shorter one nearby, so
+  // every group is searched for one first (but goal itself is taken, which
+  // keeps a file in one piece)
+  int want = count < BLOCKS_PER_GROUP ? count : BLOCKS_PER_GROUP;
+  int best = -1;
+  int best_len = 0;
+  for (int ii = 0; ii < group_count; ++ii) {
+    int gg = (first + ii) % group_count;
+    group_t *group = &groups[gg];
+    if (!blocks_group_free(gg)) {
+      continue;
+    }
+    int len = __atomic_load_n(&group->longest, __ATOMIC_RELAXED);
+    if (ii > 0 && len < want) {
+      if (len > best_len) {
+        best = gg;
+        best_len = len;
+      }
+      continue;
+    }
+    pthread_mutex_lock(&group->lock);
+    int start = find_run(gg, ii == 0 ? goal : 0, count, &len);
+    if (start >= 0 && (start == goal || len >= want)) {
+      *got = take_run(gg, start, count);
+      return start;
+    }
+    pthread_mutex_unlock(&group->lock);
+    if (len > best_len) {
+      best = gg;
+      best_len = len;
+    }
+  }
+
+  // settle for the longest run seen, or any at all if it has gone since
+  for (int ii = -1; ii < group_count; ++ii) {
+    int gg = ii < 0 ? best : (first + ii) % group_count;
+    if (gg < 0 || !blocks_group_free(gg)) {
+      continue;
+    }
+    pthread_mutex_lock(&groups[gg].lock);
+    int len;
+    int start = find_run(gg, 0, count, &len);
+    if (start >= 0) {
+      *got = take_run(gg, start, count);
+      return start;
+    }
+    pthread_mutex_unlock(&groups[gg].lock);
+  }
+  // blocks waiting for a commit to free them come back sooner
+  if (__atomic_load_n(&freeing_count, __ATOMIC_RELAXED) ||
+      __atomic_load_n(&held_count, __ATOMIC_RELAXED)) {
+    journal_wake();
   }
   return -1;
 }
 
-// Deallocate the block with the given index.
-void free_block(int bnum) {
+// Mark a run of blocks free or used in the bitmap, keeping the group and
+// superblock counts in step.
+static void put_run(int bnum, int count, int used) {
+  void *bbm = get_blocks_bitmap();
+  int end = bnum + count;
+  while (bnum < end) {
+    int gg = bnum / BLOCKS_PER_GROUP;
+    int stop = end < group_end(gg) ? end : group_end(gg);
+    group_t *group = &groups[gg];
+    pthread_mutex_lock(&group->lock);
+    for (int ii = bnum; ii < stop; ++ii) {
+      bitmap_put(bbm, ii, used);
+    }
+    journal_dirty((char *) bbm + bnum / 8, (stop - 1) / 8 - bnum / 8 + 1, 1);
+    int delta = used ? bnum - stop : stop - bnum;
+    __atomic_fetch_add(&group->free, delta, __ATOMIC_RELAXED);
+    count_free_blocks(delta);
+    if (!used && bnum < group->hint) {
+      group->hint = bnum;
+    }
+    if (!used) {
+      // the blocks may join runs on either side
+      __atomic_store_n(&group->longest, group_end(gg) - group_start(gg),
+                       __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&group->lock);
+    bnum = stop;
+  }
+}
+
+// Keep a run of blocks that have no other owner until the commit that
+// frees them. Their contents are left as they are: blocks are zeroed when
+// they are mapped into a file again (see inode_map()).
+static void release_blocks(int bnum, int count) {
+  for (int ii = bnum; ii < bnum + count; ++ii) {
+    if (set_bit(freeing, ii)) {
+      __atomic_fetch_add(&freeing_count, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Call put_run() for each run of blocks set in bits.
+static void put_bits(uint64_t *bits, int used) {
+  int total = get_superblock()->block_count;
+  for (int bnum = 0; bnum < total; ++bnum) {
+    if (!test_bit(bits, bnum)) {
+      continue;
+    }
+    int end = bnum + 1;
+    while (end < total && test_bit(bits, end)) {
+      end++;
+    }
+    put_run(bnum, end - bnum, used);
+    bnum = end;
+  }
+}
+
+// Mark the blocks freed since the last commit, and those held since the
+// one before it, free in the bitmap.
+void blocks_release_freed() {
+  if (held_count) {
+    put_bits(held, 0);
+  }
+  if (freeing_count) {
+    put_bits(freeing, 0);
+  }
+}
+
+// Finish with the blocks blocks_release_freed() marked free.
+void blocks_settle_freed(int committed) {
+  if (!committed) {
+    // back to used, to be freed by the next commit that gets through
+    if (held_count) {
+      put_bits(held, 1);
+    }
+    if (freeing_count) {
+      put_bits(freeing, 1);
+    }
+    return;
+  }
+  // the held blocks can be handed out now; the ones just freed are held in
+  // their place, used in memory only, as the next commit frees them again
+  // before it writes the bitmap
+  uint64_t *swap = held;
+  held = freeing;
+  held_count = freeing_count;
+  freeing = swap;
+  memset(freeing, 0,
+         (get_superblock()->block_count + 63) / 64 * sizeof(uint64_t));
+  freeing_count = 0;
+  if (held_count) {
+    put_bits(held, 1);
+  }
+}
+
+// Allocate a run of exactly count blocks from anywhere on the disk.
+int alloc_run(int count) {
+  superblock_t *sb = get_superblock();
+  void *bbm = get_blocks_bitmap();
+  int total = sb->block_count;
+  for (int start = bitmap_next_zero(bbm, total, sb->data_start); start >= 0;) {
+    int used = bitmap_next_one(bbm, total, start);
+    if ((used < 0 ? total : used) - start >= count) {
+      put_run(start, count, 1);
+      return start;
+    }
+    start = used < 0 ? -1 : bitmap_next_zero(bbm, total, used);
+  }
+  return -1;
+}
+
+// Find blocks free both in memory and on disk, leaving them free.
+int blocks_find_unused(uint32_t *list, int count) {
+  superblock_t *sb = get_superblock();
   void *bbm = get_blocks_bitmap();
-  void *block = blocks_get_block(bnum);
-  bitmap_put(bbm, bnum, 0);
-  memset(block, 0, BLOCK_SIZE);
+  int found = 0;
+  for (int bnum = bitmap_next_zero(bbm, sb->block_count, sb->data_start);
+       bnum >= 0 && found < count;
+       bnum = bitmap_next_zero(bbm, sb->block_count, bnum + 1)) {
+    // those being freed by this commit are still in use on disk
+    if (!blocks_freed(bnum)) {
+      list[found++] = bnum;
+    }
+  }
+  return found;
 }
+
+// Check whether a block waits for the next commit to be freed.
+int blocks_freed(int bnum) {
+  return test_bit(freeing, bnum);
+}
+
+// Add an owner to a run of allocated blocks.
+void share_blocks(int bnum, int count) {
+  uint16_t *shares = get_share_table();
+  int end = bnum + count;
+  while (bnum < end) {
+    int gg = bnum / BLOCKS_PER_GROUP;
+    int stop = end < group_end(gg) ? end : group_end(gg);
+    pthread_mutex_lock(&groups[gg].lock);
+    for (int ii = bnum; ii < stop; ++ii) {
+      assert(shares[ii] < UINT16_MAX);
+      __atomic_store_n(&shares[ii], shares[ii] + 1, __ATOMIC_RELAXED);
+    }
+    journal_dirty(shares + bnum, (stop - bnum) * sizeof(uint16_t), 1);
+    pthread_mutex_unlock(&groups[gg].lock);
+    bnum = stop;
+  }
+}
+
+// Get the number of owners a block has beyond the first.
+int block_shares(int bnum) {
+  return __atomic_load_n(&get_share_table()[bnum], __ATOMIC_RELAXED);
+}
+
+// Deallocate a run of contiguous blocks; shared ones just lose an owner.
+void free_blocks(int bnum, int count) {
+  uint16_t *shares = get_share_table();
+  int end = bnum + count;
+  while (bnum < end) {
+    int gg = bnum / BLOCKS_PER_GROUP;
+    int stop = end < group_end(gg) ? end : group_end(gg);
+    // two files sharing a block may let go of it at once, so the count is
+    // tested and dropped in one step
+    pthread_mutex_lock(&groups[gg].lock);
+    for (int ii = bnum; ii < stop; ++ii) {
+      if (!shares[ii]) {
+        release_blocks(ii, 1);
+        continue;
+      }
+      __atomic_store_n(&shares[ii], shares[ii] - 1, __ATOMIC_RELAXED);
+      journal_dirty(shares + ii, sizeof(uint16_t), 1);
+    }
+    pthread_mutex_unlock(&groups[gg].lock);
+    bnum = stop;
+  }
+}
+
+// Deallocate the block with the given index.
+void free_block(int bnum) { free_blocks(bnum, 1); }
@@ -4,29 +4,111 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The disk image is mmapped, so block data is accessed using pointers. The
+ * mapping is private: changes reach the image file only when the journal
+ * commits them (see journal.h), and every change must be reported to it
+ * with journal_dirty().
+ *
+ * The allocation functions may be called from several threads at once; the
+ * caller is responsible for serializing access to the blocks themselves.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
-#define BLOCK_COUNT 256 // we split the "disk" into 256 blocks
 #define BLOCK_SIZE 4096 // = 4K
-#define NUFS_SIZE BLOCK_SIZE * BLOCK_COUNT // = 1MB
 
-#define BLOCK_BITMAP_SIZE BLOCK_COUNT / 8
-// Note: assumes block count is divisible by 8
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 6
+
+#define NUFS_DEFAULT_SIZE (64 * 1024 * 1024) // size of a freshly created image
+#define NUFS_BYTES_PER_INODE 16384 // default inode density (one per 16K)
+#define NUFS_JOURNAL_FRACTION 64   // journal gets 1/64 of the image...
+#define NUFS_JOURNAL_MIN 64        // ...but at least this many blocks...
+#define NUFS_JOURNAL_MAX 32768     // ...and at most this many (128MB)
+#define BLOCKS_PER_GROUP 8192      // blocks per allocation group (32MB)
 
-#define INODE_BITMAP_SIZE INODE_COUNT / 8
+// how the image is mapped in (see blocks_set_mapping())
+#define BLOCKS_MAP_POPULATE 1   // fault the metadata in up front
+#define BLOCKS_MAP_HUGEPAGE 2   // back the mapping with huge pages
+#define BLOCKS_MAP_RANDOM 4     // file data is read at random...
+#define BLOCKS_MAP_SEQUENTIAL 8 // ...or front to back
+
+/**
+ * The on-disk superblock, stored at the start of block 0.
+ *
+ * Records the geometry of the image. The block bitmap, share table, inode
+ * bitmap and inode table each start on a block boundary and span as many
+ * blocks as the geometry requires. The journal region comes next; file data
+ * starts at data_start. The rest of block 0 holds the snapshot table (see
+ * snapshot.h).
+ *
+ * The share table holds a 16-bit count per block of the owners it has
+ * beyond the first, where every file block referring to it counts as one
+ * owner, whether in the live file system or in a snapshot (see snapshot.h
+ * and dedup.h). A block with a nonzero count must be copied before it is
+ * changed.
+ *
+ * The free counts are kept up to date by every allocation, in the same
+ * transaction as the bitmap change, so statfs needn't scan the bitmaps.
+ */
+typedef struct superblock {
+  uint32_t magic;               // NUFS_MAGIC
+  uint32_t version;             // NUFS_VERSION
+  uint32_t block_size;          // bytes per block, must equal BLOCK_SIZE
+  uint32_t block_count;         // total blocks in the image
+  uint32_t inode_count;         // total inodes in the inode table
+  uint32_t block_bitmap_start;  // first block of the block bitmap
+  uint32_t block_bitmap_blocks; // length of the block bitmap in blocks
+  uint32_t share_table_start;   // first block of the share table
+  uint32_t share_table_blocks;  // length of the share table in blocks
+  uint32_t inode_bitmap_start;  // first block of the inode bitmap
+  uint32_t inode_bitmap_blocks; // length of the inode bitmap in blocks
+  uint32_t inode_table_start;   // first block of the inode table
+  uint32_t inode_table_blocks;  // length of the inode table in blocks
+  uint32_t journal_start;       // first block of the journal region
+  uint32_t journal_blocks;      // length of the journal region in blocks
+  uint32_t data_start;          // first block available for data
+  uint32_t free_blocks;         // blocks marked free in the block bitmap
+  uint32_t free_inodes;         // inodes other than 0 marked free
+} superblock_t;
 
+/**
+ * Get the number of blocks needed to store the given number of bytes.
+ *
+ * @param bytes Number of bytes.
+ *
+ * @return The number of blocks.
+ */
+size_t bytes_to_blocks(size_t bytes);
 
 /**
  * Load and initialize the given disk image.
  *
+ * An empty (or new) image file is extended to the given size and formatted.
+ * An existing image is mapped at its current size and its superblock is
+ * validated; the size and inode count arguments are then ignored.
+ *
  * @param image_path Path to the disk image file.
+ * @param size Size in bytes of a new image, or 0 for NUFS_DEFAULT_SIZE.
+ * @param inode_count Inodes in a new image, or 0 to derive from the size.
+ *
+ * @return 0 on success, -1 if the image can't be opened or isn't valid.
+ */
+int blocks_init(const char *image_path, size_t size, int inode_count);
+
+/**
+ * Format the mapped image with a fresh superblock and empty bitmaps.
+ *
+ * @param block_count Number of blocks in the image.
+ * @param inode_count Number of inodes, or 0 to derive from the image size.
+ *
+ * @return 0 on success, -1 if the geometry doesn't fit.
  */
-void blocks_init(const char *image_path);
+int blocks_format(int block_count, int inode_count);
 
 /**
  * Close the disk image.
@@ -42,6 +124,90 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a run of blocks, returning a pointer to the start of the first.
+ *
+ * Blocks are laid out in memory in order, so a run can be used as one
+ * buffer; getting it this way rather than by its first block lets the
+ * cache count all of it (see blocks_set_cache()).
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ *
+ * @return Pointer to the beginning of the run in memory.
+ */
+void *blocks_get_blocks(int bnum, int count);
+
+/**
+ * Bound the memory holding file data.
+ *
+ * The image stays mapped, but only about this much of its data is kept
+ * mapped in. Data blocks count from the first time they are got until they
+ * are dropped again; once there are too many, the next commit sweeps over
+ * them CLOCK-style and drops the ones not used since the last sweep, along
+ * with their page cache. Dropping a block is always safe, even while it is
+ * being read: it reads back from the image file, which holds the same data
+ * since blocks with uncommitted changes are never dropped. Metadata (the
+ * blocks before data_start) stays mapped in.
+ *
+ * @param bytes Most bytes of file data to keep, or 0 for no bound.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int blocks_set_cache(size_t bytes);
+
+/**
+ * Tune how the image is mapped in.
+ *
+ * BLOCKS_MAP_POPULATE maps the metadata before the journal (superblock,
+ * bitmaps, share table and inode table) in right away, so the first lookups
+ * don't each stop for a page fault; blocks the journal later commits fault
+ * in again. BLOCKS_MAP_HUGEPAGE lets the kernel use transparent huge pages
+ * for the mapping, where the file system holding the image supports them.
+ * BLOCKS_MAP_RANDOM and BLOCKS_MAP_SEQUENTIAL tell the kernel how file data
+ * is read, turning its read-around off or up.
+ *
+ * @param flags BLOCKS_MAP_* flags.
+ *
+ * @return 0 on success, -1 if the kernel turned some of it down.
+ */
+int blocks_set_mapping(int flags);
+
+/**
+ * Start reading a run of blocks in the background.
+ *
+ * Getting the blocks afterwards then doesn't wait for the disk.
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_prefetch(int bnum, int count);
+
+/**
+ * Drop the in-memory copies of a run of blocks whose changes are committed.
+ *
+ * They read back from the image file the next time they are used.
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_evict(int bnum, int count);
+
+/**
+ * Shrink the cache back to its bound (see blocks_set_cache()).
+ *
+ * Must be called with every operation shut out, as a commit does, so that
+ * no block is dropped between being changed and being marked dirty.
+ */
+void blocks_trim();
+
+/**
+ * Return a pointer to the superblock.
+ *
+ * @return A pointer to the superblock at the start of block 0.
+ */
+superblock_t *get_superblock();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -49,6 +215,13 @@ void *blocks_get_block(int bnum);
  */
 void *get_blocks_bitmap();
 
+/**
+ * Return a pointer to the beginning of the share table.
+ *
+ * @return A pointer to the count of extra owners of block 0.
+ */
+uint16_t *get_share_table();
+
 /**
  * Return a pointer to the beginning of the inode table bitmap.
  *
@@ -63,6 +236,48 @@ void *get_inode_bitmap();
  */
 void *get_inode_table();
 
+/**
+ * Serve the inode bitmap and table from a frozen copy of them.
+ *
+ * get_inode_bitmap() and get_inode_table() then point into the copy, which
+ * holds the inode bitmap followed by the inode table, laid out as in the
+ * superblock.
+ *
+ * @param start First block of the copy, or 0 for the live bitmap and table.
+ */
+void blocks_view_inodes(uint32_t start);
+
+/**
+ * Get the file descriptor of the open image.
+ *
+ * Block n starts at offset n * BLOCK_SIZE of the file. Reading the file sees
+ * the same data as the mapping, so it can be used to splice blocks out.
+ *
+ * @return The descriptor, or -1 if no image is open.
+ */
+int blocks_get_fd();
+
+/**
+ * Get the number of block groups.
+ *
+ * The blocks are split into groups of BLOCKS_PER_GROUP, each with its own
+ * lock and count of free blocks, so threads allocating in different groups
+ * don't contend. Groups exist only in memory and are rebuilt from the
+ * bitmap on mount.
+ *
+ * @return The number of groups.
+ */
+int blocks_group_count();
+
+/**
+ * Get the number of free blocks in a group.
+ *
+ * @param group The group.
+ *
+ * @return Its free blocks, as of some recent moment.
+ */
+int blocks_group_free(int group);
+
 /**
  * Allocate a new block and return its number.
  *
@@ -72,11 +287,124 @@ void *get_inode_table();
  */
 int alloc_block();
 
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * Starts at goal if that block is free, so a file can keep growing in place.
+ * Otherwise looks for the first free run that is long enough in goal's
+ * group, then in each group after it; only if no group has one does it
+ * settle for the longest run there is. A run may continue past the end of a
+ * group into the next.
+ *
+ * @param goal Preferred first block, or 0 for no preference.
+ * @param count Number of blocks wanted.
+ * @param got Set to the number of blocks actually allocated (<= count).
+ *
+ * @return The first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks(int goal, int count, int *got);
+
+/**
+ * Allocate a run of exactly count contiguous blocks, wherever there is one.
+ *
+ * Unlike alloc_blocks(), searches the whole bitmap, across groups, and
+ * never settles for less. Only with every operation shut out, as taking a
+ * snapshot does.
+ *
+ * @param count Number of blocks wanted.
+ *
+ * @return The first block of the run, or -1 if no free run is that long.
+ */
+int alloc_run(int count);
+
+/**
+ * Add an owner to a run of allocated blocks.
+ *
+ * Each block then stays allocated until free_blocks() has been called for
+ * it once more.
+ *
+ * @param bnum The first block of the run.
+ * @param count Number of blocks in the run.
+ */
+void share_blocks(int bnum, int count);
+
+/**
+ * Check whether a block has more than one owner.
+ *
+ * @param bnum The block to check.
+ *
+ * @return Number of owners beyond the first (0 if it has only one).
+ */
+int block_shares(int bnum);
+
 /**
  * Deallocate the block with the given number.
  *
+ * A shared block only loses an owner; see free_blocks().
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a run of contiguous blocks.
+ *
+ * Blocks that are shared (see share_blocks()) only lose an owner and keep
+ * their contents. The others are only handed out again once the next
+ * commit is durable, since until then the image on disk may still use
+ * them.
+ *
+ * @param bnum The first block to deallocate.
+ * @param count Number of blocks in the run.
+ */
+void free_blocks(int bnum, int count);
+
+/**
+ * Mark the blocks freed since the last commit free in the bitmap.
+ *
+ * Blocks the commit before freed are marked free too: they stay marked
+ * used in memory for one more commit, so a read that looked them up in
+ * the image file before they were freed is done with them by the time
+ * they are handed out again.
+ *
+ * Called by a commit, with every operation shut out, before it collects
+ * the blocks to write; blocks_settle_freed() must follow.
+ */
+void blocks_release_freed();
+
+/**
+ * Finish with the blocks blocks_release_freed() marked free.
+ *
+ * @param committed Nonzero if the commit is durable, so those held since
+ *                  the commit before can be handed out and the ones just
+ *                  freed are held in turn; 0 if it failed, which marks them
+ *                  all used again.
+ */
+void blocks_settle_freed(int committed);
+
+/**
+ * Find blocks that are free both in memory and in the committed image,
+ * without allocating them.
+ *
+ * Only for a commit, with every operation shut out: the blocks stay free,
+ * so they may be handed out as soon as it is done.
+ *
+ * @param list Set to the blocks found, in ascending order.
+ * @param count Number of blocks wanted.
+ *
+ * @return The number of blocks found (<= count).
+ */
+int blocks_find_unused(uint32_t *list, int count);
+
+/**
+ * Check whether a block was freed since the last commit.
+ *
+ * Its contents no longer matter, so a commit doesn't write it.
+ *
+ * @param bnum The block to check.
+ *
+ * @return 1 if it waits for the next commit to be freed, 0 if not.
+ */
+int blocks_freed(int bnum);
+
 #endif
@@ -0,0 +1,135 @@
+/**
+ * @file compress.c
+ *
+ * Cluster compression and the CLOCK cache of decompressed clusters.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+
+#include "lz4.h"
+
+typedef struct cluster {
+  uint32_t start; // first disk block of the compressed extent, 0 if free
+  int referenced; // used since the hand last passed
+  char *data;     // COMPRESS_CLUSTER_BYTES, allocated on first use
+} cluster_t;
+
+static cluster_t clusters[COMPRESS_CACHE];
+static int hand = 0;
+
+// guards everything above
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Empty the cache of decompressed clusters.
+void compress_init() {
+  pthread_mutex_lock(&lock);
+  for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+    clusters[ii].start = 0;
+    clusters[ii].referenced = 0;
+  }
+  hand = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+// Free the memory held by the cache.
+void compress_free() {
+  pthread_mutex_lock(&lock);
+  for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+    free(clusters[ii].data);
+    clusters[ii].data = NULL;
+    clusters[ii].start = 0;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Compress a cluster's worth of data.
+size_t compress_pack(const void *src, size_t len, void *dst) {
+  // anything that doesn't free a whole block isn't worth a decompression
+  // on every read
+  size_t max = len > BLOCK_SIZE ? (bytes_to_blocks(len) - 1) * BLOCK_SIZE : 0;
+  return max ? lz4_compress(src, len, dst, max) : 0;
+}
+
+// Decompress a compressed extent.
+int compress_unpack(const extent_t *ext, void *dst) {
+  size_t len = (size_t) ext->len * BLOCK_SIZE;
+  char *src = blocks_get_blocks(ext->start, extent_disk_blocks(ext));
+  long got = lz4_decompress(src, ext->zlen, dst, len);
+  return got == (long) len ? 0 : -1;
+}
+
+// Find a cached cluster, or -1.
+static int find(uint32_t start) {
+  for (int ii = 0; ii < COMPRESS_CACHE; ++ii) {
+    if (clusters[ii].start == start) {
+      return ii;
+    }
+  }
+  return -1;
+}
+
+// Pick a slot to reuse: the first one the hand finds unreferenced,
+// clearing references as it goes.
+static int evict() {
+  for (;;) {
+    cluster_t *c = &clusters[hand];
+    int slot = hand;
+    hand = (hand + 1) % COMPRESS_CACHE;
+    if (!c->start || !c->referenced) {
+      return slot;
+    }
+    c->referenced = 0;
+  }
+}
+
+// Copy data out of a compressed extent, through the cache.
+int compress_read(const extent_t *ext, size_t offset, void *buf, size_t len) {
+  pthread_mutex_lock(&lock);
+  int slot = find(ext->start);
+  if (slot >= 0) {
+    clusters[slot].referenced = 1;
+    memcpy(buf, clusters[slot].data + offset, len);
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&lock);
+
+  // decompress without holding up other readers
+  char data[COMPRESS_CLUSTER_BYTES];
+  if (ext->len > COMPRESS_CLUSTER || compress_unpack(ext, data) < 0) {
+    memset(buf, 0, len);
+    return -1;
+  }
+  memcpy(buf, data + offset, len);
+
+  pthread_mutex_lock(&lock);
+  if (find(ext->start) < 0) {
+    slot = evict();
+    cluster_t *c = &clusters[slot];
+    if (!c->data) {
+      c->data = malloc(COMPRESS_CLUSTER_BYTES);
+    }
+    // without memory the cluster just isn't cached
+    c->start = c->data ? ext->start : 0;
+    c->referenced = 1;
+    if (c->data) {
+      memcpy(c->data, data, (size_t) ext->len * BLOCK_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+// Drop a cluster from the cache once its blocks are freed.
+void compress_forget(uint32_t start) {
+  pthread_mutex_lock(&lock);
+  int slot = find(start);
+  if (slot >= 0) {
+    clusters[slot].start = 0;
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,87 @@
+/**
+ * @file compress.h
+ *
+ * Compressed file data, and an in-memory cache of it decompressed.
+ *
+ * File data is compressed in clusters of COMPRESS_CLUSTER blocks, aligned
+ * in the file, each stored as one extent whose zlen records the compressed
+ * size (see extent.h). Only whole clusters are compressed, and only when
+ * that saves at least one block. A compressed extent is never changed in
+ * place: inode_unshare() expands it back into plain blocks first.
+ *
+ * Reads of compressed data go through a fixed-size cache of decompressed
+ * clusters, keyed by their first disk block and evicted in CLOCK order, so
+ * random reads within a cluster decompress it once. All functions are
+ * thread-safe.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+#include "extent.h"
+
+#define COMPRESS_CLUSTER 16 // blocks compressed together (64K)
+#define COMPRESS_CACHE 64   // clusters kept decompressed (4MB)
+
+// bytes in a cluster
+#define COMPRESS_CLUSTER_BYTES (COMPRESS_CLUSTER * BLOCK_SIZE)
+
+/**
+ * Empty the cache of decompressed clusters.
+ *
+ * Called whenever an image is opened, since the cache is keyed by block
+ * numbers.
+ */
+void compress_init();
+
+/**
+ * Free the memory held by the cache.
+ */
+void compress_free();
+
+/**
+ * Compress a cluster's worth of data.
+ *
+ * @param src The data, COMPRESS_CLUSTER_BYTES at most.
+ * @param len Length of the data.
+ * @param dst Buffer for the compressed data, as long as the data.
+ *
+ * @return Length of the compressed data, or 0 if compressing it wouldn't
+ *         save a block.
+ */
+size_t compress_pack(const void *src, size_t len, void *dst);
+
+/**
+ * Decompress a compressed extent.
+ *
+ * @param ext The extent.
+ * @param dst Buffer for its data, ext->len blocks long.
+ *
+ * @return 0 on success, -1 if the stored data is corrupt.
+ */
+int compress_unpack(const extent_t *ext, void *dst);
+
+/**
+ * Copy data out of a compressed extent, through the cache.
+ *
+ * @param ext The extent.
+ * @param offset Byte offset of the data within the extent.
+ * @param buf Buffer for the data.
+ * @param len Number of bytes to copy.
+ *
+ * @return 0 on success, -1 if the stored data is corrupt (buf is then
+ *         zeroed).
+ */
+int compress_read(const extent_t *ext, size_t offset, void *buf, size_t len);
+
+/**
+ * Drop a cluster from the cache once its blocks are freed.
+ *
+ * @param start First disk block of the compressed extent.
+ */
+void compress_forget(uint32_t start);
+
+#endif
@@ -0,0 +1,200 @@
+/**
+ * @file dcache.c
+ *
+ * Fixed-size LRU cache of directory entries.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "dcache.h"
+
+#include "directory.h"
+
+#define DCACHE_BUCKETS 4096 // hash chains, a power of two
+
+typedef struct dentry {
+  int parent;                     // directory inum, -1 if the slot is free
+  int inum;                       // target inum, -1 for a negative entry
+  char name[DIR_NAME_LENGTH + 1];
+  int hnext;                      // next entry in the hash chain (or free list)
+  int prev;                       // LRU neighbours, most recently used first
+  int next;
+} dentry_t;
+
+static dentry_t dentries[DCACHE_SIZE];
+static int buckets[DCACHE_BUCKETS];
+static int free_head = -1;
+static int lru_head = -1;
+static int lru_tail = -1;
+static dcache_stats_t stats;
+
+// guards everything above; lookups reorder the LRU list, so even they write
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hash a (parent, name) pair to a bucket (FNV-1a).
+static int bucket_of(int parent, const char *name, int len) {
+  uint32_t hash = 2166136261u ^ (uint32_t) parent;
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+  }
+  return hash & (DCACHE_BUCKETS - 1);
+}
+
+// Unlink an entry from the LRU list.
+static void lru_remove(int i) {
+  dentry_t *d = &dentries[i];
+  if (d->prev >= 0) {
+    dentries[d->prev].next = d->next;
+  } else {
+    lru_head = d->next;
+  }
+  if (d->next >= 0) {
+    dentries[d->next].prev = d->prev;
+  } else {
+    lru_tail = d->prev;
+  }
+}
+
+// Put an entry at the most recently used end of the LRU list.
+static void lru_push(int i) {
+  dentry_t *d = &dentries[i];
+  d->prev = -1;
+  d->next = lru_head;
+  if (lru_head >= 0) {
+    dentries[lru_head].prev = i;
+  } else {
+    lru_tail = i;
+  }
+  lru_head = i;
+}
+
+// Find the entry for (parent, name) in the given bucket, or -1.
+static int find(int bucket, int parent, const char *name, int len) {
+  for (int i = buckets[bucket]; i >= 0; i = dentries[i].hnext) {
+    dentry_t *d = &dentries[i];
+    if (d->parent == parent && !memcmp(d->name, name, len) && !d->name[len]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Remove an entry from its hash chain and the LRU list and free the slot.
+static void drop(int i) {
+  dentry_t *d = &dentries[i];
+  int *link = &buckets[bucket_of(d->parent, d->name, strlen(d->name))];
+  while (*link != i) {
+    link = &dentries[*link].hnext;
+  }
+  *link = d->hnext;
+  lru_remove(i);
+
+  d->parent = -1;
+  d->hnext = free_head;
+  free_head = i;
+}
+
+// Empty the cache and reset its counters.
+void dcache_init() {
+  for (int i = 0; i < DCACHE_BUCKETS; i++) {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < DCACHE_SIZE; i++) {
+    dentries[i].parent = -1;
+    dentries[i].hnext = i + 1 < DCACHE_SIZE ? i + 1 : -1;
+  }
+  free_head = 0;
+  lru_head = -1;
+  lru_tail = -1;
+  memset(&stats, 0, sizeof(stats));
+}
+
+// Look up a name in the cache.
+int dcache_lookup(int parent, const char *name, int len, int *inum) {
+  int i = -1;
+  pthread_mutex_lock(&lock);
+  if (len <= DIR_NAME_LENGTH) {
+    i = find(bucket_of(parent, name, len), parent, name, len);
+  }
+  if (i < 0) {
+    stats.misses++;
+  } else {
+    lru_remove(i);
+    lru_push(i);
+
+    *inum = dentries[i].inum;
+    stats.hits++;
+    if (*inum < 0) {
+      stats.negative++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return i >= 0;
+}
+
+// Add or replace a cache entry.
+void dcache_insert(int parent, const char *name, int len, int inum) {
+  if (len > DIR_NAME_LENGTH) {
+    return;
+  }
+
+  int bucket = bucket_of(parent, name, len);
+  pthread_mutex_lock(&lock);
+  int i = find(bucket, parent, name, len);
+  if (i >= 0) {
+    dentries[i].inum = inum;
+    lru_remove(i);
+    lru_push(i);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  if (free_head < 0) {
+    drop(lru_tail);
+    stats.evictions++;
+  }
+  i = free_head;
+  free_head = dentries[i].hnext;
+
+  dentry_t *d = &dentries[i];
+  d->parent = parent;
+  d->inum = inum;
+  memcpy(d->name, name, len);
+  d->name[len] = 0;
+  d->hnext = buckets[bucket];
+  buckets[bucket] = i;
+  lru_push(i);
+  pthread_mutex_unlock(&lock);
+}
+
+// Drop the entry for a name, if cached.
+void dcache_invalidate(int parent, const char *name, int len) {
+  if (len > DIR_NAME_LENGTH) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  int i = find(bucket_of(parent, name, len), parent, name, len);
+  if (i >= 0) {
+    drop(i);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Drop every entry for names inside a directory.
+void dcache_forget_dir(int parent) {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < DCACHE_SIZE; i++) {
+    if (dentries[i].parent == parent) {
+      drop(i);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Get the hit/miss counters.
+void dcache_get_stats(dcache_stats_t *out) {
+  pthread_mutex_lock(&lock);
+  *out = stats;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,75 @@
+/**
+ * @file dcache.h
+ *
+ * In-memory cache of directory entries used for path resolution.
+ *
+ * Maps (parent inum, name) to the inum of the named file, remembering
+ * failed lookups as negative entries. The cache has a fixed number of
+ * entries and evicts the least recently used one when full, so lookups and
+ * inserts never allocate memory. All functions are thread-safe.
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+
+#define DCACHE_SIZE 8192 // number of cached entries
+
+typedef struct dcache_stats {
+  uint64_t hits;      // lookups answered by the cache (including negative)
+  uint64_t negative;  // hits that found a cached "does not exist"
+  uint64_t misses;    // lookups that had to read the directory
+  uint64_t evictions; // entries dropped to make room
+} dcache_stats_t;
+
+/**
+ * Empty the cache and reset its counters.
+ */
+void dcache_init();
+
+/**
+ * Look up a name in the cache.
+ *
+ * @param parent Inum of the directory holding the name.
+ * @param name Name to look up (need not be NUL-terminated).
+ * @param len Length of the name.
+ * @param inum Set to the cached inum, or -1 for a negative entry.
+ *
+ * @return 1 on a hit, 0 on a miss.
+ */
+int dcache_lookup(int parent, const char *name, int len, int *inum);
+
+/**
+ * Add or replace a cache entry.
+ *
+ * @param parent Inum of the directory holding the name.
+ * @param name Name of the entry (need not be NUL-terminated).
+ * @param len Length of the name.
+ * @param inum Inum the name maps to, or -1 if it does not exist.
+ */
+void dcache_insert(int parent, const char *name, int len, int inum);
+
+/**
+ * Drop the entry for a name, if cached.
+ *
+ * @param parent Inum of the directory holding the name.
+ * @param name Name of the entry (need not be NUL-terminated).
+ * @param len Length of the name.
+ */
+void dcache_invalidate(int parent, const char *name, int len);
+
+/**
+ * Drop every entry for names inside a directory (e.g. when it is freed).
+ *
+ * @param parent Inum of the directory.
+ */
+void dcache_forget_dir(int parent);
+
+/**
+ * Get the hit/miss counters.
+ *
+ * @param stats Filled in with the current counters.
+ */
+void dcache_get_stats(dcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,263 @@
+/**
+ * @file dedup.c
+ *
+ * Deduplication pass over the blocks of every file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "xxhash.h"
+
+// most owners the pass gives a block: every snapshot taken later adds as
+// many owners again, and the count must still fit the share table
+#define MAX_OWNERS (UINT16_MAX / (SNAPSHOT_MAX + 1))
+
+typedef struct fingerprint {
+  uint64_t hash;
+  uint32_t bnum; // block with this hash, 0 if the slot is free
+  uint32_t inum; // file the block was found in...
+  uint32_t lblk; // ...and where, to check it is still there before use
+} fingerprint_t;
+
+// open-addressing hash table from fingerprint to block
+typedef struct index {
+  fingerprint_t *slots;
+  size_t mask; // slot count - 1, a power of two minus one
+  size_t used; // slots taken
+} index_t;
+
+typedef struct pass {
+  uint8_t *seen;       // disk blocks counted in stats->unique
+  int full;            // out of blocks for the extent trees; stop merging
+  uint64_t started;    // journal generation the pass started in
+  int inum;            // where the next batch starts, -1 once done...
+  uint32_t lblk;       // ...and the block of that file
+  int left;            // blocks the current batch may still hash
+  dedup_stats_t *stats;
+} pass_t;
+
+// one pass at a time; guards everything below
+static pthread_mutex_t pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static pass_t pass;
+
+// Kept from one pass to the next, so files that haven't changed since the
+// last complete pass needn't be read again: their blocks are still in it.
+static index_t fingerprints;
+static uint64_t last_started; // when that pass started, 0 if none was
+
+// Find the slot holding a hash, or the free slot where it would go.
+static fingerprint_t *lookup(index_t *index, uint64_t hash) {
+  size_t ii = hash & index->mask;
+  while (index->slots[ii].bnum && index->slots[ii].hash != hash) {
+    ii = (ii + 1) & index->mask;
+  }
+  return &index->slots[ii];
+}
+
+// Check that a file still maps lblk to bnum as a plain block.
+static int still_maps(inode_t *node, uint32_t lblk, uint32_t bnum) {
+  extent_t ext;
+  return !(node->mode & 040000) && inode_get_extent(node, lblk, &ext) &&
+         !ext.zlen && ext.start + (lblk - ext.lblk) == bnum;
+}
+
+// Point file block lblk, stored in bnum, at an earlier block with the same
+// data, if there is one; otherwise remember bnum for later blocks. Returns
+// 1 if the block was remapped.
+static int dedup_block(inode_t *node, int inum, uint32_t lblk, uint32_t bnum) {
+  char *data = blocks_get_block(bnum);
+  uint64_t hash = xxh64(data, BLOCK_SIZE, 0);
+  fingerprint_t *fp = lookup(&fingerprints, hash);
+  fingerprint_t here = {hash, bnum, inum, lblk};
+  if (!fp->bnum) {
+    // a quarter stays free, so probes stay short; see dedup_begin()
+    if (fingerprints.used < fingerprints.mask - fingerprints.mask / 4) {
+      fingerprints.used++;
+      *fp = here;
+    }
+    return 0;
+  }
+  if (fp->bnum == bnum) {
+    *fp = here; // already shared
+    return 0;
+  }
+
+  // The block was found in an earlier batch or pass, and may have been
+  // rewritten or freed since. Its file is locked while it is checked, but
+  // without waiting, since this one is locked already.
+  int owner = fp->inum;
+  if (owner != inum) {
+    if (!inode_pin_used(owner)) {
+      *fp = here;
+      return 0;
+    }
+    if (inode_trylock(owner, 0) < 0) {
+      inode_unpin(owner);
+      return 0;
+    }
+  }
+  uint32_t target = fp->bnum;
+  int rv = 0;
+  if (!still_maps(get_inode(owner), fp->lblk, target)) {
+    *fp = here;
+  } else if (pass.full || memcmp(blocks_get_block(target), data, BLOCK_SIZE)) {
+    // a different block with the same hash
+  } else if (block_shares(target) + 2 > MAX_OWNERS) {
+    *fp = here; // later copies share this one instead
+  } else {
+    // once shared, it is copied before its file changes it
+    share_blocks(target, 1);
+    rv = 1;
+  }
+  if (owner != inum) {
+    inode_unlock(owner);
+    inode_unpin(owner);
+  }
+  if (!rv) {
+    return 0;
+  }
+
+  extent_t moved = {lblk, target, 1};
+  if (extent_remap(&node->tree, moved) < 0) {
+    free_blocks(target, 1);
+    pass.full = 1;
+    return 0;
+  }
+  pass.stats->merged++;
+  return 1;
+}
+
+// Count the plain data blocks of a file locked for writing from pass.lblk
+// on, deduplicating them too if hash is set, until the batch has hashed as
+// many as it may. Returns 1 once it got to the end of the file.
+static int dedup_inode(inode_t *node, int inum, int hash) {
+  int changed = 0;
+  // not the blocks mapped past the end, which are kept for appends
+  uint32_t end = extent_end(&node->tree);
+  uint32_t size = bytes_to_blocks(node->size);
+  end = end < size ? end : size;
+  uint32_t lblk = pass.lblk;
+  while (lblk < end && !(hash && pass.left == 0)) {
+    extent_t ext;
+    if (!inode_get_extent(node, lblk, &ext) || ext.zlen) {
+      lblk = ext.lblk + ext.len;
+      continue;
+    }
+    if (hash) {
+      changed |= dedup_block(node, inum, lblk, ext.start + (lblk - ext.lblk));
+      pass.left--;
+    }
+
+    uint32_t bnum = inode_get_bnum(node, lblk);
+    pass.stats->blocks++;
+    if (!bitmap_get(pass.seen, bnum)) {
+      bitmap_put(pass.seen, bnum, 1);
+      pass.stats->unique++;
+    }
+    lblk++;
+  }
+  if (changed) {
+    inode_dirty(node);
+  }
+  pass.lblk = lblk;
+  return lblk >= end;
+}
+
+// Start a deduplication pass.
+int dedup_begin(dedup_stats_t *stats) {
+  pthread_mutex_lock(&pass_lock);
+  superblock_t *sb = get_superblock();
+  if (!fingerprints.slots) {
+    // at most half full with every data block in it
+    size_t slots = 1;
+    while (slots < 2 * (size_t) (sb->block_count - sb->data_start)) {
+      slots *= 2;
+    }
+    fingerprints = (index_t) {calloc(slots, sizeof(fingerprint_t)), slots - 1};
+    last_started = 0;
+  } else if (fingerprints.used > fingerprints.mask / 4) {
+    // Stale entries pile up over the passes. Past a quarter full, start
+    // afresh with every file, so this pass can't fill it.
+    memset(fingerprints.slots, 0,
+           (fingerprints.mask + 1) * sizeof(fingerprint_t));
+    fingerprints.used = 0;
+    last_started = 0;
+  }
+  pass = (pass_t) {calloc((sb->block_count + 7) / 8, 1), 0,
+                   journal_generation(), 1, 0, 0, stats};
+  if (!fingerprints.slots || !pass.seen) {
+    free(pass.seen);
+    pthread_mutex_unlock(&pass_lock);
+    return -ENOMEM;
+  }
+  memset(stats, 0, sizeof(dedup_stats_t));
+  return 0;
+}
+
+// Deduplicate the next batch of blocks.
+int dedup_batch() {
+  pass.left = DEDUP_BATCH;
+  // keeps inodes from being allocated while they are walked
+  directory_lock(0);
+  while (pass.inum >= 0 && pass.left > 0) {
+    int inum = inode_next_used(pass.inum);
+    if (inum != pass.inum) {
+      pass.lblk = 0; // the file the last batch stopped in is gone
+    }
+    pass.inum = inum;
+    if (inum < 0) {
+      break;
+    }
+    if (!inode_pin_used(inum)) {
+      pass.inum = inum + 1; // freed since it was found
+      continue;
+    }
+    inode_lock(inum, 1);
+    inode_t *node = get_inode(inum);
+    int done = 1;
+    if (!(node->mode & 040000)) {
+      // unchanged files are still in the index, so only counted
+      int hash = pass.lblk > 0 || inode_generation(inum) >= last_started;
+      done = dedup_inode(node, inum, hash);
+    }
+    inode_unlock(inum);
+    inode_unpin(inum);
+    if (done) {
+      pass.inum = inum + 1;
+      pass.lblk = 0;
+    }
+  }
+  directory_unlock();
+  return pass.inum >= 0;
+}
+
+// Finish a deduplication pass.
+void dedup_end() {
+  if (pass.inum < 0) {
+    last_started = pass.started;
+  }
+  free(pass.seen);
+  pass.seen = 0;
+  pthread_mutex_unlock(&pass_lock);
+}
+
+// Drop the index of the image being closed.
+void dedup_free() {
+  pthread_mutex_lock(&pass_lock);
+  free(fingerprints.slots);
+  fingerprints = (index_t) {0};
+  last_started = 0;
+  pthread_mutex_unlock(&pass_lock);
+}
@@ -0,0 +1,72 @@
+/**
+ * @file dedup.h
+ *
+ * Deduplication of identical file blocks.
+ *
+ * A pass fingerprints every plain data block of every regular file with
+ * XXH64, keeping an index from fingerprint to the first block seen with it.
+ * A later block whose data matches one in the index (checked byte for
+ * byte, not just by fingerprint) is remapped onto it, and the block it had
+ * is freed. The surviving block gains an owner in the share table, so it is
+ * copied before either file changes it and freed only when its last owner
+ * lets go (see blocks.h), exactly like blocks shared with a snapshot.
+ *
+ * The pass goes through the files in batches of DEDUP_BATCH blocks, each
+ * one an ordinary operation that can be committed on its own, so the rest
+ * of the file system carries on in between. The index outlives the pass:
+ * an entry names the file and block it came from and is checked before it
+ * is used, and files that haven't changed since the last complete pass are
+ * only counted, not read again.
+ *
+ * Runs of blocks copied from one file to another end up as a single extent
+ * pointing at the original run, since remapped neighbours are merged.
+ * Compressed clusters and directories are left alone.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+typedef struct dedup_stats {
+  uint64_t blocks; // file data blocks looked at
+  uint64_t unique; // distinct disk blocks those map to after the pass
+  uint64_t merged; // blocks this pass pointed at an identical block
+} dedup_stats_t;
+
+#define DEDUP_BATCH 4096 // most blocks read by one dedup_batch()
+
+/**
+ * Start a deduplication pass.
+ *
+ * Waits for any other pass to finish; every dedup_begin() that succeeds
+ * must be followed by dedup_end().
+ *
+ * @param stats Filled in as the pass goes; blocks / unique is the
+ *              deduplication ratio of the live file system.
+ *
+ * @return 0 on success, -ENOMEM if the index couldn't be allocated.
+ */
+int dedup_begin(dedup_stats_t *stats);
+
+/**
+ * Deduplicate the next batch of blocks.
+ *
+ * Must run inside journal_begin()/journal_end(). Files are locked one at a
+ * time, and the directory tree for reading, so creates and unlinks wait
+ * for the batch but reads and writes go on.
+ *
+ * @return 1 if there is more to do, 0 once every file has been seen.
+ */
+int dedup_batch();
+
+/**
+ * Finish a deduplication pass, complete or not.
+ */
+void dedup_end();
+
+/**
+ * Drop the index kept between passes, when the image is closed.
+ */
+void dedup_free();
+
+#endif
@@ -1,50 +1,274 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "directory.h"
 
 #include "blocks.h"
+#include "dcache.h"
+#include "journal.h"
+#include "path.h"
 #include "inode.h"
 #include "slist.h"
 #include "bitmap.h"
 
 int rootinode = 0;
 
+// guards every directory's entries; prefers writers so a steady stream of
+// lookups can't starve mknod/unlink/rename
+static pthread_rwlock_t tree_lock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
 /**
  * Initializes root directory of the filesystem
+ *
+ * @return int 0 on success, -1 if there was no block for a new root.
  */
-void directory_init() {
-  void *bbm = get_blocks_bitmap();
-  if (!bitmap_get(bbm, 0)) {
-    rootinode = alloc_inode();
+int directory_init() {
+  dcache_init();
+  if (!bitmap_get(get_inode_bitmap(), 1)) {
+    rootinode = alloc_inode(0, 1);
     assert(rootinode == 1);
     inode_t *root = get_inode(rootinode);
     root->mode = 040755;
-    root->size = 0;
-    root->block = alloc_block();
-    root->iblock = 0;
+    if (grow_inode(root, BLOCK_SIZE) < 0) {
+      free_inode(rootinode);
+      return -1;
+    }
+    root->size = BLOCK_SIZE;
+    inode_dirty(root);
     directory_put(root, ".", rootinode);
-    bitmap_put(get_inode_bitmap(), rootinode, 1);
   } else {
     rootinode = 1;
   }
+  return 0;
 }
 
 /**
- * Finds a file in a directory
+ * Locks the directory tree for reading or writing
  *
- * @param di Directory inode to search
- * @param name Name of file requested
- *
- * @return int Inum of requested file, -1 if DNE.
+ * @param write Nonzero to lock for writing
  */
-int directory_lookup(inode_t *di, const char *name) {
+void directory_lock(int write) {
+  if (write) {
+    pthread_rwlock_wrlock(&tree_lock);
+  } else {
+    pthread_rwlock_rdlock(&tree_lock);
+  }
+}
+
+/**
+ * Unlocks the directory tree locked with directory_lock()
+ */
+void directory_unlock() {
+  pthread_rwlock_unlock(&tree_lock);
+}
+
+// A dirent together with the hash of its name, used to split a leaf.
+typedef struct hashed_dirent {
+  uint32_t hash;
+  dirent_t entry;
+} hashed_dirent_t;
+
+// Hash a file name of the given length (32-bit FNV-1a from the given
+// offset basis).
+static uint32_t fnv_hash(const char *name, int len, uint32_t hash) {
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t name_hash(const char *name, int len) {
+  return fnv_hash(name, len, 2166136261u);
+}
+
+// Get the readdir position of a name: its hash, then 30 bits of a second
+// hash that tell apart names whose hashes collide.
+static off_t name_key(const char *name, int len) {
+  uint32_t minor = fnv_hash(name, len, 0x9747b28cu) & 0x3fffffff;
+  return (off_t) name_hash(name, len) << 30 | minor;
+}
+
+// Check whether a dirent holds the given (not NUL-terminated) name.
+static int name_matches(dirent_t *dirent, const char *name, int len) {
+  return !memcmp(dirent->name, name, len) &&
+         (len == DIR_NAME_LENGTH || !dirent->name[len]);
+}
+
+// Get the nth block of a directory.
+static void *dir_block(inode_t *di, int lblk) {
+  return blocks_get_block(inode_get_bnum(di, lblk));
+}
+
+// Get the nth block of a directory to change it, copying it first if a
+// snapshot shares it. Returns NULL if the disk is too full for the copy.
+static void *dir_block_w(inode_t *di, int lblk) {
+  if (inode_unshare(di, lblk, 1) < 0) {
+    return NULL;
+  }
+  return dir_block(di, lblk);
+}
+
+// Get the first and one-past-last blocks holding dirents.
+static int first_leaf(inode_t *di) {
+  return (di->flags & INODE_DIR_HASHED) ? 1 : 0;
+}
+
+static int end_leaf(inode_t *di) {
+  return (di->flags & INODE_DIR_HASHED) ? di->size / BLOCK_SIZE : 1;
+}
+
+// Find the index slot of the leaf that covers the given hash.
+static int leaf_slot(dir_index_t *index, uint32_t hash) {
+  int lo = 0;
+  int hi = index->count - 1;
+  int slot = 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (index->leaves[mid].hash <= hash) {
+      slot = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return slot;
+}
+
+// Get the number of the block of dirents the given name lives in (or would
+// go into).
+static int leaf_lblk(inode_t *di, const char *name, int len) {
+  if (!(di->flags & INODE_DIR_HASHED)) {
+    return 0;
+  }
+  dir_index_t *index = dir_block(di, 0);
+  int slot = leaf_slot(index, name_hash(name, len));
+  return index->leaves[slot].lblk;
+}
+
+// Get the block of dirents the given name lives in (or would go into).
+static dirent_t *leaf_for(inode_t *di, const char *name, int len) {
+  return dir_block(di, leaf_lblk(di, name, len));
+}
+
+// Append an empty block to a directory and return its number.
+static int add_block(inode_t *di) {
+  int lblk = di->size / BLOCK_SIZE;
+  if (grow_inode(di, di->size + BLOCK_SIZE) < 0) {
+    return -1;
+  }
+  di->size += BLOCK_SIZE;
+  inode_dirty(di);
+  memset(dir_block(di, lblk), 0, BLOCK_SIZE);
+  journal_dirty(dir_block(di, lblk), BLOCK_SIZE, 1);
+  return lblk;
+}
+
+// Convert a full linear directory to the hashed format: its dirents move
+// to a new leaf covering every hash and block 0 becomes the index.
+static int make_hashed(inode_t *di) {
+  int lblk = add_block(di);
+  if (lblk < 0) {
+    return -1;
+  }
+  dir_index_t *index = dir_block_w(di, 0);
+  if (!index) {
+    return -1;
+  }
+  memcpy(dir_block(di, lblk), index, BLOCK_SIZE);
+  memset(index, 0, BLOCK_SIZE);
+  journal_dirty(index, BLOCK_SIZE, 1);
+  index->count = 1;
+  index->leaves[0].hash = 0;
+  index->leaves[0].lblk = lblk;
+  di->flags |= INODE_DIR_HASHED;
+  inode_dirty(di);
+  return 0;
+}
+
+static int compare_hash(const void *a, const void *b) {
+  uint32_t x = ((const hashed_dirent_t *) a)->hash;
+  uint32_t y = ((const hashed_dirent_t *) b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+// Split the full leaf covering the given hash around its median hash.
+static int split_leaf(inode_t *di, uint32_t hash) {
+  dir_index_t *index = dir_block_w(di, 0);
+  if (!index || index->count == DIR_INDEX_COUNT) {
+    return -1;
+  }
+  int slot = leaf_slot(index, hash);
+  dirent_t *leaf = dir_block_w(di, index->leaves[slot].lblk);
+  if (!leaf) {
+    return -1;
+  }
+
+  hashed_dirent_t sorted[DIRENT_COUNT];
+  int n = 0;
+  for (int i = 0; i < DIRENT_COUNT; i++) {
+    if (strlen(leaf[i].name)) {
+      sorted[n].hash = name_hash(leaf[i].name, strlen(leaf[i].name));
+      sorted[n].entry = leaf[i];
+      n++;
+    }
+  }
+  qsort(sorted, n, sizeof(hashed_dirent_t), compare_hash);
+
+  // names with equal hashes must stay in the same leaf
+  int mid = n / 2;
+  while (mid < n && sorted[mid].hash == sorted[mid - 1].hash) {
+    mid++;
+  }
+  if (mid == n) {
+    mid = n / 2;
+    while (mid > 0 && sorted[mid].hash == sorted[mid - 1].hash) {
+      mid--;
+    }
+  }
+  if (mid == 0) {
+    return -1;
+  }
+
+  int lblk = add_block(di);
+  if (lblk < 0) {
+    return -1;
+  }
+  dirent_t *right = dir_block(di, lblk);
+  memset(leaf, 0, BLOCK_SIZE);
+  journal_dirty(leaf, BLOCK_SIZE, 1);
+  journal_dirty(index, BLOCK_SIZE, 1);
+  for (int i = 0; i < n; i++) {
+    if (i < mid) {
+      leaf[i] = sorted[i].entry;
+    } else {
+      right[i - mid] = sorted[i].entry;
+    }
+  }
+
+  memmove(index->leaves + slot + 2, index->leaves + slot + 1,
+          (index->count - slot - 1) * sizeof(dir_index_entry_t));
+  index->leaves[slot + 1].hash = sorted[mid].hash;
+  index->leaves[slot + 1].lblk = lblk;
+  index->count++;
+  return 0;
+}
+
+// Find a name, given as a slice of a path, in a directory.
+static int lookup_part(inode_t *di, const char *name, int len) {
   assert(di->mode & 040000); //inode should be a directory
-  dirent_t *base = (dirent_t *)blocks_get_block(di->block);
+  if (len > DIR_NAME_LENGTH) {
+    return -1;
+  }
+  dirent_t *base = leaf_for(di, name, len);
   for (int i = 0; i < DIRENT_COUNT; i++) {
     dirent_t *dirent = base + i;
     if (dirent->inum) {
-      if (!strcmp(dirent->name, name)) {
+      if (name_matches(dirent, name, len)) {
         return dirent->inum;
       }
     }
@@ -52,6 +276,18 @@ int directory_lookup(inode_t *di, const char *name) {
   return -1;
 }
 
+/**
+ * Finds a file in a directory
+ *
+ * @param di Directory inode to search
+ * @param name Name of file requested
+ *
+ * @return int Inum of requested file, -1 if DNE.
+ */
+int directory_lookup(inode_t *di, const char *name) {
+  return lookup_part(di, name, strlen(name));
+}
+
 /**
  * Adds a new file to a directory
  *
@@ -63,36 +299,55 @@ int directory_lookup(inode_t *di, const char *name) {
  */
 int directory_put(inode_t *di, const char *name, int inum) {
   assert(di->mode & 040000); //inode should be a directory
-  dirent_t *base = (dirent_t *)blocks_get_block(di->block);
-  for (int i = 0; i < DIRENT_COUNT; i++) {
-    dirent_t *dirent = base + i;
-    if (!strlen(dirent->name)) {
-      dirent->inum = inum;
-      memset(dirent->name, 0, DIR_NAME_LENGTH);
-      memcpy(dirent->name, name, strlen(name));
-      inode_t *node = get_inode(dirent->inum);
-      return 0;
+  int len = strlen(name);
+  for (;;) {
+    dirent_t *base = dir_block_w(di, leaf_lblk(di, name, len));
+    if (!base) {
+      return -1;
+    }
+    for (int i = 0; i < DIRENT_COUNT; i++) {
+      dirent_t *dirent = base + i;
+      if (!strlen(dirent->name)) {
+        dirent->inum = inum;
+        memset(dirent->name, 0, DIR_NAME_LENGTH);
+        memcpy(dirent->name, name, len);
+        journal_dirty(dirent, sizeof(dirent_t), 1);
+        dcache_insert(inode_get_inum(di), name, len, inum);
+        return 0;
+      }
+    }
+
+    // no room: index the directory (or split the leaf) and try again
+    int rv = (di->flags & INODE_DIR_HASHED)
+                 ? split_leaf(di, name_hash(name, len))
+                 : make_hashed(di);
+    if (rv < 0) {
+      return -1;
     }
   }
-  return -1;
 }
 
 /**
- * Unlinks file from directory
+ * Unlinks file from directory, leaving its inode alone
  *
  * @param di Directory inode to modify
- * @param inum Inum of file to unlink
+ * @param name Name of file to unlink
  *
  * @return int 0 on success, -1 if DNE.
  */
-int directory_unlink(inode_t *di, int inum) {
+int directory_unlink(inode_t *di, const char *name) {
   assert(di->mode & 040000); //inode should be a directory
-  dirent_t *entries = (dirent_t *)blocks_get_block(di->block);
-  for(int i = 0; i<DIRENT_COUNT; i++){ //iterates over dirent entries, unlinks first node.
+  int len = strlen(name);
+  dirent_t *entries = dir_block_w(di, leaf_lblk(di, name, len));
+  if (!entries) {
+    return -1;
+  }
+  for(int i = 0; i<DIRENT_COUNT; i++){
     dirent_t *entry = entries + i;
-    if(entry->inum == inum){
-      inode_t *node = get_inode(inum);
+    if(entry->inum && name_matches(entry, name, len)){
       memset(entry, 0, sizeof(dirent_t));
+      journal_dirty(entry, sizeof(dirent_t), 1);
+      dcache_insert(inode_get_inum(di), name, len, -1);
       return 0;
     }
   }
@@ -109,13 +364,18 @@ int directory_unlink(inode_t *di, int inum) {
  */
 int directory_delete(inode_t *di, const char *name) {
   assert(di->mode & 040000); //inode should be a directory
-  dirent_t *entries = (dirent_t *)blocks_get_block(di->block);
+  int len = strlen(name);
+  dirent_t *entries = dir_block_w(di, leaf_lblk(di, name, len));
+  if (!entries) {
+    return -1;
+  }
   for (int i = 0; i < DIRENT_COUNT; i++) {
     dirent_t *entry = entries + i;
-    if (!strcmp(name, entry->name)) {
-      inode_t *node = get_inode(entry->inum);
-      free_inode(entry->inum);
+    if (entry->inum && name_matches(entry, name, len)) {
+      unlink_inode(entry->inum);
       memset(entry, 0, sizeof(dirent_t));
+      journal_dirty(entry, sizeof(dirent_t), 1);
+      dcache_insert(inode_get_inum(di), name, len, -1);
       return 0;
     }
   }
@@ -132,57 +392,192 @@ int directory_delete(inode_t *di, const char *name) {
 slist_t *directory_list(inode_t* di) {
   assert(di->mode & 040000); //inode should be a directory
   slist_t* list = NULL;
-  dirent_t *entries = (dirent_t *) blocks_get_block(di->block);
-  for(int i = 0; i<DIRENT_COUNT; i++){
-    dirent_t *entry = entries + i;
-    if(!strlen(entry->name)) continue;
-    list = s_cons(entry->name, list);
+  for (int lblk = first_leaf(di); lblk < end_leaf(di); lblk++) {
+    dirent_t *entries = dir_block(di, lblk);
+    for(int i = 0; i<DIRENT_COUNT; i++){
+      dirent_t *entry = entries + i;
+      if(!strlen(entry->name)) continue;
+      list = s_cons(entry->name, list);
+    }
   }
   return list;
 }
 
 /**
- * Lists all files in a directory
+ * Checks whether a directory has no entries
  *
- * @param di Directory inode to search
+ * @param di Directory inode to check
+ * @param inum Inum of the directory itself, ignored if it lists itself
  *
- * @return slist_t List of names of files in the directory
+ * @return int 1 if the directory is empty, 0 if not.
  */
-int directory_find(const char *path) {
-  if (!strcmp(path, "/")) {
-    return rootinode;
+int directory_is_empty(inode_t *di, int inum) {
+  assert(di->mode & 040000); //inode should be a directory
+  for (int lblk = first_leaf(di); lblk < end_leaf(di); lblk++) {
+    if (!inode_get_bnum(di, lblk)) continue;
+    dirent_t *entries = dir_block(di, lblk);
+    for (int i = 0; i < DIRENT_COUNT; i++) {
+      dirent_t *entry = entries + i;
+      if (entry->name[0] && entry->inum != inum) {
+        return 0;
+      }
+    }
   }
-  int parent = directory_find_parent(path);
-  if (parent < 0) {
-    return -1;
+  return 1;
+}
+
+// A dirent together with its readdir position.
+typedef struct keyed_dirent {
+  off_t key;
+  dirent_t *entry;
+} keyed_dirent_t;
+
+static int compare_key(const void *a, const void *b) {
+  off_t x = ((const keyed_dirent_t *) a)->key;
+  off_t y = ((const keyed_dirent_t *) b)->key;
+  return x < y ? -1 : x > y;
+}
+
+// Pass the entries of a block of dirents at or after a position to fill,
+// in position order. Returns nonzero if fill asked to stop.
+static int read_block(dirent_t *entries, off_t pos, directory_fill_t fill,
+                      void *ctx) {
+  keyed_dirent_t sorted[DIRENT_COUNT];
+  int n = 0;
+  for (int i = 0; i < DIRENT_COUNT; i++) {
+    dirent_t *entry = entries + i;
+    if (!entry->name[0]) continue;
+    off_t key = name_key(entry->name, strnlen(entry->name, DIR_NAME_LENGTH));
+    if (key >= pos) {
+      sorted[n].key = key;
+      sorted[n].entry = entry;
+      n++;
+    }
   }
-  slist_t *list = s_explode(path, '/');
-  int inum = directory_lookup(get_inode(parent), s_get_last(list));
-  s_free(list);
-  return inum;
+  qsort(sorted, n, sizeof(keyed_dirent_t), compare_key);
+
+  for (int i = 0; i < n; i++) {
+    char name[DIR_NAME_LENGTH + 1];
+    memcpy(name, sorted[i].entry->name, DIR_NAME_LENGTH);
+    name[DIR_NAME_LENGTH] = 0;
+    if (fill(ctx, name, sorted[i].entry->inum, sorted[i].key + 1)) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 /**
- * Finds the inum of the parent directory of the current path
+ * Reads the entries of a directory, starting at a position
  *
- * @param path Path of the item
+ * @param di Directory inode to read
+ * @param pos 0 to start at the first entry, or a position passed to fill
+ * @param fill Called for each entry in turn
+ * @param ctx Passed to fill
+ */
+void directory_read(inode_t *di, off_t pos, directory_fill_t fill, void *ctx) {
+  assert(di->mode & 040000); //inode should be a directory
+  // a directory whose creation ran out of space has no block at all
+  if (!inode_get_bnum(di, 0)) {
+    return;
+  }
+  if (!(di->flags & INODE_DIR_HASHED)) {
+    read_block(dir_block(di, 0), pos, fill, ctx);
+    return;
+  }
+  // entries are read in hash order, leaf by leaf, whatever slots they are in
+  dir_index_t *index = dir_block(di, 0);
+  for (int slot = leaf_slot(index, pos >> 30); slot < index->count; slot++) {
+    if (read_block(dir_block(di, index->leaves[slot].lblk), pos, fill, ctx)) {
+      return;
+    }
+  }
+}
+
+/**
+ * Frees the inodes of every file in a directory (recursively)
  *
- * @return int Inum of the directory, -1 if DNE.
+ * @param di Directory inode to clear
+ * @param inum Inum of the directory itself, skipped if it lists itself
  */
-int directory_find_parent(const char *path) {
-  slist_t *list = s_explode(path, '/');
-  list = list->next;
+void directory_clear(inode_t *di, int inum) {
+  assert(di->mode & 040000); //inode should be a directory
+  dcache_forget_dir(inode_get_inum(di));
+  for (int lblk = first_leaf(di); lblk < end_leaf(di); lblk++) {
+    // a directory whose creation ran out of space has no block at all
+    if (!inode_get_bnum(di, lblk)) continue;
+    dirent_t *entries = dir_block(di, lblk);
+    for (int i = 0; i < DIRENT_COUNT; i++) {
+      dirent_t *entry = entries + i;
+      if (!strlen(entry->name) || entry->inum == inum) continue;
+      // the blocks are freed right after, and a snapshot may share them,
+      // so the entries themselves are left alone
+      unlink_inode(entry->inum);
+    }
+  }
+}
+
+// Look up a name in a directory through the dentry cache, remembering the
+// answer (even a miss) for next time.
+static int lookup_cached(int parent, path_part_t *part) {
+  int inum;
+  if (dcache_lookup(parent, part->name, part->len, &inum)) {
+    return inum;
+  }
+  inode_t *di = get_inode(parent);
+  if (!(di->mode & 040000)) {
+    return -1; // a path component that isn't a directory
+  }
+  inum = lookup_part(di, part->name, part->len);
+  dcache_insert(parent, part->name, part->len, inum);
+  return inum;
+}
+
+// Walk every component of a path but the last, without allocating.
+// Returns the inum of the directory holding the last component and sets
+// *last to it (last->len is 0 for the root itself), or -1 if some directory
+// along the way doesn't exist.
+static int walk_parent(const char *path, path_part_t *last) {
   int inum = rootinode;
-  inode_t *node = get_inode(rootinode);
-  while (list->next) {
-    inum = directory_lookup(node, list->data);
-    if (inum == -1) {
-      return -1;
+  path_part_t part;
+  last->name = path;
+  last->len = 0;
+  while (path_next(&path, &part)) {
+    if (last->len) {
+      inum = lookup_cached(inum, last);
+      if (inum < 0) {
+        return -1;
+      }
     }
-    node = get_inode(inum);
-    list = list->next;
+    *last = part;
   }
-  s_free(list);
   return inum;
 }
 
+/**
+ * Finds the inum of the file at the given path
+ *
+ * @param path Path of the item
+ *
+ * @return int Inum of the file, -1 if DNE.
+ */
+int directory_find(const char *path) {
+  path_part_t last;
+  int parent = walk_parent(path, &last);
+  if (parent < 0 || !last.len) {
+    return parent;
+  }
+  return lookup_cached(parent, &last);
+}
+
+/**
+ * Finds the inum of the parent directory of the current path
+ *
+ * @param path Path of the item
+ *
+ * @return int Inum of the directory, -1 if DNE.
+ */
+int directory_find_parent(const char *path) {
+  path_part_t last;
+  return walk_parent(path, &last);
+}
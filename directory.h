@@ -8,11 +8,13 @@
 
 #define DIR_NAME_LENGTH 15
 
+#include <sys/types.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
 
-#define DIRENT_COUNT BLOCK_SIZE / sizeof(dirent_t)
+#define DIRENT_COUNT (BLOCK_SIZE / sizeof(dirent_t))
 
 typedef struct dirent {
   char name[DIR_NAME_LENGTH];
@@ -21,10 +23,48 @@ typedef struct dirent {
   //char _reserved[8];
 } dirent_t;
 
+// Directories start out linear: a single block of dirents. Once that block
+// fills up the directory is converted to the hashed format (and flagged with
+// INODE_DIR_HASHED): block 0 becomes an index of name-hash ranges sorted by
+// hash, and every other block is a leaf of dirents whose names hash into
+// that leaf's range. A full leaf is split in two at its median hash.
+
+typedef struct dir_index_entry {
+  uint32_t hash; // lowest name hash stored in the leaf
+  uint32_t lblk; // directory block holding the leaf
+} dir_index_entry_t;
+
+typedef struct dir_index {
+  uint32_t count; // leaves in use
+  uint32_t _reserved;
+  dir_index_entry_t leaves[];
+} dir_index_t;
+
+#define DIR_INDEX_COUNT \
+  ((BLOCK_SIZE - sizeof(dir_index_t)) / sizeof(dir_index_entry_t))
+
 /**
  * Initializes root directory of the filesystem
+ *
+ * @return int 0 on success, -1 if there was no block for a new root.
  */
-void directory_init();
+int directory_init();
+
+/**
+ * Locks the directory tree for reading or writing
+ *
+ * Lookups (directory_lookup, directory_find, directory_list) need the tree
+ * locked for reading; anything that adds, removes or renames entries needs
+ * it locked for writing. Take this lock before any inode lock.
+ *
+ * @param write Nonzero to lock for writing
+ */
+void directory_lock(int write);
+
+/**
+ * Unlocks the directory tree locked with directory_lock()
+ */
+void directory_unlock();
 
 /**
  * Finds a file in a directory
@@ -48,14 +88,14 @@ int directory_lookup(inode_t *di, const char *name);
 int directory_put(inode_t *di, const char *name, int inum);
 
 /**
- * Unlinks file from directory
+ * Unlinks file from directory, leaving its inode alone
  *
  * @param di Directory inode to modify
- * @param inum Inum of file to unlink
+ * @param name Name of file to unlink
  *
  * @return int 0 on success, -1 if DNE.
  */
-int directory_unlink(inode_t *di, int inum);
+int directory_unlink(inode_t *di, const char *name);
 
 /**
  * Deletes a file from the directory
@@ -77,11 +117,60 @@ int directory_delete(inode_t *di, const char *name);
 slist_t *directory_list(inode_t* di);
 
 /**
- * Lists all files in a directory
+ * Checks whether a directory has no entries
  *
- * @param di Directory inode to search
+ * @param di Directory inode to check
+ * @param inum Inum of the directory itself, ignored if it lists itself
  *
- * @return slist_t List of names of files in the directory
+ * @return int 1 if the directory is empty, 0 if not.
+ */
+int directory_is_empty(inode_t *di, int inum);
+
+/**
+ * Called by directory_read() for each entry
+ *
+ * @param ctx Context passed to directory_read()
+ * @param name Name of the entry
+ * @param inum Inum the entry refers to
+ * @param next Position just past the entry, to resume reading from
+ *
+ * @return int 0 to keep reading, nonzero to stop.
+ */
+typedef int (*directory_fill_t)(void *ctx, const char *name, int inum,
+                                off_t next);
+
+/**
+ * Reads the entries of a directory, starting at a position
+ *
+ * Entries come in order of a 62-bit hash of their names, and a position
+ * is the hash to go on from, so reading resumes where it left off however
+ * leaf splits or the switch to the hashed format moved entries around. An
+ * entry added or removed while the directory is being read may or may not
+ * be seen; every other entry is seen exactly once.
+ *
+ * @param di Directory inode to read
+ * @param pos 0 to start at the first entry, or a position passed to fill
+ * @param fill Called for each entry in turn
+ * @param ctx Passed to fill
+ */
+void directory_read(inode_t *di, off_t pos, directory_fill_t fill, void *ctx);
+
+/**
+ * Frees the inodes of every file in a directory (recursively)
+ *
+ * @param di Directory inode to clear
+ * @param inum Inum of the directory itself, skipped if it lists itself
+ */
+void directory_clear(inode_t *di, int inum);
+
+/**
+ * Finds the inum of the file at the given path
+ *
+ * Walks the path in place through the dentry cache; does not allocate.
+ *
+ * @param path Path of the item
+ *
+ * @return int Inum of the file, -1 if DNE.
  */
 int directory_find(const char *path);
 
@@ -0,0 +1,496 @@
+/**
+ * @file extent.c
+ *
+ * Extent B+tree mapping file blocks to disk blocks.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "extent.h"
+
+#include "blocks.h"
+#include "compress.h"
+#include "journal.h"
+
+// Get the entries that follow a node header.
+static extent_t *entries(extent_header_t *hdr) {
+  return (extent_t *) (hdr + 1);
+}
+
+// Record that a node (the inode's root or a tree block) is being changed.
+static void touch(extent_header_t *hdr) {
+  journal_dirty(hdr, sizeof(extent_header_t) + hdr->max * sizeof(extent_t), 1);
+}
+
+// Get the tree node an interior entry points to.
+static extent_header_t *child(extent_t *idx) {
+  return (extent_header_t *) blocks_get_block(idx->start);
+}
+
+// Check whether b continues a, both in the file and on disk.
+static int contiguous(extent_t *a, extent_t *b) {
+  return !a->zlen && !b->zlen && a->lblk + a->len == b->lblk &&
+         a->start + a->len == b->start;
+}
+
+// Free the disk blocks behind count file blocks of an extent, starting
+// skip blocks in. A compressed extent can only be freed as a whole.
+static void free_run(extent_t *e, uint32_t skip, uint32_t count) {
+  if (e->zlen) {
+    assert(skip == 0 && count == e->len);
+    compress_forget(e->start);
+    free_blocks(e->start, extent_disk_blocks(e));
+  } else {
+    free_blocks(e->start + skip, count);
+  }
+}
+
+// Find the last entry with lblk <= the given block (0 if there is none).
+static int find_slot(extent_header_t *hdr, uint32_t lblk) {
+  extent_t *ents = entries(hdr);
+  int lo = 0;
+  int hi = hdr->count - 1;
+  int slot = 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ents[mid].lblk <= lblk) {
+      slot = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return slot;
+}
+
+// Insert an entry at the given position of a node that has room for it.
+static void put_entry(extent_header_t *hdr, int pos, extent_t ent) {
+  extent_t *ents = entries(hdr);
+  assert(hdr->count < hdr->max);
+  touch(hdr);
+  memmove(ents + pos + 1, ents + pos, (hdr->count - pos) * sizeof(extent_t));
+  ents[pos] = ent;
+  hdr->count++;
+}
+
+// Delete the entry at the given position.
+static void drop_entry(extent_header_t *hdr, int pos) {
+  extent_t *ents = entries(hdr);
+  touch(hdr);
+  memmove(ents + pos, ents + pos + 1,
+          (hdr->count - pos - 1) * sizeof(extent_t));
+  hdr->count--;
+}
+
+// Get the number of disk blocks an extent takes up.
+uint32_t extent_disk_blocks(const extent_t *ext) {
+  return ext->zlen ? bytes_to_blocks(ext->zlen) : ext->len;
+}
+
+// Initialize an empty extent tree root.
+void extent_init(extent_header_t *root, int max) {
+  memset(root, 0, sizeof(extent_header_t) + max * sizeof(extent_t));
+  root->max = max;
+  touch(root);
+}
+
+// Look up lblk in a subtree. On a miss, lowers *next to the first mapped
+// block after lblk that this subtree knows about.
+static int find(extent_header_t *hdr, uint32_t lblk, extent_t *ext,
+                uint32_t *next) {
+  if (hdr->count == 0) {
+    return 0;
+  }
+
+  extent_t *ents = entries(hdr);
+  int slot = find_slot(hdr, lblk);
+  if (hdr->depth) {
+    if (slot + 1 < hdr->count && ents[slot + 1].lblk < *next) {
+      *next = ents[slot + 1].lblk;
+    }
+    return find(child(&ents[slot]), lblk, ext, next);
+  }
+
+  extent_t *e = &ents[slot];
+  if (e->lblk <= lblk && lblk - e->lblk < e->len) {
+    *ext = *e;
+    return 1;
+  }
+  if (e->lblk > lblk) {
+    *next = e->lblk < *next ? e->lblk : *next;
+  } else if (slot + 1 < hdr->count && ents[slot + 1].lblk < *next) {
+    *next = ents[slot + 1].lblk;
+  }
+  return 0;
+}
+
+// Find the extent (or hole) containing the given file block.
+int extent_find(extent_header_t *root, uint32_t lblk, extent_t *ext) {
+  uint32_t next = UINT32_MAX;
+  if (find(root, lblk, ext, &next)) {
+    return 1;
+  }
+  ext->lblk = lblk;
+  ext->start = 0;
+  ext->len = next - lblk;
+  ext->zlen = 0;
+  return 0;
+}
+
+// Split the full child at the given slot of hdr (which has room) in two.
+// When the new extent goes past everything in the child, only the last
+// entry moves, so files written sequentially get nearly full nodes.
+static int split_child(extent_header_t *hdr, int slot, uint32_t lblk) {
+  extent_t *ents = entries(hdr);
+  extent_header_t *left = child(&ents[slot]);
+  extent_t *lents = entries(left);
+
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -1;
+  }
+  extent_header_t *right = (extent_header_t *) blocks_get_block(bnum);
+  extent_init(right, EXTENT_BLOCK_MAX);
+  right->depth = left->depth;
+
+  int keep = left->count / 2;
+  if (lblk > lents[left->count - 1].lblk) {
+    keep = left->count - 1;
+  }
+  right->count = left->count - keep;
+  memcpy(entries(right), lents + keep, right->count * sizeof(extent_t));
+  left->count = keep;
+  touch(left);
+
+  extent_t idx = {entries(right)[0].lblk, bnum, 0};
+  put_entry(hdr, slot + 1, idx);
+  return 0;
+}
+
+// Insert an extent into a subtree. Returns 0 on success, 1 if this node is
+// full and must be split by its parent first, -1 if out of blocks.
+static int insert(extent_header_t *hdr, extent_t ext) {
+  extent_t *ents = entries(hdr);
+  int slot = find_slot(hdr, ext.lblk);
+
+  if (hdr->depth) {
+    int rv = insert(child(&ents[slot]), ext);
+    if (rv == 1) {
+      if (hdr->count == hdr->max) {
+        return 1;
+      }
+      if (split_child(hdr, slot, ext.lblk) < 0) {
+        return -1;
+      }
+      return insert(hdr, ext);
+    }
+    if (ext.lblk < ents[slot].lblk) {
+      ents[slot].lblk = ext.lblk;
+      touch(hdr);
+    }
+    return rv;
+  }
+
+  int pos = 0;
+  if (hdr->count) {
+    pos = ents[slot].lblk <= ext.lblk ? slot + 1 : slot;
+  }
+
+  // grow a neighbour instead of adding an entry where possible
+  if (pos > 0 && contiguous(&ents[pos - 1], &ext)) {
+    touch(hdr);
+    ents[pos - 1].len += ext.len;
+    if (pos < hdr->count && contiguous(&ents[pos - 1], &ents[pos])) {
+      ents[pos - 1].len += ents[pos].len;
+      drop_entry(hdr, pos);
+    }
+    return 0;
+  }
+  if (pos < hdr->count && contiguous(&ext, &ents[pos])) {
+    touch(hdr);
+    ents[pos].lblk = ext.lblk;
+    ents[pos].start = ext.start;
+    ents[pos].len += ext.len;
+    return 0;
+  }
+
+  if (hdr->count == hdr->max) {
+    return 1;
+  }
+  put_entry(hdr, pos, ext);
+  return 0;
+}
+
+// Move the contents of a full root into a new block, leaving the root with
+// a single entry pointing at it.
+static int push_down(extent_header_t *root) {
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -1;
+  }
+  extent_header_t *node = (extent_header_t *) blocks_get_block(bnum);
+  extent_init(node, EXTENT_BLOCK_MAX);
+  node->depth = root->depth;
+  node->count = root->count;
+  memcpy(entries(node), entries(root), root->count * sizeof(extent_t));
+
+  extent_t idx = {entries(root)[0].lblk, bnum, 0};
+  touch(root);
+  root->depth++;
+  root->count = 1;
+  entries(root)[0] = idx;
+  return 0;
+}
+
+// Map a previously unmapped run of file blocks.
+int extent_insert(extent_header_t *root, extent_t ext) {
+  int rv = insert(root, ext);
+  if (rv == 1) {
+    if (push_down(root) < 0) {
+      return -1;
+    }
+    rv = insert(root, ext);
+  }
+  return rv;
+}
+
+// Make sure the leaf that maps lblk has room for need more entries,
+// splitting full nodes on the way down like insert(). Returns 0 on success,
+// 1 if hdr itself is full and must be split by its parent first, -1 if out
+// of blocks.
+static int make_room(extent_header_t *hdr, uint32_t lblk, int need) {
+  if (hdr->depth == 0) {
+    return hdr->count + need <= hdr->max ? 0 : 1;
+  }
+  int slot = find_slot(hdr, lblk);
+  int rv = make_room(child(&entries(hdr)[slot]), lblk, need);
+  if (rv != 1) {
+    return rv;
+  }
+  if (hdr->count == hdr->max) {
+    return 1;
+  }
+  if (split_child(hdr, slot, lblk) < 0) {
+    return -1;
+  }
+  return make_room(hdr, lblk, need);
+}
+
+// Make sure the leaf that maps lblk has room for need more entries,
+// growing the tree if the root is full. Returns 0, or -1 if out of blocks.
+static int reserve(extent_header_t *root, uint32_t lblk, int need) {
+  int rv = make_room(root, lblk, need);
+  if (rv == 1) {
+    if (push_down(root) < 0) {
+      return -1;
+    }
+    rv = make_room(root, lblk, need);
+  }
+  return rv < 0 ? -1 : 0;
+}
+
+// Move part of a mapped extent to other disk blocks.
+int extent_remap(extent_header_t *root, extent_t ext) {
+  // the extent may split in three; get room for that before changing
+  // anything, so running out of blocks leaves the mapping as it was
+  if (reserve(root, ext.lblk, 2) < 0) {
+    return -1;
+  }
+
+  extent_header_t *hdr = root;
+  while (hdr->depth) {
+    hdr = child(&entries(hdr)[find_slot(hdr, ext.lblk)]);
+  }
+  extent_t *ents = entries(hdr);
+  int slot = find_slot(hdr, ext.lblk);
+  extent_t *e = &ents[slot];
+  assert(e->lblk <= ext.lblk && ext.lblk + ext.len <= e->lblk + e->len);
+
+  extent_t was = *e;
+  uint32_t old = e->start + (ext.lblk - e->lblk);
+  uint32_t head = ext.lblk - e->lblk;
+  extent_t tail = {ext.lblk + ext.len, old + ext.len,
+                   e->lblk + e->len - (ext.lblk + ext.len)};
+  touch(hdr);
+  if (head) {
+    e->len = head;
+    put_entry(hdr, ++slot, ext);
+  } else {
+    *e = ext;
+  }
+  if (tail.len) {
+    put_entry(hdr, slot + 1, tail);
+  }
+
+  // copies made one after another end up in one extent
+  if (slot > 0 && contiguous(&ents[slot - 1], &ents[slot])) {
+    ents[slot - 1].len += ents[slot].len;
+    drop_entry(hdr, slot);
+  }
+  free_run(&was, ext.lblk - was.lblk, ext.len);
+  return 0;
+}
+
+// Move a whole extent to several runs of other disk blocks.
+int extent_remap_runs(extent_header_t *root, const extent_t *runs,
+                      int count) {
+  // the one entry becomes count of them; get the room first, like
+  // extent_remap()
+  if (reserve(root, runs[0].lblk, count) < 0) {
+    return -1;
+  }
+
+  extent_header_t *hdr = root;
+  while (hdr->depth) {
+    hdr = child(&entries(hdr)[find_slot(hdr, runs[0].lblk)]);
+  }
+  extent_t *ents = entries(hdr);
+  int slot = find_slot(hdr, runs[0].lblk);
+  extent_t was = ents[slot];
+  assert(was.lblk == runs[0].lblk &&
+         runs[count - 1].lblk + runs[count - 1].len == was.lblk + was.len);
+
+  touch(hdr);
+  ents[slot] = runs[0];
+  for (int ii = 1; ii < count; ++ii) {
+    put_entry(hdr, slot + ii, runs[ii]);
+  }
+  int last = slot + count - 1;
+  if (last + 1 < hdr->count && contiguous(&ents[last], &ents[last + 1])) {
+    ents[last].len += ents[last + 1].len;
+    drop_entry(hdr, last + 1);
+  }
+  if (slot > 0 && contiguous(&ents[slot - 1], &ents[slot])) {
+    ents[slot - 1].len += ents[slot].len;
+    drop_entry(hdr, slot);
+  }
+  free_run(&was, 0, was.len);
+  return 0;
+}
+
+// Give a copied subtree its own nodes. On failure the node is cut short
+// after the entries it owns, so the tree can still be removed.
+static int clone(extent_header_t *hdr) {
+  extent_t *ents = entries(hdr);
+  for (int ii = 0; ii < hdr->count; ++ii) {
+    if (hdr->depth == 0) {
+      share_blocks(ents[ii].start, extent_disk_blocks(&ents[ii]));
+      continue;
+    }
+    int bnum = alloc_block();
+    touch(hdr);
+    if (bnum < 0) {
+      hdr->count = ii;
+      return -1;
+    }
+    memcpy(blocks_get_block(bnum), child(&ents[ii]), BLOCK_SIZE);
+    journal_dirty(blocks_get_block(bnum), BLOCK_SIZE, 1);
+    ents[ii].start = bnum;
+    if (clone(child(&ents[ii])) < 0) {
+      hdr->count = ii + 1;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Give a copy of an extent tree its own nodes, sharing its data blocks.
+int extent_clone(extent_header_t *root) {
+  return clone(root);
+}
+
+// Unmap [lo, hi) in a subtree. An extent that covers the whole range on
+// both sides keeps its head; its tail is passed back to be reinserted.
+static void remove_range(extent_header_t *hdr, uint64_t lo, uint64_t hi,
+                         extent_t *tail) {
+  extent_t *ents = entries(hdr);
+  int i = find_slot(hdr, lo);
+
+  if (hdr->depth) {
+    while (i < hdr->count && ents[i].lblk < hi) {
+      extent_header_t *c = child(&ents[i]);
+      remove_range(c, lo, hi, tail);
+      if (c->count == 0) {
+        free_block(ents[i].start);
+        drop_entry(hdr, i);
+        continue;
+      }
+      ents[i].lblk = entries(c)[0].lblk;
+      touch(hdr);
+      i++;
+    }
+    return;
+  }
+
+  while (i < hdr->count && ents[i].lblk < hi) {
+    extent_t *e = &ents[i];
+    uint64_t es = e->lblk;
+    uint64_t ee = es + e->len;
+    if (ee <= lo) {
+      i++;
+      continue;
+    }
+
+    uint64_t cut_lo = es > lo ? es : lo;
+    uint64_t cut_hi = ee < hi ? ee : hi;
+    free_run(e, cut_lo - es, cut_hi - cut_lo);
+    touch(hdr);
+
+    if (cut_lo > es && cut_hi < ee) {
+      tail->lblk = cut_hi;
+      tail->start = e->start + (cut_hi - es);
+      tail->len = ee - cut_hi;
+      e->len = cut_lo - es;
+      i++;
+    } else if (cut_lo > es) {
+      e->len = cut_lo - es;
+      i++;
+    } else if (cut_hi < ee) {
+      e->lblk = cut_hi;
+      e->start += cut_hi - es;
+      e->len = ee - cut_hi;
+      i++;
+    } else {
+      drop_entry(hdr, i);
+    }
+  }
+}
+
+// Unmap a range of file blocks, freeing their disk blocks.
+int extent_remove(extent_header_t *root, uint32_t lblk, uint32_t count) {
+  // an extent split in two needs another entry, and freeing shared blocks
+  // frees no room for a node split; get the room before changing anything
+  extent_t ext;
+  uint64_t end = (uint64_t) lblk + count;
+  if (extent_find(root, lblk, &ext) && ext.lblk < lblk &&
+      ext.lblk + ext.len > end && reserve(root, lblk, 1) < 0) {
+    return -1;
+  }
+
+  extent_t tail = {0, 0, 0, 0};
+  remove_range(root, lblk, end, &tail);
+  if (root->count == 0) {
+    touch(root);
+    root->depth = 0;
+  }
+  if (tail.len) {
+    // the leaf has room, so this needs no new block
+    int rv = extent_insert(root, tail);
+    assert(rv == 0);
+  }
+  return 0;
+}
+
+// Get the file block just past the last mapped one.
+uint32_t extent_end(extent_header_t *root) {
+  extent_header_t *hdr = root;
+  if (hdr->count == 0) {
+    return 0;
+  }
+  while (hdr->depth) {
+    hdr = child(&entries(hdr)[hdr->count - 1]);
+  }
+  extent_t *last = &entries(hdr)[hdr->count - 1];
+  return last->lblk + last->len;
+}
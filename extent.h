@@ -0,0 +1,167 @@
+/**
+ * @file extent.h
+ *
+ * Extent-based mapping from file blocks to disk blocks.
+ *
+ * A file's blocks are described by extents, runs of consecutive file blocks
+ * stored in consecutive disk blocks. The extents live in a B+tree whose root
+ * is stored inline in the inode: small files keep their few extents directly
+ * in the inode, fragmented files spill into tree nodes, one per block.
+ *
+ * Every node (including the root) is an extent_header_t followed directly by
+ * its entries. Leaf entries (depth 0) are extents; interior entries reuse
+ * extent_t with lblk the first file block of the child's subtree and start
+ * the child's block number.
+ *
+ * An extent with a nonzero zlen is compressed (see compress.h): its len
+ * file blocks are stored as zlen bytes of compressed data, in as many disk
+ * blocks as that takes. A compressed extent is never merged with others and
+ * is only ever unmapped or remapped as a whole.
+ */
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+typedef struct extent {
+  uint32_t lblk;  // first file block covered
+  uint32_t start; // first disk block (child node block in interior nodes)
+  uint32_t len;   // number of blocks (unused in interior nodes)
+  uint32_t zlen;  // bytes of compressed data, or 0 if stored as is
+} extent_t;
+
+typedef struct extent_header {
+  uint16_t count;     // entries in use
+  uint16_t max;       // entries that fit in this node
+  uint16_t depth;     // 0 if the entries are extents, else tree height
+  uint16_t _reserved;
+} extent_header_t;
+
+// number of entries in a tree node that fills a whole block
+#define EXTENT_BLOCK_MAX \
+  ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t))
+
+/**
+ * Initialize an empty extent tree root.
+ *
+ * @param root The root header, followed by room for max entries.
+ * @param max Number of entries that fit in the root.
+ */
+void extent_init(extent_header_t *root, int max);
+
+/**
+ * Get the number of disk blocks an extent takes up.
+ *
+ * @param ext The extent.
+ *
+ * @return len, or the blocks holding the compressed data.
+ */
+uint32_t extent_disk_blocks(const extent_t *ext);
+
+/**
+ * Find the extent that maps the given file block.
+ *
+ * If the block is mapped, ext is set to the whole extent containing it.
+ * Otherwise ext describes the hole around it: lblk is the requested block,
+ * start is 0 and len runs up to the next mapped block (or the end of the
+ * addressable range).
+ *
+ * @param root Root of the extent tree.
+ * @param lblk File block to look up.
+ * @param ext Filled in with the extent or hole.
+ *
+ * @return 1 if the block is mapped, 0 if it falls in a hole.
+ */
+int extent_find(extent_header_t *root, uint32_t lblk, extent_t *ext);
+
+/**
+ * Map a previously unmapped run of file blocks.
+ *
+ * The new extent is merged with its neighbours when they are contiguous both
+ * in the file and on disk, so appending to a file grows its last extent.
+ *
+ * @param root Root of the extent tree.
+ * @param ext The run to map.
+ *
+ * @return 0 on success, -1 if no block was free to grow the tree.
+ */
+int extent_insert(extent_header_t *root, extent_t ext);
+
+/**
+ * Move part of a mapped extent to other disk blocks.
+ *
+ * Used to copy blocks on write: the run starting at ext.lblk is mapped to
+ * ext.start instead, and the blocks that backed it are freed (for shared
+ * blocks, that only drops an owner). The run must lie within one extent,
+ * and cover all of it if that extent is compressed. Either the old or the
+ * new extent may be compressed, which is how clusters are compressed and
+ * expanded again.
+ *
+ * @param root Root of the extent tree.
+ * @param ext The run and its new disk blocks.
+ *
+ * @return 0 on success, -1 if no block was free to grow the tree, in which
+ *         case nothing changed.
+ */
+int extent_remap(extent_header_t *root, extent_t ext);
+
+/**
+ * Move a whole extent to several runs of other disk blocks.
+ *
+ * Like extent_remap(), for when the new blocks don't come in one run: the
+ * runs must follow each other in the file and together cover exactly one
+ * extent (which may be compressed), whose blocks are then freed.
+ *
+ * @param root Root of the extent tree.
+ * @param runs The runs and their new disk blocks, in file order.
+ * @param count Number of runs.
+ *
+ * @return 0 on success, -1 if no block was free to grow the tree, in which
+ *         case nothing changed.
+ */
+int extent_remap_runs(extent_header_t *root, const extent_t *runs,
+                      int count);
+
+/**
+ * Give a copy of an extent tree its own tree nodes.
+ *
+ * The root has already been copied; every node below it is copied to a new
+ * block and every data block gains an owner (see share_blocks()), so the
+ * copy and the original can each be changed or removed on their own.
+ *
+ * @param root Root of the copy.
+ *
+ * @return 0 on success, -1 if out of blocks. The copy then holds only what
+ *         it owns, and must still be removed with extent_remove().
+ */
+int extent_clone(extent_header_t *root);
+
+/**
+ * Unmap a range of file blocks, freeing the disk blocks that backed it.
+ *
+ * Extents straddling either end of the range are trimmed (or split) and
+ * tree nodes that become empty are freed. Compressed extents can't be
+ * trimmed, so they must lie wholly inside or outside the range.
+ *
+ * @param root Root of the extent tree.
+ * @param lblk First file block to unmap.
+ * @param count Number of file blocks to unmap.
+ *
+ * @return 0 on success, -1 if an extent had to be split and no block was
+ *         free to grow the tree, in which case nothing changed. Removing
+ *         everything from lblk on never fails.
+ */
+int extent_remove(extent_header_t *root, uint32_t lblk, uint32_t count);
+
+/**
+ * Get the file block just past the last mapped one.
+ *
+ * @param root Root of the extent tree.
+ *
+ * @return End of the last extent, or 0 if nothing is mapped.
+ */
+uint32_t extent_end(extent_header_t *root);
+
+#endif
@@ -1,10 +1,253 @@
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
 
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "compress.h"
 #include "directory.h"
+#include "journal.h"
+
+// no inode below this index is free; alloc_inode() starts searching here
+static int inode_hint = 1;
+
+// block group the next top-level directory is spread to
+static int dir_group = 0;
+
+// serializes the inode bitmap, inode_hint and dir_group between FUSE threads
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// in-memory state of each inode, indexed by inum
+typedef struct inode_state {
+  pthread_rwlock_t lock;
+  int opens;    // open file handles pinning the inode
+  int unlinked; // no directory refers to it; free on the last close
+
+  // changes since the last commit, for fsync; guarded by lock
+  uint64_t meta_gen;        // journal generation of the last metadata change
+  uint64_t data_gen;        // journal generation the ranges belong to
+  journal_range_t *ranges;  // data blocks written, in write order
+  int range_count;
+  int range_room;
+  int range_overflow;       // out of memory, so ranges is incomplete
+
+  // blocks mapped ahead of appends, past the end; guarded by lock
+  uint32_t ahead_start;
+  uint32_t ahead_end; // 0 if none
+
+  // sequential read detection; readers share lock, so accessed atomically
+  uint32_t read_next;   // block after the last one read
+  uint32_t read_ahead;  // block after the last one prefetched
+  uint32_t read_window; // blocks prefetched at a time, 0 if not sequential
+} inode_state_t;
+
+static inode_state_t *states = 0;
+static int state_count = 0;
+
+// guards opens and unlinked
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Note that an inode's metadata changed in the current transaction.
+// free_inode() and others may get here without the inode lock.
+static void meta_changed(inode_t *node) {
+  inode_state_t *state = &states[inode_get_inum(node)];
+  __atomic_store_n(&state->meta_gen, journal_generation(), __ATOMIC_RELAXED);
+}
+
+/**
+ * Sets up the per-inode locks for the mounted image
+ *
+ * @return int 0 on success, -1 if out of memory.
+ */
+int inode_init() {
+  for (int ii = 0; ii < state_count; ++ii) {
+    pthread_rwlock_destroy(&states[ii].lock);
+    free(states[ii].ranges);
+  }
+  free(states);
+
+  state_count = get_superblock()->inode_count;
+  states = calloc(state_count, sizeof(inode_state_t));
+  if (!states) {
+    state_count = 0;
+    return -1;
+  }
+  for (int ii = 0; ii < state_count; ++ii) {
+    pthread_rwlock_init(&states[ii].lock, 0);
+  }
+  inode_hint = 1;
+  return 0;
+}
+
+/**
+ * Locks an inode for reading or writing
+ *
+ * @param inum Inode to lock
+ * @param write Nonzero to lock for writing
+ */
+void inode_lock(int inum, int write) {
+  assert(inum >= 0 && inum < state_count);
+  if (write) {
+    pthread_rwlock_wrlock(&states[inum].lock);
+  } else {
+    pthread_rwlock_rdlock(&states[inum].lock);
+  }
+}
+
+/**
+ * Unlocks an inode locked with inode_lock()
+ *
+ * @param inum Inode to unlock
+ */
+void inode_unlock(int inum) {
+  pthread_rwlock_unlock(&states[inum].lock);
+}
+
+/**
+ * Locks an inode for reading or writing if nobody holds it in the way
+ *
+ * @param inum Inode to lock
+ * @param write Nonzero to lock for writing
+ *
+ * @return int 0 if it was locked, -1 if it is busy.
+ */
+int inode_trylock(int inum, int write) {
+  assert(inum >= 0 && inum < state_count);
+  int rv = write ? pthread_rwlock_trywrlock(&states[inum].lock)
+                 : pthread_rwlock_tryrdlock(&states[inum].lock);
+  return rv ? -1 : 0;
+}
+
+/**
+ * Pins an inode for an open file handle or a kernel lookup reference
+ *
+ * @param inum Inode being opened or looked up
+ */
+void inode_pin(int inum) {
+  assert(inum >= 0 && inum < state_count);
+  pthread_mutex_lock(&pin_lock);
+  states[inum].opens++;
+  pthread_mutex_unlock(&pin_lock);
+}
+
+/**
+ * Unpins an inode when a file handle is closed or a reference dropped
+ *
+ * @param inum Inode being closed or forgotten
+ */
+void inode_unpin(int inum) {
+  pthread_mutex_lock(&pin_lock);
+  inode_state_t *state = &states[inum];
+  assert(state->opens > 0);
+  int last = --state->opens == 0 && state->unlinked;
+  if (last) {
+    state->unlinked = 0;
+  }
+  pthread_mutex_unlock(&pin_lock);
+
+  if (last) {
+    free_inode(inum);
+  }
+}
+
+/**
+ * Pins an inode only if it is in use
+ *
+ * @param inum Inode to pin
+ *
+ * @return int 1 if it was pinned, 0 if it is free.
+ */
+int inode_pin_used(int inum) {
+  assert(inum >= 0 && inum < state_count);
+  // a pinned inode can't be freed, so it can't be reused either
+  pthread_mutex_lock(&alloc_lock);
+  int used = bitmap_get(get_inode_bitmap(), inum);
+  if (used) {
+    inode_pin(inum);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return used;
+}
+
+/**
+ * Checks whether an inode is in use
+ *
+ * @param inum Inode to check, which may be out of range
+ *
+ * @return int 1 if it is in use, 0 if it is free or no inode at all.
+ */
+int inode_is_used(int inum) {
+  // inode 0 is never handed out
+  if (inum <= 0 || inum >= state_count) {
+    return 0;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  int used = bitmap_get(get_inode_bitmap(), inum);
+  pthread_mutex_unlock(&alloc_lock);
+  return used;
+}
+
+/**
+ * Finds the first inode in use from inum on
+ *
+ * @param inum Where to start looking
+ *
+ * @return int The inode found, or -1 if there is none.
+ */
+int inode_next_used(int inum) {
+  pthread_mutex_lock(&alloc_lock);
+  inum = bitmap_next_one(get_inode_bitmap(), state_count, inum);
+  pthread_mutex_unlock(&alloc_lock);
+  return inum;
+}
+
+/**
+ * Drops a directory's reference to an inode
+ *
+ * @param inum Inode that was unlinked
+ */
+void unlink_inode(int inum) {
+  pthread_mutex_lock(&pin_lock);
+  inode_state_t *state = &states[inum];
+  int open = state->opens > 0;
+  if (open) {
+    state->unlinked = 1;
+  }
+  pthread_mutex_unlock(&pin_lock);
+
+  if (!open) {
+    free_inode(inum);
+  }
+}
+
+/**
+ * Checks whether an inode is only kept alive by pins
+ *
+ * @param inum Inode to check
+ *
+ * @return int 1 if no directory refers to it any more, 0 if one does.
+ */
+int inode_unlinked(int inum) {
+  pthread_mutex_lock(&pin_lock);
+  int unlinked = states[inum].unlinked;
+  pthread_mutex_unlock(&pin_lock);
+  return unlinked;
+}
+
+/**
+ * Gets the journal generation of the last change to an inode or its data
+ *
+ * @param inum Inode locked for reading or writing
+ *
+ * @return uint64_t The generation, or 0 if it hasn't changed since mount.
+ */
+uint64_t inode_generation(int inum) {
+  inode_state_t *state = &states[inum];
+  uint64_t meta = __atomic_load_n(&state->meta_gen, __ATOMIC_RELAXED);
+  return meta > state->data_gen ? meta : state->data_gen;
+}
 
 /**
  * Gets inode of inum
@@ -12,27 +255,216 @@
  * @return inode_t* Pointer to inode
  */
 inode_t *get_inode(int inum) {
-  assert(inum >= 0 && inum <= 255);
+  assert(inum >= 0 && inum < get_superblock()->inode_count);
   inode_t *table = (inode_t *)get_inode_table();
   inode_t *node = table + inum;
   return node;
 }
 
+/**
+ * Marks an inode as changed
+ *
+ * @param node Pointer into the inode table
+ */
+void inode_dirty(inode_t *node) {
+  journal_dirty(node, sizeof(inode_t), 1);
+  meta_changed(node);
+}
+
+/**
+ * Marks part of a file's data as changed
+ *
+ * @param node Inode the data belongs to
+ * @param ptr Start of the changed bytes, a pointer into the mapping
+ * @param len Number of changed bytes
+ */
+void inode_dirty_data(inode_t *node, const void *ptr, size_t len) {
+  journal_dirty(ptr, len, 0);
+
+  inode_state_t *state = &states[inode_get_inum(node)];
+  uint64_t gen = journal_generation();
+  if (state->data_gen != gen) {
+    // everything recorded before is committed
+    state->data_gen = gen;
+    state->range_count = 0;
+    state->range_overflow = 0;
+  }
+
+  size_t pos = (const char *) ptr - (char *) blocks_get_block(0);
+  uint32_t start = pos / BLOCK_SIZE;
+  uint32_t end = (pos + len - 1) / BLOCK_SIZE + 1;
+
+  // sequential writes extend the last range
+  if (state->range_count) {
+    journal_range_t *last = &state->ranges[state->range_count - 1];
+    if (start >= last->start && start <= last->start + last->len) {
+      if (end > last->start + last->len) {
+        last->len = end - last->start;
+      }
+      return;
+    }
+  }
+  if (state->range_count == state->range_room) {
+    int room = state->range_room ? state->range_room * 2 : 8;
+    journal_range_t *ranges =
+        realloc(state->ranges, room * sizeof(journal_range_t));
+    if (!ranges) {
+      state->range_overflow = 1;
+      return;
+    }
+    state->ranges = ranges;
+    state->range_room = room;
+  }
+  state->ranges[state->range_count++] = (journal_range_t){start, end - start};
+}
+
+// Order ranges by first block, for qsort().
+static int range_cmp(const void *a, const void *b) {
+  uint32_t x = ((const journal_range_t *) a)->start;
+  uint32_t y = ((const journal_range_t *) b)->start;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Makes a file's changes since the last commit durable, if that can be
+ * done without a commit
+ *
+ * @param node Inode locked for writing, inside journal_begin()/journal_end()
+ *
+ * @return int 0 on success, 1 if the metadata changed too and a commit is
+ *         needed, -EIO if the image couldn't be written.
+ */
+int inode_sync(inode_t *node) {
+  inode_state_t *state = &states[inode_get_inum(node)];
+  uint64_t gen = journal_generation();
+  if (__atomic_load_n(&state->meta_gen, __ATOMIC_RELAXED) == gen) {
+    return 1;
+  }
+  if (state->data_gen != gen || state->range_count == 0) {
+    return 0;
+  }
+  if (state->range_overflow) {
+    return 1;
+  }
+
+  // sort and coalesce, so the image is written in as few runs as possible
+  journal_range_t *ranges = state->ranges;
+  qsort(ranges, state->range_count, sizeof(journal_range_t), range_cmp);
+  int count = 1;
+  for (int ii = 1; ii < state->range_count; ++ii) {
+    journal_range_t *last = &ranges[count - 1];
+    if (ranges[ii].start <= last->start + last->len) {
+      uint32_t end = ranges[ii].start + ranges[ii].len;
+      if (end > last->start + last->len) {
+        last->len = end - last->start;
+      }
+    } else {
+      ranges[count++] = ranges[ii];
+    }
+  }
+  state->range_count = count;
+
+  int rv = journal_sync_data(ranges, count);
+  if (rv == 0) {
+    state->range_count = 0;
+  }
+  return rv;
+}
+
+/**
+ * Gets inum of inode
+ *
+ * @param node Pointer into the inode table
+ *
+ * @return int Inum of the inode
+ */
+int inode_get_inum(inode_t *node) {
+  return node - (inode_t *)get_inode_table();
+}
+
+// Add delta to the superblock's count of free inodes. Called with
+// alloc_lock held; statfs reads the count without it.
+static void count_free_inodes(int delta) {
+  superblock_t *sb = get_superblock();
+  __atomic_store_n(&sb->free_inodes, sb->free_inodes + delta,
+                   __ATOMIC_RELAXED);
+  journal_dirty(&sb->free_inodes, sizeof(sb->free_inodes), 1);
+}
+
+// Get the block group whose blocks an inode's data starts out in. Inodes
+// map onto groups in order, so inodes close together share a group.
+static int inode_group(int inum) {
+  return (int64_t) inum * blocks_group_count() /
+         get_superblock()->inode_count;
+}
+
+// Get the first inode that maps onto a block group.
+static int group_first_inode(int group) {
+  int64_t count = get_superblock()->inode_count;
+  return (group * count + blocks_group_count() - 1) / blocks_group_count();
+}
+
+// Pick the block group for a new top-level directory: the next one, round
+// robin, with at least the average number of free blocks. Called with
+// alloc_lock held.
+static int spread_group() {
+  int groups = blocks_group_count();
+  int64_t total = 0;
+  for (int ii = 0; ii < groups; ++ii) {
+    total += blocks_group_free(ii);
+  }
+  for (int ii = 0; ii < groups; ++ii) {
+    int group = (dir_group + ii) % groups;
+    if ((int64_t) blocks_group_free(group) * groups >= total) {
+      dir_group = group + 1;
+      return group;
+    }
+  }
+  return dir_group++ % groups;
+}
+
 /**
  * Allocates new inode
  *
+ * @param parent Inum of the directory the inode goes in, 0 for none.
+ * @param dir Whether the inode is for a directory.
+ *
  * @return int Inum to new inode, or -1 if failure.
  */
-int alloc_inode() {
+int alloc_inode(int parent, int dir) {
   // inode 0 used as unininitialized inode
-  for (int i = 1; i < INODE_COUNT; ++i) {
-    void *ibm = get_inode_bitmap();
-    if (!bitmap_get(ibm, i)) {
-      bitmap_put(ibm, i, 1);
-      return i;
+  void *ibm = get_inode_bitmap();
+  int count = get_superblock()->inode_count;
+  pthread_mutex_lock(&alloc_lock);
+  int start = inode_hint;
+  if (dir && parent == 1) {
+    start = group_first_inode(spread_group());
+  } else if (parent > 0) {
+    start = parent;
+  }
+  start = start > inode_hint ? start : inode_hint;
+  int inum = bitmap_next_zero(ibm, count, start);
+  if (inum < 0) {
+    inum = bitmap_next_zero(ibm, count, inode_hint);
+  }
+  if (inum >= 0) {
+    bitmap_put(ibm, inum, 1);
+    journal_dirty((char *) ibm + inum / 8, 1, 1);
+    count_free_inodes(-1);
+    if (inum == inode_hint) {
+      inode_hint = inum + 1;
     }
   }
-  return -1;
+  pthread_mutex_unlock(&alloc_lock);
+  if (inum < 0) {
+    return -1;
+  }
+
+  inode_t *node = get_inode(inum);
+  memset(node, 0, sizeof(inode_t));
+  extent_init(&node->tree, INODE_EXTENTS);
+  inode_dirty(node);
+  return inum;
 }
 
 /**
@@ -43,25 +475,70 @@ int alloc_inode() {
 void free_inode(int inum) {
   inode_t *node = get_inode(inum);
   if(node->mode & 040000){
-    dirent_t *entries = (dirent_t *)blocks_get_block(node->block);
-    for(int i = 0; i < DIRENT_COUNT; i++){
-      dirent_t *entry = entries + i;
-      if(!strlen(entry->name)) continue;
-      free_inode(entry->inum);
-    }
-    memset(entries, 0, BLOCK_SIZE);
-  }
-  free_block(node->block);
-  if (node->iblock) {
-    int *iblock = blocks_get_block(node->iblock);
-    for(int i = 0; i < DIRENT_COUNT; i++) {
-      if(*(iblock + i)){
-        free_block(*(iblock + i));
-      }
-    }
+    directory_clear(node, inum);
   }
+  truncate_inode(node, 0);
   memset(node, 0, sizeof(inode_t));
+  inode_dirty(node);
+
+  pthread_mutex_lock(&alloc_lock);
   bitmap_put(get_inode_bitmap(), inum, 0);
+  journal_dirty((char *) get_inode_bitmap() + inum / 8, 1, 1);
+  count_free_inodes(1);
+  if (inum < inode_hint) {
+    inode_hint = inum;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Pick the disk block to put a file's block lblk in: the one after the
+// disk block of the file block before it, if that is mapped, else the
+// start of the inode's block group.
+static int goal_for(inode_t *node, uint32_t lblk) {
+  extent_t prev;
+  if (lblk == 0 || !inode_get_extent(node, lblk - 1, &prev)) {
+    return inode_group(inode_get_inum(node)) * BLOCKS_PER_GROUP;
+  }
+  if (prev.zlen) {
+    return prev.start + extent_disk_blocks(&prev);
+  }
+  return prev.start + (lblk - prev.lblk);
+}
+
+// Replace a compressed extent with plain blocks holding its data, in as
+// many runs as free space comes in. Returns 0, or -1 if the disk is full or
+// the data is corrupt.
+static int expand(inode_t *node, extent_t *ext) {
+  char plain[COMPRESS_CLUSTER_BYTES];
+  if (ext->len > COMPRESS_CLUSTER || compress_unpack(ext, plain) < 0) {
+    return -1;
+  }
+
+  extent_t runs[COMPRESS_CLUSTER];
+  int count = 0;
+  uint32_t done = 0;
+  int goal = goal_for(node, ext->lblk);
+  while (done < ext->len) {
+    int got;
+    int start = alloc_blocks(goal, ext->len - done, &got);
+    if (start < 0) {
+      break;
+    }
+    char *dst = blocks_get_blocks(start, got);
+    memcpy(dst, plain + (size_t) done * BLOCK_SIZE, (size_t) got * BLOCK_SIZE);
+    journal_dirty(dst, (size_t) got * BLOCK_SIZE, 0);
+    runs[count++] = (extent_t) {ext->lblk + done, start, got};
+    done += got;
+    goal = start + got;
+  }
+  if (done < ext->len || extent_remap_runs(&node->tree, runs, count) < 0) {
+    for (int ii = 0; ii < count; ++ii) {
+      free_blocks(runs[ii].start, runs[ii].len);
+    }
+    return -1;
+  }
+  meta_changed(node);
+  return 0;
 }
 
 /**
@@ -69,53 +546,390 @@ void free_inode(int inum) {
  *
  * @param node Node object to be grown
  * @param size Desired final size of the node
+ *
+ * @return int 0 on success, -1 if the disk is full.
+ */
+int grow_inode(inode_t *node, int64_t size) {
+  uint32_t curblocks = extent_end(&node->tree);
+  uint32_t newblocks = bytes_to_blocks(size);
+  if (curblocks >= newblocks) {
+    return 0;
+  }
+  return inode_map(node, curblocks, newblocks - curblocks);
+}
+
+/**
+ * Maps the holes in a range of a file to new, zeroed blocks
+ *
+ * @param node Node object to be mapped
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full.
+ */
+int inode_map(inode_t *node, uint32_t lblk, uint32_t count) {
+  uint64_t end = (uint64_t) lblk + count;
+  while (lblk < end) {
+    extent_t ext;
+    if (inode_get_extent(node, lblk, &ext)) {
+      lblk = ext.lblk + ext.len;
+      continue;
+    }
+    uint64_t stop = (uint64_t) ext.lblk + ext.len;
+    stop = stop < end ? stop : end;
+
+    // try to continue right after the blocks before the hole
+    int got;
+    int start = alloc_blocks(goal_for(node, lblk), stop - lblk, &got);
+    if (start < 0) {
+      return -1;
+    }
+    extent_t mapped = {lblk, start, got};
+    if (extent_insert(&node->tree, mapped) < 0) {
+      free_blocks(start, got);
+      return -1;
+    }
+    // freed blocks keep whatever they last held
+    char *fresh = blocks_get_blocks(start, got);
+    memset(fresh, 0, (size_t) got * BLOCK_SIZE);
+    journal_dirty(fresh, (size_t) got * BLOCK_SIZE,
+                  (node->mode & 040000) != 0);
+    lblk += got;
+    meta_changed(node);
+  }
+  return 0;
+}
+
+/**
+ * Maps the holes in a range of a file for a write through an open file
+ *
+ * @param node Node object to be mapped
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full.
+ */
+int inode_map_append(inode_t *node, uint32_t lblk, uint32_t count) {
+  uint64_t end = (uint64_t) lblk + count;
+  if (end <= extent_end(&node->tree) ||
+      lblk > (uint64_t) bytes_to_blocks(node->size)) {
+    return inode_map(node, lblk, count);
+  }
+
+  // as many blocks as the file will have, so the runs double as it grows
+  uint64_t ahead = end < INODE_AHEAD_MAX ? end : INODE_AHEAD_MAX;
+  if (end + ahead > UINT32_MAX) {
+    ahead = UINT32_MAX - end;
+  }
+  int rv = inode_map(node, lblk, count + ahead);
+
+  // whatever got mapped past the range is for inode_trim() to free
+  inode_state_t *state = &states[inode_get_inum(node)];
+  if (!state->ahead_end) {
+    state->ahead_start = end;
+  }
+  state->ahead_end = end + ahead;
+  if (!(node->flags & INODE_AHEAD)) {
+    node->flags |= INODE_AHEAD;
+    inode_dirty(node);
+  }
+  // the range itself may still fit when the blocks ahead didn't
+  return rv == 0 ? 0 : inode_map(node, lblk, count);
+}
+
+/**
+ * Frees the blocks inode_map_append() mapped ahead of a file's end that the
+ * file hasn't grown into
+ *
+ * @param node Node object to be trimmed
+ */
+void inode_trim(inode_t *node) {
+  inode_state_t *state = &states[inode_get_inum(node)];
+  uint32_t keep = bytes_to_blocks(node->size);
+  uint32_t start = state->ahead_start > keep ? state->ahead_start : keep;
+  // fails only if fallocate mapped blocks right after them and the tree
+  // can't grow to split the extent; they then stay mapped
+  if (state->ahead_end > start &&
+      extent_remove(&node->tree, start, state->ahead_end - start) == 0) {
+    meta_changed(node);
+  }
+  state->ahead_start = 0;
+  state->ahead_end = 0;
+  if (node->flags & INODE_AHEAD) {
+    node->flags &= ~INODE_AHEAD;
+    inode_dirty(node);
+  }
+}
+
+/**
+ * Frees the blocks mapped ahead of appends that a crash left mapped
+ *
+ * @return int Number of files trimmed.
+ */
+int inode_trim_crashed() {
+  int count = 0;
+  for (int inum = inode_next_used(1); inum >= 0;
+       inum = inode_next_used(inum + 1)) {
+    inode_t *node = get_inode(inum);
+    if (!(node->flags & INODE_AHEAD)) {
+      continue;
+    }
+    // where the blocks ahead were mapped is gone with the crash, so all
+    // past the end go, short of cutting into a compressed cluster
+    uint32_t keep = bytes_to_blocks(node->size);
+    extent_t ext;
+    if (inode_get_extent(node, keep, &ext) && ext.zlen && ext.lblk < keep) {
+      keep = ext.lblk + ext.len;
+    }
+    uint32_t end = extent_end(&node->tree);
+    if (end > keep) {
+      extent_remove(&node->tree, keep, end - keep);
+    }
+    node->flags &= ~INODE_AHEAD;
+    inode_dirty(node);
+    count++;
+  }
+  return count;
+}
+
+// Start reading the data of file blocks [lblk, end) in the background.
+static void prefetch(inode_t *node, uint32_t lblk, uint32_t end) {
+  while (lblk < end) {
+    extent_t ext;
+    if (!inode_get_extent(node, lblk, &ext)) {
+      lblk = ext.lblk + ext.len;
+      continue;
+    }
+    if (ext.zlen) {
+      blocks_prefetch(ext.start, extent_disk_blocks(&ext));
+    } else {
+      uint32_t stop = ext.lblk + ext.len < end ? ext.lblk + ext.len : end;
+      blocks_prefetch(ext.start + (lblk - ext.lblk), stop - lblk);
+    }
+    lblk = ext.lblk + ext.len;
+  }
+}
+
+/**
+ * Notes a read of a file, reading ahead of it if reads are sequential
+ *
+ * @param node Node object being read, locked for reading
+ * @param lblk First file block of the read
+ * @param count Number of file blocks in the read
  */
-void grow_inode(inode_t *node, int size) {
-  int curblocks = node->size / BLOCK_SIZE + 1;
-  if (!(node->size % BLOCK_SIZE)) {
-    curblocks--;
+void inode_readahead(inode_t *node, uint32_t lblk, uint32_t count) {
+  inode_state_t *state = &states[inode_get_inum(node)];
+  uint32_t end = lblk + count;
+  uint32_t next = __atomic_exchange_n(&state->read_next, end, __ATOMIC_RELAXED);
+  if (lblk != next) {
+    __atomic_store_n(&state->read_window, 0, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // once the reader is within half a window of what was prefetched, fetch
+  // another window, twice as long as the last one
+  uint32_t window = __atomic_load_n(&state->read_window, __ATOMIC_RELAXED);
+  uint32_t ahead = __atomic_load_n(&state->read_ahead, __ATOMIC_RELAXED);
+  if (window && ahead > end + window / 2) {
+    return;
   }
-  if (curblocks == 0) {
-    curblocks = 1;
+  window = window ? window * 2 : INODE_READ_AHEAD_MIN;
+  window = window < INODE_READ_AHEAD_MAX ? window : INODE_READ_AHEAD_MAX;
+  uint32_t first = ahead > end ? ahead : end;
+  uint64_t stop = (uint64_t) end + window;
+  uint32_t size = bytes_to_blocks(node->size);
+  stop = stop < size ? stop : size;
+  if (first < stop) {
+    prefetch(node, first, stop);
   }
-  int newblocks = size / BLOCK_SIZE + 1;
-  if (!(size % BLOCK_SIZE)) {
-    newblocks--;
+  __atomic_store_n(&state->read_ahead, (uint32_t) stop, __ATOMIC_RELAXED);
+  __atomic_store_n(&state->read_window, window, __ATOMIC_RELAXED);
+}
+
+/**
+ * Unmaps a range of a file, leaving a hole that reads back as zeros
+ *
+ * @param node Node object to be changed
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full.
+ */
+int inode_punch(inode_t *node, uint32_t lblk, uint32_t count) {
+  // compressed extents can only be removed whole
+  uint64_t end = (uint64_t) lblk + count;
+  extent_t ext;
+  if (inode_get_extent(node, lblk, &ext) && ext.zlen && ext.lblk < lblk &&
+      expand(node, &ext) < 0) {
+    return -1;
   }
-  int i = 0;
-  while (newblocks > curblocks) {
-    if (!node->iblock) {
-      node->iblock = alloc_block();
+  if (inode_get_extent(node, end - 1, &ext) && ext.zlen &&
+      ext.lblk + ext.len > end && expand(node, &ext) < 0) {
+    return -1;
+  }
+
+  if (extent_remove(&node->tree, lblk, count) < 0) {
+    return -1;
+  }
+  meta_changed(node);
+  return 0;
+}
+
+/**
+ * Copies the shared blocks in a range of a file, so they can be changed
+ *
+ * @param node Node object to be changed
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full (or compressed data in
+ *         the range is corrupt).
+ */
+int inode_unshare(inode_t *node, uint32_t lblk, uint32_t count) {
+  uint64_t end = (uint64_t) lblk + count;
+  while (lblk < end) {
+    extent_t ext;
+    int mapped = inode_get_extent(node, lblk, &ext);
+    if (mapped && ext.zlen) {
+      // the copy is a plain one, which can be changed in place
+      if (expand(node, &ext) < 0) {
+        return -1;
+      }
+      lblk = ext.lblk + ext.len;
       continue;
     }
-    int *iblock = blocks_get_block(node->iblock);
-    while(*(iblock + i)) { // find next unused block index
-      i++;
+    uint64_t stop = (uint64_t) ext.lblk + ext.len;
+    stop = stop < end ? stop : end;
+    uint32_t bnum = ext.start + (lblk - ext.lblk);
+    if (!mapped || !block_shares(bnum)) {
+      // skip to the next shared block of the extent, if any
+      uint32_t run = 1;
+      while (mapped && lblk + run < stop && !block_shares(bnum + run)) {
+        run++;
+      }
+      lblk = mapped ? lblk + run : stop;
+      continue;
     }
-    *(iblock + i) = alloc_block();
-    curblocks++;
+
+    uint32_t want = 1;
+    while (lblk + want < stop && block_shares(bnum + want)) {
+      want++;
+    }
+    // keep the copies of a file's blocks together
+    int got;
+    int start = alloc_blocks(goal_for(node, lblk), want, &got);
+    if (start < 0) {
+      return -1;
+    }
+    char *copy = blocks_get_blocks(start, got);
+    memcpy(copy, blocks_get_blocks(bnum, got), (size_t) got * BLOCK_SIZE);
+    journal_dirty(copy, (size_t) got * BLOCK_SIZE, (node->mode & 040000) != 0);
+    extent_t moved = {lblk, start, got};
+    if (extent_remap(&node->tree, moved) < 0) {
+      free_blocks(start, got);
+      return -1;
+    }
+    meta_changed(node);
+    lblk += got;
   }
-  bitmap_print(get_blocks_bitmap(), 256);
+  return 0;
 }
 
 /**
- * Truncates inode (removes all blocks except default)
+ * Compresses the clusters a range of a file touches
+ *
+ * @param node Node object to be compressed
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ */
+void inode_compress(inode_t *node, uint32_t lblk, uint32_t count) {
+  uint64_t end = (uint64_t) lblk + count;
+  for (uint64_t first = lblk - lblk % COMPRESS_CLUSTER; first < end;
+       first += COMPRESS_CLUSTER) {
+    // only whole clusters of the file, all in one plain extent
+    uint64_t last = first + COMPRESS_CLUSTER;
+    extent_t ext;
+    if (last * BLOCK_SIZE > (uint64_t) node->size ||
+        !inode_get_extent(node, first, &ext) || ext.zlen ||
+        ext.lblk + ext.len < last) {
+      continue;
+    }
+
+    char packed[COMPRESS_CLUSTER_BYTES];
+    char *plain =
+        blocks_get_blocks(ext.start + (first - ext.lblk), COMPRESS_CLUSTER);
+    size_t zlen = compress_pack(plain, COMPRESS_CLUSTER_BYTES, packed);
+    if (zlen == 0) {
+      continue;
+    }
+    // right after the plain blocks, which is where an append would go
+    // next: it then continues after the compressed copy instead of in the
+    // hole the plain blocks leave, which would split the next cluster
+    uint32_t need = bytes_to_blocks(zlen);
+    int goal = ext.start + (first - ext.lblk) + COMPRESS_CLUSTER;
+    int got;
+    int start = alloc_blocks(goal, need, &got);
+    if (start < 0) {
+      return;
+    }
+    if ((uint32_t) got < need) {
+      free_blocks(start, got);
+      return;
+    }
+    char *dst = blocks_get_blocks(start, need);
+    memcpy(dst, packed, zlen);
+    memset(dst + zlen, 0, (size_t) need * BLOCK_SIZE - zlen);
+    journal_dirty(dst, (size_t) need * BLOCK_SIZE, 0);
+    extent_t compressed = {first, start, COMPRESS_CLUSTER, zlen};
+    if (extent_remap(&node->tree, compressed) < 0) {
+      free_blocks(start, need);
+      return;
+    }
+    meta_changed(node);
+  }
+}
+
+/**
+ * Truncates inode to the given size, freeing blocks past the end
  *
  * @param node Node object to be truncated
+ * @param size New size in bytes
  *
+ * @return int 0 on success, -1 if the last block is shared or compressed
+ *         and there was no room to copy it (nothing is changed then).
  */
-void truncate_inode(inode_t *node) {
-  int curblocks = 1;
-  if(!node->iblock) return; // inode is already smallest size
-  int *iblock = blocks_get_block(node->iblock);
-  for(int i = 0; i< BLOCK_SIZE / sizeof(int); i++){
-    if (*(iblock + i)) {
-      free_block(*(iblock + i));
-      memset(iblock + i, 0, sizeof(int));
+int truncate_inode(inode_t *node, int64_t size) {
+  // the rest of the last block gets zeroed, which a snapshot mustn't see,
+  // and a compressed extent can't be cut short
+  uint32_t keep = bytes_to_blocks(size);
+  extent_t ext;
+  int cut = inode_get_extent(node, keep, &ext) && ext.zlen && ext.lblk < keep;
+  if ((size % BLOCK_SIZE || cut) &&
+      inode_unshare(node, size / BLOCK_SIZE, 1) < 0) {
+    return -1;
+  }
+
+  uint32_t end = extent_end(&node->tree);
+  if (end > keep) {
+    extent_remove(&node->tree, keep, end - keep);
+  }
+  inode_state_t *state = &states[inode_get_inum(node)];
+  state->ahead_start = 0;
+  state->ahead_end = 0;
+  node->flags &= ~INODE_AHEAD;
+
+  // zero the rest of the last block so growing again reads back zeros
+  if (size % BLOCK_SIZE) {
+    int bnum = inode_get_bnum(node, size / BLOCK_SIZE);
+    if (bnum) {
+      char *block = blocks_get_block(bnum);
+      memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+      inode_dirty_data(node, block, BLOCK_SIZE);
     }
   }
-  free_block(node->iblock);
-  memset(iblock, 0, BLOCK_SIZE);
+  node->size = size;
+  inode_dirty(node);
+  return 0;
 }
 
 /**
@@ -124,14 +938,26 @@ void truncate_inode(inode_t *node) {
  * @param node Inode to access
  * @param file_bnum Nth block of inode
  *
- * @return int Bnum (block number).
+ * @return int Bnum (block number), or 0 if the block isn't mapped.
  */
 int inode_get_bnum(inode_t *node, int file_bnum) {
-  if (file_bnum == 0) {
-    return node->block;
+  extent_t ext;
+  if (!inode_get_extent(node, file_bnum, &ext)) {
+    return 0;
   }
-  int inum = file_bnum - 1;
-  int *base = (int *) blocks_get_block(node->iblock);
-  return base[inum];
+  assert(!ext.zlen);
+  return ext.start + (file_bnum - ext.lblk);
 }
 
+/**
+ * Gets the extent containing the nth block of inode
+ *
+ * @param node Inode to access
+ * @param file_bnum Nth block of inode
+ * @param ext Filled with the extent (or the hole) containing the block
+ *
+ * @return int 1 if the block is mapped, 0 if it's in a hole.
+ */
+int inode_get_extent(inode_t *node, int file_bnum, extent_t *ext) {
+  return extent_find(&node->tree, file_bnum, ext);
+}
@@ -9,16 +9,145 @@
 #include <stdint.h>
 
 #include "blocks.h"
+#include "extent.h"
 
-#define INODE_COUNT 256
+#define INODE_EXTENTS 4 // extents (or tree root entries) stored in the inode
+
+// largest file size, as file blocks are numbered with 32 bits
+#define INODE_MAX_SIZE ((int64_t) UINT32_MAX * BLOCK_SIZE)
+
+#define INODE_AHEAD_MAX 256 // most blocks mapped ahead of an appending write
+#define INODE_READ_AHEAD_MIN 8   // first read-ahead window, in blocks (32K)
+#define INODE_READ_AHEAD_MAX 256 // largest read-ahead window (1M)
+
+#define INODE_DIR_HASHED 1 // directory uses the hashed format (directory.h)
+#define INODE_AHEAD 2      // file may have blocks mapped ahead of appends
 
 typedef struct inode {
-  int mode;       // permission & type
-  int size;       // bytes
-  uint8_t block;  // single block pointer (if max file size <= 4K or directory)
-  uint8_t iblock; // indirect block pointer
+  int mode;                        // permission & type
+  int flags;                       // INODE_* flags
+  int64_t size;                    // bytes
+  extent_header_t tree;            // root of the block mapping...
+  extent_t extents[INODE_EXTENTS]; // ...and its entries
 } inode_t;
 
+/**
+ * Sets up the per-inode locks for the mounted image
+ *
+ * Called by blocks_init() once the image is mapped.
+ *
+ * @return int 0 on success, -1 if out of memory.
+ */
+int inode_init();
+
+/**
+ * Locks an inode for reading or writing
+ *
+ * Any number of readers, or a single writer, may hold an inode's lock. Hold
+ * it for reading to look at the inode's size or data, and for writing to
+ * change them.
+ *
+ * @param inum Inode to lock
+ * @param write Nonzero to lock for writing
+ */
+void inode_lock(int inum, int write);
+
+/**
+ * Unlocks an inode locked with inode_lock()
+ *
+ * @param inum Inode to unlock
+ */
+void inode_unlock(int inum);
+
+/**
+ * Locks an inode for reading or writing if nobody holds it in the way
+ *
+ * For code already holding another inode's lock, which mustn't wait.
+ *
+ * @param inum Inode to lock
+ * @param write Nonzero to lock for writing
+ *
+ * @return int 0 if it was locked, -1 if it is busy.
+ */
+int inode_trylock(int inum, int write);
+
+/**
+ * Pins an inode for an open file handle or a kernel lookup reference
+ *
+ * A pinned inode stays allocated even if it is unlinked, until the last
+ * handle is closed or reference dropped with inode_unpin().
+ *
+ * @param inum Inode being opened or looked up
+ */
+void inode_pin(int inum);
+
+/**
+ * Unpins an inode when a file handle is closed or a reference dropped
+ *
+ * Frees the inode if this was the last pin and it has been unlinked.
+ *
+ * @param inum Inode being closed or forgotten
+ */
+void inode_unpin(int inum);
+
+/**
+ * Pins an inode only if it is in use
+ *
+ * For code that finds inodes other than by name, which must keep them from
+ * being freed under it; unpin with inode_unpin().
+ *
+ * @param inum Inode to pin
+ *
+ * @return int 1 if it was pinned, 0 if it is free.
+ */
+int inode_pin_used(int inum);
+
+/**
+ * Checks whether an inode is in use
+ *
+ * @param inum Inode to check, which may be out of range
+ *
+ * @return int 1 if it is in use, 0 if it is free or no inode at all.
+ */
+int inode_is_used(int inum);
+
+/**
+ * Finds the first inode in use from inum on
+ *
+ * @param inum Where to start looking
+ *
+ * @return int The inode found, or -1 if there is none.
+ */
+int inode_next_used(int inum);
+
+/**
+ * Drops a directory's reference to an inode
+ *
+ * Frees the inode right away unless it is open, in which case it is freed
+ * when the last handle is closed.
+ *
+ * @param inum Inode that was unlinked
+ */
+void unlink_inode(int inum);
+
+/**
+ * Checks whether an inode is only kept alive by pins
+ *
+ * @param inum Inode to check
+ *
+ * @return int 1 if no directory refers to it any more, 0 if one does.
+ */
+int inode_unlinked(int inum);
+
+/**
+ * Gets the journal generation of the last change to an inode or its data
+ *
+ * @param inum Inode locked for reading or writing
+ *
+ * @return uint64_t The generation, or 0 if it hasn't changed since mount.
+ */
+uint64_t inode_generation(int inum);
+
 /**
  * Gets inode of inum
  *
@@ -26,12 +155,66 @@ typedef struct inode {
  */
 inode_t *get_inode(int inum);
 
+/**
+ * Marks an inode as changed
+ *
+ * Must be called (inside journal_begin()/journal_end()) whenever an inode's
+ * fields are modified directly, so the change gets committed.
+ *
+ * @param node Pointer into the inode table
+ */
+void inode_dirty(inode_t *node);
+
+/**
+ * Marks part of a file's data as changed
+ *
+ * Like journal_dirty(), but also remembers the blocks for inode_sync().
+ * Must be called with the inode locked for writing.
+ *
+ * @param node Inode the data belongs to
+ * @param ptr Start of the changed bytes, a pointer into the mapping
+ * @param len Number of changed bytes
+ */
+void inode_dirty_data(inode_t *node, const void *ptr, size_t len);
+
+/**
+ * Makes a file's changes since the last commit durable, if that can be
+ * done without a commit
+ *
+ * Only possible when nothing but data in already-mapped blocks changed, in
+ * which case just those blocks are written, sorted and coalesced into runs.
+ *
+ * @param node Inode locked for writing, inside journal_begin()/journal_end()
+ *
+ * @return int 0 on success, 1 if the metadata changed too and a commit is
+ *         needed, -EIO if the image couldn't be written.
+ */
+int inode_sync(inode_t *node);
+
+/**
+ * Gets inum of inode
+ *
+ * @param node Pointer into the inode table
+ *
+ * @return int Inum of the inode
+ */
+int inode_get_inum(inode_t *node);
+
 /**
  * Allocates new inode
  *
+ * Inodes map onto block groups in order (see blocks.h), and a file's data
+ * starts out in its inode's group. So a new file gets the first free inode
+ * after its parent directory's, keeping it near its siblings, while a new
+ * directory under the root goes to the next group with at least the
+ * average number of free blocks, spreading unrelated trees over the disk.
+ *
+ * @param parent Inum of the directory the inode goes in, 0 for none.
+ * @param dir Whether the inode is for a directory.
+ *
  * @return int Inum to new inode, or -1 if failure.
  */
-int alloc_inode();
+int alloc_inode(int parent, int dir);
 
 /**
  * Frees inode from memory
@@ -43,27 +226,168 @@ void free_inode(int inum);
 /**
  * Grows inode to fit data of desired size
  *
+ * Maps every block up to the new size, allocating contiguous runs so the
+ * file stays in as few extents as possible. Does not change node->size.
+ *
  * @param node Node object to be grown
  * @param size Desired final size of the node
+ *
+ * @return int 0 on success, -1 if the disk is full.
  */
-void grow_inode(inode_t *node, int size);
+int grow_inode(inode_t *node, int64_t size);
 
 /**
- * Truncates inode (removes all blocks except default)
+ * Maps the holes in a range of a file to new, zeroed blocks
+ *
+ * Blocks already mapped are left as they are. The range may lie past the
+ * end of the file. Does not change node->size.
+ *
+ * @param node Node object to be mapped
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full (blocks mapped by then
+ *         stay mapped).
+ */
+int inode_map(inode_t *node, uint32_t lblk, uint32_t count);
+
+/**
+ * Maps the holes in a range of a file for a write through an open file
+ *
+ * Like inode_map(), but when the range extends the file past its mapped
+ * blocks, blocks past the range are mapped ahead in the same run, as many
+ * as the file then has (up to INODE_AHEAD_MAX), so a file that keeps
+ * growing is laid out in runs that double in length instead of being
+ * interleaved with other files written at the same time. Writes that leave
+ * a hole don't map ahead. inode_trim() frees what the file didn't grow into.
+ * The inode is flagged INODE_AHEAD meanwhile, so that if the file is never
+ * trimmed, inode_trim_crashed() frees them on the next mount.
+ *
+ * @param node Node object to be mapped
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full (blocks mapped by then
+ *         stay mapped).
+ */
+int inode_map_append(inode_t *node, uint32_t lblk, uint32_t count);
+
+/**
+ * Frees the blocks inode_map_append() mapped ahead of a file's end that the
+ * file hasn't grown into
+ *
+ * Called when a file is closed. Blocks mapped with inode_map() (e.g. by
+ * fallocate) past the end are left alone.
+ *
+ * @param node Node object to be trimmed, locked for writing
+ */
+void inode_trim(inode_t *node);
+
+/**
+ * Frees the blocks mapped ahead of appends that a crash left mapped
+ *
+ * For every inode still flagged INODE_AHEAD, removes every block past the
+ * end of the file, including any fallocate mapped there. Only at mount,
+ * before any file is opened, within a transaction.
+ *
+ * @return int Number of files trimmed.
+ */
+int inode_trim_crashed();
+
+/**
+ * Notes a read of a file, reading ahead of it if reads are sequential
+ *
+ * A read that starts where the previous read of the file ended starts
+ * fetching the blocks after it in the background (see blocks_prefetch()),
+ * INODE_READ_AHEAD_MIN blocks at first and twice as many each time the
+ * reader gets halfway through what was fetched, up to
+ * INODE_READ_AHEAD_MAX. Any other read stops the read-ahead.
+ *
+ * @param node Node object being read, locked for reading
+ * @param lblk First file block of the read
+ * @param count Number of file blocks in the read
+ */
+void inode_readahead(inode_t *node, uint32_t lblk, uint32_t count);
+
+/**
+ * Unmaps a range of a file, leaving a hole that reads back as zeros
+ *
+ * Frees the blocks of the range (shared ones only lose an owner).
+ * Compressed clusters straddling either end are expanded first. Does not
+ * change node->size.
+ *
+ * @param node Node object to be changed
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full (the blocks are then
+ *         left mapped).
+ */
+int inode_punch(inode_t *node, uint32_t lblk, uint32_t count);
+
+/**
+ * Copies the shared blocks in a range of a file, so they can be changed
+ *
+ * Blocks shared with a snapshot (see share_blocks()) are copied to new
+ * blocks that the file maps instead, and compressed clusters are expanded
+ * into plain blocks (see compress.h). Must be called before changing any
+ * block of a file in place.
+ *
+ * @param node Node object to be changed
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ *
+ * @return int 0 on success, -1 if the disk is full (or compressed data in
+ *         the range is corrupt).
+ */
+int inode_unshare(inode_t *node, uint32_t lblk, uint32_t count);
+
+/**
+ * Compresses the clusters a range of a file touches
+ *
+ * Each cluster that lies wholly within the file and in one plain extent is
+ * stored compressed instead, if that saves a block (see compress.h). Left
+ * as it is when the disk is too full to hold the compressed copy.
+ *
+ * @param node Node object to be compressed
+ * @param lblk First file block of the range
+ * @param count Number of file blocks in the range
+ */
+void inode_compress(inode_t *node, uint32_t lblk, uint32_t count);
+
+/**
+ * Truncates inode to the given size, freeing blocks past the end
  *
  * @param node Node object to be truncated
+ * @param size New size in bytes
+ *
+ * @return int 0 on success, -1 if the last block is shared or compressed
+ *         and there was no room to copy it (nothing is changed then).
  */
-void truncate_inode(inode_t *node);
+int truncate_inode(inode_t *node, int64_t size);
 
 /**
  * Gets bnum (block number) of nth block of inode
  *
+ * The block must not be compressed.
+ *
  * @param node Inode to access
  * @param file_bnum Nth block of inode
  *
- * @return int Bnum (block number).
+ * @return int Bnum (block number), or 0 if the block isn't mapped.
  */
 int inode_get_bnum(inode_t *node, int file_bnum);
 
+/**
+ * Gets the extent containing the nth block of inode
+ *
+ * @param node Inode to access
+ * @param file_bnum Nth block of inode
+ * @param ext Filled with the extent (or the hole) containing the block
+ *
+ * @return int 1 if the block is mapped, 0 if it's in a hole.
+ */
+int inode_get_extent(inode_t *node, int file_bnum, extent_t *ext);
+
 
 #endif
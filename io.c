@@ -0,0 +1,344 @@
+/**
+ * @file io.c
+ *
+ * Batched writes to the image file, through io_uring when the kernel has it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "io.h"
+
+static int io_fd = -1;
+
+// Write all of a buffer to the file, waiting for it. Returns 0 or -1.
+static int write_full(const char *buf, size_t len, off_t pos) {
+  while (len > 0) {
+    ssize_t n = pwrite(io_fd, buf, len, pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("io: write");
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+#ifdef __NR_io_uring_setup
+
+// a write the kernel has, by its slot (the user_data of its entries); buf
+// is NULL while the slot is unused
+typedef struct pending {
+  const char *buf;
+  size_t len;
+  off_t pos;
+} pending_t;
+
+static int ring_fd = -1;
+static unsigned ring_entries = 0;
+
+// the rings shared with the kernel
+static void *sq_map = 0;
+static size_t sq_map_len = 0;
+static void *cq_map = 0;
+static size_t cq_map_len = 0;
+static struct io_uring_sqe *sqes = 0;
+static size_t sqes_len = 0;
+static unsigned *sq_tail;
+static unsigned *sq_mask;
+static unsigned *sq_array;
+static unsigned *cq_head;
+static unsigned *cq_tail;
+static unsigned *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static pending_t *pending = 0;
+static unsigned *free_slots = 0; // stack of unused slots
+static unsigned free_count = 0;
+
+// one batch at a time has the ring
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ring_abandon(io_batch_t *batch);
+
+// Hand queued entries to the kernel and wait for at least wait of them to
+// complete. Returns 0, or -1 if the ring is broken, which gives it up and
+// finishes the batch synchronously (see ring_abandon()).
+static int enter(io_batch_t *batch, unsigned wait) {
+  for (;;) {
+    int n = syscall(__NR_io_uring_enter, ring_fd, batch->queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n >= 0) {
+      batch->queued -= n;
+      batch->inflight += n;
+      if (!wait || !batch->queued) {
+        return 0;
+      }
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("io: io_uring_enter, writing synchronously");
+      ring_abandon(batch);
+      return -1;
+    }
+  }
+}
+
+// Collect the writes the kernel has completed, finishing short ones
+// synchronously.
+static void reap(io_batch_t *batch) {
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    unsigned slot = cqe->user_data;
+    pending_t *write = &pending[slot];
+    // a failed write gets another, synchronous, try; that also covers
+    // kernels whose io_uring predates IORING_OP_WRITE
+    size_t done = cqe->res > 0 ? cqe->res : 0;
+    if (done < write->len &&
+        write_full(write->buf + done, write->len - done, write->pos + done) <
+            0) {
+      batch->failed = 1;
+    }
+    write->buf = 0;
+    free_slots[free_count++] = slot;
+    batch->inflight--;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Drop the ring.
+static void ring_free() {
+  if (sqes) {
+    munmap(sqes, sqes_len);
+  }
+  if (cq_map && cq_map != sq_map) {
+    munmap(cq_map, cq_map_len);
+  }
+  if (sq_map) {
+    munmap(sq_map, sq_map_len);
+  }
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+  free(pending);
+  free(free_slots);
+  sqes = 0;
+  sq_map = 0;
+  cq_map = 0;
+  ring_fd = -1;
+  pending = 0;
+  free_slots = 0;
+  free_count = 0;
+  ring_entries = 0;
+}
+
+// Give up on the ring for good, as errors from io_uring_enter() other than
+// running out of resources don't go away (such as EOWNERDEAD once the ring
+// is used from another process than the one that set it up). The batch's
+// writes the kernel hasn't completed are written again synchronously, with
+// the same data, so the batch still succeeds.
+static void ring_abandon(io_batch_t *batch) {
+  reap(batch);
+  for (unsigned slot = 0; slot < ring_entries; ++slot) {
+    pending_t *write = &pending[slot];
+    if (write->buf && write_full(write->buf, write->len, write->pos) < 0) {
+      batch->failed = 1;
+    }
+  }
+  ring_free();
+  batch->ring = 0;
+  batch->queued = 0;
+  batch->inflight = 0;
+  pthread_mutex_unlock(&ring_lock);
+}
+
+// Set up a ring of the given depth. Returns 0, or -1 if there is none.
+static int ring_init(unsigned depth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_fd < 0) {
+    return -1;
+  }
+  ring_entries = params.sq_entries;
+
+  sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_map_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_map_len > sq_map_len) {
+    sq_map_len = cq_map_len;
+  }
+  sq_map = mmap(0, sq_map_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_map == MAP_FAILED) {
+    sq_map = 0;
+    ring_free();
+    return -1;
+  }
+  cq_map = single ? sq_map
+                  : mmap(0, cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd,
+                         IORING_OFF_CQ_RING);
+  sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(0, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring_fd, IORING_OFF_SQES);
+  pending = calloc(ring_entries, sizeof(pending_t));
+  free_slots = calloc(ring_entries, sizeof(unsigned));
+  if (cq_map == MAP_FAILED || sqes == MAP_FAILED || !pending ||
+      !free_slots) {
+    cq_map = cq_map == MAP_FAILED ? 0 : cq_map;
+    sqes = sqes == MAP_FAILED ? 0 : sqes;
+    ring_free();
+    return -1;
+  }
+
+  char *sq = sq_map;
+  char *cq = cq_map;
+  sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *) (sq + params.sq_off.array);
+  cq_head = (unsigned *) (cq + params.cq_off.head);
+  cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  for (unsigned ii = 0; ii < ring_entries; ++ii) {
+    free_slots[free_count++] = ii;
+  }
+  return 0;
+}
+
+// Queue a write on the ring, making room first if it is full.
+static void ring_write(io_batch_t *batch, const void *buf, size_t len,
+                       off_t pos) {
+  if (!free_count) {
+    if (enter(batch, 1) < 0) {
+      if (write_full(buf, len, pos) < 0) {
+        batch->failed = 1;
+      }
+      return;
+    }
+    reap(batch);
+  }
+  unsigned slot = free_slots[--free_count];
+  pending[slot] = (pending_t) {buf, len, pos};
+
+  unsigned tail = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = io_fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = pos;
+  sqe->user_data = slot;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  batch->queued++;
+
+  // get the device going before the whole batch is queued
+  if (batch->queued >= ring_entries / 2) {
+    enter(batch, 0);
+  }
+}
+
+// Wait for every write of a batch on the ring.
+static void ring_end(io_batch_t *batch) {
+  while (batch->queued || batch->inflight) {
+    unsigned wait = batch->queued + batch->inflight;
+    if (enter(batch, wait) < 0) {
+      break; // finished synchronously
+    }
+    reap(batch);
+  }
+}
+
+#endif
+
+// Set up writes to a file.
+int io_init(int fd, unsigned depth) {
+  io_free();
+  io_fd = fd;
+#ifdef __NR_io_uring_setup
+  if (depth && ring_init(depth) == 0) {
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+// Tear down what io_init() set up.
+void io_free() {
+#ifdef __NR_io_uring_setup
+  ring_free();
+#endif
+  io_fd = -1;
+}
+
+// Start a batch of writes.
+void io_begin(io_batch_t *batch) {
+  memset(batch, 0, sizeof(io_batch_t));
+#ifdef __NR_io_uring_setup
+  // the ring may have been given up while another batch had it
+  if (pthread_mutex_trylock(&ring_lock) == 0) {
+    batch->ring = ring_fd >= 0;
+    if (!batch->ring) {
+      pthread_mutex_unlock(&ring_lock);
+    }
+  }
+#endif
+}
+
+// Queue a write.
+void io_write(io_batch_t *batch, const void *buf, size_t len, off_t pos) {
+#ifdef __NR_io_uring_setup
+  if (batch->ring) {
+    // one entry covers at most 4G - 1 bytes
+    while (len > UINT32_MAX / 2 && batch->ring) {
+      ring_write(batch, buf, UINT32_MAX / 2, pos);
+      buf = (const char *) buf + UINT32_MAX / 2;
+      len -= UINT32_MAX / 2;
+      pos += UINT32_MAX / 2;
+    }
+    if (batch->ring) {
+      ring_write(batch, buf, len, pos);
+      return;
+    }
+  }
+#endif
+  if (write_full(buf, len, pos) < 0) {
+    batch->failed = 1;
+  }
+}
+
+// Wait for every write of a batch to complete.
+int io_end(io_batch_t *batch) {
+#ifdef __NR_io_uring_setup
+  if (batch->ring) {
+    ring_end(batch);
+  }
+  // the ring may have been given up meanwhile, which let go of it
+  if (batch->ring) {
+    pthread_mutex_unlock(&ring_lock);
+  }
+#endif
+  return batch->failed ? -1 : 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file io.h
+ *
+ * Batched writes to the image file, through io_uring when the kernel has it.
+ *
+ * A batch queues writes and waits for all of them at the end, so a commit
+ * writing back thousands of scattered blocks keeps the device's queue full
+ * instead of waiting for one pwrite at a time. The ring is set up with raw
+ * system calls, so no library is needed. Without io_uring (an old kernel,
+ * or a sandbox that forbids it), while another batch has the ring, or once
+ * the ring has stopped working, the same calls write synchronously.
+ */
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IO_QUEUE_DEPTH 64 // most writes in flight at once
+
+typedef struct io_batch {
+  int ring;     // nonzero if the batch has the ring to itself
+  int queued;   // writes not yet handed to the kernel
+  int inflight; // writes handed to the kernel and not yet completed
+  int failed;   // some write failed
+} io_batch_t;
+
+/**
+ * Set up writes to a file.
+ *
+ * @param fd The file (the open image).
+ * @param depth Queue depth of the ring, or 0 to always write synchronously.
+ *
+ * @return 1 if writes go through io_uring, 0 if they are synchronous.
+ */
+int io_init(int fd, unsigned depth);
+
+/**
+ * Tear down what io_init() set up.
+ */
+void io_free();
+
+/**
+ * Start a batch of writes.
+ *
+ * @param batch The batch, filled in.
+ */
+void io_begin(io_batch_t *batch);
+
+/**
+ * Queue a write.
+ *
+ * The buffer must stay unchanged until io_end(); the write may happen at
+ * any time until then, in any order with the others of the batch.
+ *
+ * @param batch The batch.
+ * @param buf Data to write.
+ * @param len Length of the data.
+ * @param pos Offset in the file to write it at.
+ */
+void io_write(io_batch_t *batch, const void *buf, size_t len, off_t pos);
+
+/**
+ * Wait for every write of a batch to complete.
+ *
+ * The data isn't durable yet; that takes an fdatasync() afterwards.
+ *
+ * @param batch The batch.
+ *
+ * @return 0 if every write succeeded, -1 if any failed.
+ */
+int io_end(io_batch_t *batch);
+
+#endif
@@ -0,0 +1,739 @@
+/**
+ * @file journal.c
+ *
+ * Write-ahead journal for metadata updates.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#include "io.h"
+
+// commit early once this many data blocks are waiting (64MB)
+#define DIRTY_DATA_MAX 16384
+
+// blocks changed since the last commit, and which of them are metadata
+static uint64_t *dirty_bits = 0;
+static uint64_t *meta_bits = 0;
+static int bit_words = 0;
+static int dirty_count = 0;
+static int meta_count = 0;
+
+// blocks with a copy in the log, which a replay would write over them
+static uint64_t *logged_bits = 0;
+
+// the log follows the header block of the journal region
+static int log_start = 0;
+static int log_blocks = 0;
+static int log_head = 0;   // next free log block
+static uint64_t seq = 0;   // sequence number of the next transaction
+static uint64_t generation = 1; // bumped by every commit
+
+// held shared by operations and exclusively by commits
+static pthread_rwlock_t op_lock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+// background commits
+static pthread_t committer;
+static int running = 0;
+static int stopping = 0;
+static int pressure = 0;
+static int commit_interval = JOURNAL_COMMIT_INTERVAL;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+// Get the block number of a pointer into the mapping.
+static int block_of(const void *ptr) {
+  return ((const char *) ptr - (const char *) blocks_get_block(0)) /
+         BLOCK_SIZE;
+}
+
+static int test_bit(uint64_t *bits, int bnum) {
+  return (bits[bnum / 64] >> (bnum % 64)) & 1;
+}
+
+// Fold a block into a running checksum (64-bit FNV-1a over words).
+static uint64_t checksum(uint64_t hash, const void *block) {
+  const uint64_t *words = block;
+  for (size_t ii = 0; ii < BLOCK_SIZE / sizeof(uint64_t); ++ii) {
+    hash = (hash ^ words[ii]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Write all of a buffer to the image file.
+static int write_all(const void *buf, size_t len, off_t pos) {
+  int fd = blocks_get_fd();
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("journal: write");
+      return -1;
+    }
+    buf = (const char *) buf + n;
+    len -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+// Read a block of the image file, bypassing the private mapping.
+static int read_block(int bnum, void *buf) {
+  off_t pos = (off_t) bnum * BLOCK_SIZE;
+  ssize_t n = pread(blocks_get_fd(), buf, BLOCK_SIZE, pos);
+  return n == BLOCK_SIZE ? 0 : -1;
+}
+
+static int flush() {
+  if (fdatasync(blocks_get_fd()) < 0) {
+    perror("journal: fdatasync");
+    return -1;
+  }
+  return 0;
+}
+
+// Point the journal header at the next transaction, emptying the log.
+// Everything already in the log must be durable at home first.
+static int reset_log() {
+  static char block[BLOCK_SIZE];
+  journal_block_t *hdr = (journal_block_t *) block;
+  memset(block, 0, BLOCK_SIZE);
+  hdr->magic = JOURNAL_MAGIC;
+  hdr->type = JOURNAL_HEADER;
+  hdr->seq = seq;
+  log_head = 0;
+  if (logged_bits) {
+    memset(logged_bits, 0, bit_words * sizeof(uint64_t));
+  }
+  return write_all(block, BLOCK_SIZE,
+                   (off_t) get_superblock()->journal_start * BLOCK_SIZE);
+}
+
+// Write an empty journal to a freshly formatted image.
+void journal_format() {
+  superblock_t *sb = get_superblock();
+  seq = 1;
+  reset_log();
+
+  // make sure no stale block in the log looks like a transaction
+  static char zeros[BLOCK_SIZE];
+  write_all(zeros, BLOCK_SIZE, (off_t) (sb->journal_start + 1) * BLOCK_SIZE);
+}
+
+// Get the block holding block v of a transaction: the log blocks from pos
+// on, or the blocks listed by its spill blocks.
+static int tx_block(const uint32_t *spill, int pos, int v) {
+  return spill ? (int) spill[v] : log_start + pos + v;
+}
+
+// Copy the blocks of a committed transaction home. Its descriptors and
+// copies are len blocks, found through tx_block().
+static int apply(const uint32_t *spill, int pos, int len) {
+  static char desc[BLOCK_SIZE];
+  static char copy[BLOCK_SIZE];
+  for (int v = 0; v < len;) {
+    if (read_block(tx_block(spill, pos, v), desc) < 0) {
+      return -1;
+    }
+    journal_block_t *hdr = (journal_block_t *) desc;
+    uint32_t *homes = (uint32_t *) (hdr + 1);
+    for (uint32_t ii = 0; ii < hdr->count; ++ii) {
+      if (read_block(tx_block(spill, pos, v + 1 + ii), copy) < 0 ||
+          write_all(copy, BLOCK_SIZE, (off_t) homes[ii] * BLOCK_SIZE) < 0) {
+        return -1;
+      }
+    }
+    v += 1 + hdr->count;
+  }
+  return 0;
+}
+
+// Walk the descriptors of a transaction and the copies they list, at most
+// max blocks, folding each into *sum. Returns the number of blocks they
+// take, or -1 if a copy can't be read.
+static int walk(const uint32_t *spill, int pos, int max, uint64_t *sum) {
+  static char block[BLOCK_SIZE];
+  journal_block_t *hdr = (journal_block_t *) block;
+  int v = 0;
+  while (v < max && read_block(tx_block(spill, pos, v), block) == 0 &&
+         hdr->magic == JOURNAL_MAGIC && hdr->type == JOURNAL_DESCRIPTOR &&
+         hdr->seq == seq && hdr->count <= JOURNAL_DESC_MAX &&
+         v + 1 + (int) hdr->count <= max) {
+    int count = hdr->count;
+    *sum = checksum(*sum, block);
+    for (int ii = 1; ii <= count; ++ii) {
+      if (read_block(tx_block(spill, pos, v + ii), block) < 0) {
+        return -1;
+      }
+      *sum = checksum(*sum, block);
+    }
+    v += 1 + count;
+  }
+  return v;
+}
+
+// Read the spill blocks at the start of a transaction into *spill, folding
+// them into *sum. Returns the number of blocks listed (0 if the transaction
+// isn't spilled), or -1 if out of memory.
+static int read_spill(int pos, uint32_t **spill, uint64_t *sum) {
+  static char block[BLOCK_SIZE];
+  journal_block_t *hdr = (journal_block_t *) block;
+  uint32_t total = get_superblock()->block_count;
+  int listed = 0;
+  while (pos < log_blocks && read_block(log_start + pos, block) == 0 &&
+         hdr->magic == JOURNAL_MAGIC && hdr->type == JOURNAL_SPILL &&
+         hdr->seq == seq && hdr->count <= JOURNAL_DESC_MAX) {
+    uint32_t *bnums = (uint32_t *) (hdr + 1);
+    for (uint32_t ii = 0; ii < hdr->count; ++ii) {
+      if (bnums[ii] >= total) {
+        return 0; // not ours, so not a transaction either
+      }
+    }
+    uint32_t *more = realloc(*spill, (listed + hdr->count) * sizeof(uint32_t));
+    if (!more) {
+      return -1;
+    }
+    *spill = more;
+    memcpy(more + listed, bnums, hdr->count * sizeof(uint32_t));
+    listed += hdr->count;
+    *sum = checksum(*sum, block);
+    pos++;
+  }
+  return listed;
+}
+
+// Replay every complete transaction in the log, in order.
+static int replay() {
+  static char block[BLOCK_SIZE];
+  journal_block_t *hdr = (journal_block_t *) block;
+
+  uint32_t *spill = 0;
+  int rv = 0;
+  int replayed = 0;
+  int pos = 0;
+  for (;;) {
+    // walk the blocks of the next transaction up to its commit block
+    int start = pos;
+    uint64_t sum = 14695981039346656037ull;
+    int listed = read_spill(pos, &spill, &sum);
+    if (listed < 0) {
+      rv = -1;
+      break;
+    }
+    int len;
+    if (listed) {
+      pos += (listed + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+      len = walk(spill, 0, listed, &sum);
+    } else {
+      len = walk(0, pos, log_blocks - pos - 1, &sum);
+      pos += len > 0 ? len : 0;
+    }
+    if (len < 0) {
+      rv = -1;
+      break;
+    }
+
+    // a transaction counts only if its commit block made it to disk intact
+    if (len == 0 || (listed && len != listed) || pos >= log_blocks ||
+        read_block(log_start + pos, block) < 0 ||
+        hdr->magic != JOURNAL_MAGIC || hdr->type != JOURNAL_COMMIT ||
+        hdr->seq != seq || hdr->count != pos - start || hdr->checksum != sum) {
+      break;
+    }
+    if (apply(listed ? spill : 0, listed ? 0 : start, len) < 0) {
+      rv = -1;
+      break;
+    }
+    pos++;
+    seq++;
+    replayed++;
+  }
+  free(spill);
+
+  if (rv == 0 && replayed) {
+    fprintf(stderr, "journal: replayed %d transaction(s)\n", replayed);
+    rv = flush();
+  }
+  return rv;
+}
+
+// Open the journal of the mounted image, replaying committed transactions.
+int journal_open() {
+  superblock_t *sb = get_superblock();
+  log_start = sb->journal_start + 1;
+  log_blocks = sb->journal_blocks - 1;
+
+  static char block[BLOCK_SIZE];
+  journal_block_t *hdr = (journal_block_t *) block;
+  if (read_block(sb->journal_start, block) < 0 ||
+      hdr->magic != JOURNAL_MAGIC || hdr->type != JOURNAL_HEADER) {
+    fprintf(stderr, "journal: bad journal header\n");
+    return -1;
+  }
+  seq = hdr->seq;
+  if (replay() < 0 || reset_log() < 0 || flush() < 0) {
+    return -1;
+  }
+
+  free(dirty_bits);
+  free(meta_bits);
+  free(logged_bits);
+  bit_words = (sb->block_count + 63) / 64;
+  dirty_bits = calloc(bit_words, sizeof(uint64_t));
+  meta_bits = calloc(bit_words, sizeof(uint64_t));
+  logged_bits = calloc(bit_words, sizeof(uint64_t));
+  dirty_count = 0;
+  meta_count = 0;
+  if (!dirty_bits || !meta_bits || !logged_bits) {
+    return -1;
+  }
+  return 0;
+}
+
+// Record that a range of the mapped image has been changed.
+void journal_dirty(const void *ptr, size_t len, int meta) {
+  if (len == 0) {
+    return;
+  }
+  int first = block_of(ptr);
+  int last = block_of((const char *) ptr + len - 1);
+  for (int bnum = first; bnum <= last; ++bnum) {
+    uint64_t bit = 1ull << (bnum % 64);
+    uint64_t old = __atomic_fetch_or(&dirty_bits[bnum / 64], bit,
+                                     __ATOMIC_RELAXED);
+    if (!(old & bit)) {
+      __atomic_fetch_add(&dirty_count, 1, __ATOMIC_RELAXED);
+    }
+    if (meta) {
+      old = __atomic_fetch_or(&meta_bits[bnum / 64], bit, __ATOMIC_RELAXED);
+      if (!(old & bit)) {
+        __atomic_fetch_add(&meta_count, 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+// Check whether a block has changes that haven't been committed yet.
+int journal_is_dirty(int bnum) {
+  uint64_t word = __atomic_load_n(&dirty_bits[bnum / 64], __ATOMIC_ACQUIRE);
+  return (word >> (bnum % 64)) & 1;
+}
+
+// Check whether a block has uncommitted metadata changes.
+static int is_meta(int bnum) {
+  uint64_t word = __atomic_load_n(&meta_bits[bnum / 64], __ATOMIC_RELAXED);
+  return (word >> (bnum % 64)) & 1;
+}
+
+// Mark the start of an operation that changes the image.
+void journal_begin() { pthread_rwlock_rdlock(&op_lock); }
+
+// Mark the start of an operation that must run alone.
+void journal_begin_exclusive() { pthread_rwlock_wrlock(&op_lock); }
+
+// Mark the end of an operation, waking the committer if a lot is waiting.
+void journal_end() {
+  pthread_rwlock_unlock(&op_lock);
+
+  int meta = __atomic_load_n(&meta_count, __ATOMIC_RELAXED);
+  int data = __atomic_load_n(&dirty_count, __ATOMIC_RELAXED) - meta;
+  if (meta > log_blocks / 2 || data > DIRTY_DATA_MAX) {
+    journal_wake();
+  }
+}
+
+// Ask the background thread to commit now.
+void journal_wake() {
+  pthread_mutex_lock(&thread_lock);
+  pressure = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&thread_lock);
+}
+
+// Check whether a block is dirty data to be written home by a commit;
+// blocks being freed aren't, whatever was written to them.
+static int is_data(int bnum) {
+  return test_bit(dirty_bits, bnum) && !test_bit(meta_bits, bnum) &&
+         !blocks_freed(bnum);
+}
+
+// Write runs of dirty data blocks to their home locations.
+static int write_data() {
+  io_batch_t batch;
+  io_begin(&batch);
+  int count = get_superblock()->block_count;
+  for (int bnum = 0; bnum < count; ++bnum) {
+    if (!is_data(bnum)) {
+      continue;
+    }
+    int end = bnum + 1;
+    while (end < count && is_data(end)) {
+      end++;
+    }
+    io_write(&batch, blocks_get_block(bnum),
+             (size_t) (end - bnum) * BLOCK_SIZE, (off_t) bnum * BLOCK_SIZE);
+    bnum = end;
+  }
+  return io_end(&batch);
+}
+
+// Check whether a dirty data block was metadata with a copy in the log. A
+// replay would write the old copy over the new data, so the log has to be
+// emptied before the data goes home.
+static int data_logged() {
+  for (int ii = 0; ii < bit_words; ++ii) {
+    uint64_t bits = dirty_bits[ii] & ~meta_bits[ii] & logged_bits[ii];
+    while (bits) {
+      if (!blocks_freed(ii * 64 + __builtin_ctzll(bits))) {
+        return 1;
+      }
+      bits &= bits - 1;
+    }
+  }
+  return 0;
+}
+
+// Write copies of metadata blocks to their home locations; copies[ii] is
+// home to homes[ii].
+static int write_homes(char **copies, uint32_t *homes, int count) {
+  io_batch_t batch;
+  io_begin(&batch);
+  for (int ii = 0; ii < count; ++ii) {
+    io_write(&batch, copies[ii], BLOCK_SIZE, (off_t) homes[ii] * BLOCK_SIZE);
+  }
+  return io_end(&batch);
+}
+
+// Write the blocks of a spilled transaction to the blocks listed for them.
+static int write_spill(const char *body, const uint32_t *spill, int count) {
+  io_batch_t batch;
+  io_begin(&batch);
+  for (int ii = 0; ii < count;) {
+    int end = ii + 1;
+    while (end < count && spill[end] == spill[end - 1] + 1) {
+      end++;
+    }
+    io_write(&batch, body + (size_t) ii * BLOCK_SIZE,
+             (size_t) (end - ii) * BLOCK_SIZE, (off_t) spill[ii] * BLOCK_SIZE);
+    ii = end;
+  }
+  return io_end(&batch);
+}
+
+// Journal the dirty metadata blocks as one transaction, flush, and copy
+// them home.
+static int write_metadata(uint32_t *homes, int count) {
+  int descs = (count + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+  int body = descs + count; // descriptors and copies
+
+  // too big for the log: the body goes to unused blocks, and the log gets
+  // the list of them and the commit block
+  uint32_t *spill = 0;
+  int maps = 0;
+  if (body + 1 > log_blocks) {
+    maps = (body + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+    spill = malloc(body * sizeof(uint32_t));
+    if (!spill || maps + 1 > log_blocks ||
+        blocks_find_unused(spill, body) < body) {
+      fprintf(stderr, "journal: no room for a transaction of %d blocks\n",
+              count);
+      free(spill);
+      return -1;
+    }
+  }
+  int total = spill ? maps + 1 : body + 1; // blocks going to the log
+
+  // out of room: the checkpoints of earlier transactions must be durable
+  // before their log blocks are reused
+  if (log_head + total > log_blocks) {
+    if (flush() < 0 || reset_log() < 0) {
+      free(spill);
+      return -1;
+    }
+  }
+
+  // spill blocks, then descriptors and copies, then the commit block
+  char *tx = malloc((size_t) (maps + body + 1) * BLOCK_SIZE);
+  char **copies = malloc(count * sizeof(char *));
+  if (!tx || !copies) {
+    free(tx);
+    free(copies);
+    free(spill);
+    return -1;
+  }
+  memset(tx, 0, (size_t) (maps + body + 1) * BLOCK_SIZE);
+  uint64_t sum = 14695981039346656037ull;
+  char *pos = tx;
+  for (int done = 0; done < (spill ? body : 0);) {
+    int n = body - done < JOURNAL_DESC_MAX ? body - done : JOURNAL_DESC_MAX;
+    journal_block_t *map = (journal_block_t *) pos;
+    map->magic = JOURNAL_MAGIC;
+    map->type = JOURNAL_SPILL;
+    map->seq = seq;
+    map->count = n;
+    memcpy(map + 1, spill + done, n * sizeof(uint32_t));
+    sum = checksum(sum, pos);
+    pos += BLOCK_SIZE;
+    done += n;
+  }
+  for (int done = 0; done < count;) {
+    int n = count - done < JOURNAL_DESC_MAX ? count - done : JOURNAL_DESC_MAX;
+    journal_block_t *desc = (journal_block_t *) pos;
+    desc->magic = JOURNAL_MAGIC;
+    desc->type = JOURNAL_DESCRIPTOR;
+    desc->seq = seq;
+    desc->count = n;
+    memcpy(desc + 1, homes + done, n * sizeof(uint32_t));
+    sum = checksum(sum, pos);
+    pos += BLOCK_SIZE;
+    for (int ii = 0; ii < n; ++ii) {
+      memcpy(pos, blocks_get_block(homes[done + ii]), BLOCK_SIZE);
+      copies[done + ii] = pos;
+      sum = checksum(sum, pos);
+      pos += BLOCK_SIZE;
+    }
+    done += n;
+  }
+  journal_block_t *commit = (journal_block_t *) pos;
+  commit->magic = JOURNAL_MAGIC;
+  commit->type = JOURNAL_COMMIT;
+  commit->seq = seq;
+  commit->count = total - 1;
+  commit->checksum = sum;
+
+  // one sequential write and one flush, which also covers the data
+  off_t head = (off_t) (log_start + log_head) * BLOCK_SIZE;
+  int rv;
+  if (spill) {
+    rv = write_spill(tx + (size_t) maps * BLOCK_SIZE, spill, body);
+    if (rv == 0) {
+      rv = write_all(tx, (size_t) maps * BLOCK_SIZE, head);
+    }
+    if (rv == 0) {
+      rv = write_all(commit, BLOCK_SIZE, head + (off_t) maps * BLOCK_SIZE);
+    }
+  } else {
+    rv = write_all(tx, (size_t) total * BLOCK_SIZE, head);
+  }
+  if (rv == 0) {
+    rv = flush();
+  }
+  if (rv == 0) {
+    log_head += total;
+    seq++;
+    for (int ii = 0; ii < count; ++ii) {
+      logged_bits[homes[ii] / 64] |= 1ull << (homes[ii] % 64);
+    }
+
+    // checkpoint; these become durable with a later flush, and until then
+    // replay can redo them
+    rv = write_homes(copies, homes, count);
+  }
+  // the spilled blocks are free for anyone once this commit is done, so
+  // the transaction must not be replayed from them again
+  if (rv == 0 && spill) {
+    rv = flush() < 0 || reset_log() < 0 ? -1 : 0;
+  }
+  free(tx);
+  free(copies);
+  free(spill);
+  return rv;
+}
+
+// Commit with every operation shut out.
+static int commit_locked() {
+  // blocks freed by this transaction become free with it, and not before:
+  // until it is durable the image on disk may still use them
+  blocks_release_freed();
+  if (dirty_count == 0) {
+    blocks_settle_freed(1);
+    return 0;
+  }
+
+  uint32_t *homes = malloc((meta_count + 1) * sizeof(uint32_t));
+  if (!homes) {
+    blocks_settle_freed(0);
+    return -EIO;
+  }
+  int count = 0;
+  for (int ii = 0; ii < bit_words; ++ii) {
+    uint64_t bits = meta_bits[ii];
+    while (bits) {
+      int bnum = ii * 64 + __builtin_ctzll(bits);
+      if (!blocks_freed(bnum)) {
+        homes[count++] = bnum;
+      }
+      bits &= bits - 1;
+    }
+  }
+
+  int rv = 0;
+  if (data_logged()) {
+    rv = flush() < 0 || reset_log() < 0 ? -1 : 0;
+  }
+  if (rv == 0) {
+    rv = write_data();
+  }
+  if (rv == 0) {
+    rv = count ? write_metadata(homes, count) : flush();
+  }
+  free(homes);
+  if (rv < 0) {
+    blocks_settle_freed(0);
+    return -EIO; // keep everything dirty and try again next time
+  }
+
+  // the image file is now up to date, so drop our private copies
+  int total = get_superblock()->block_count;
+  for (int bnum = 0; bnum < total; ++bnum) {
+    if (!test_bit(dirty_bits, bnum)) {
+      continue;
+    }
+    int end = bnum + 1;
+    while (end < total && test_bit(dirty_bits, end)) {
+      end++;
+    }
+    blocks_evict(bnum, end - bnum);
+    bnum = end;
+  }
+  // readers check the bits without taking op_lock
+  for (int ii = 0; ii < bit_words; ++ii) {
+    __atomic_store_n(&dirty_bits[ii], 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&meta_bits[ii], 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&dirty_count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta_count, 0, __ATOMIC_RELAXED);
+  blocks_settle_freed(1);
+  generation++;
+  return 0;
+}
+
+// Commit every change made so far and wait until it is durable.
+int journal_commit() {
+  pthread_rwlock_wrlock(&op_lock);
+  int rv = commit_locked();
+  blocks_trim();
+  pthread_rwlock_unlock(&op_lock);
+  return rv;
+}
+
+// Get the number of the transaction changes are currently going into.
+uint64_t journal_generation() { return generation; }
+
+// Write dirty data blocks home without a commit.
+int journal_sync_data(const journal_range_t *ranges, int count) {
+  // only blocks that are dirty data; other operations may be marking
+  // unrelated blocks meanwhile, so the bits are read atomically. Blocks
+  // mapped since the last commit are written too: they were free in the
+  // committed image, as freed blocks are only reused once it is committed
+  // (and a commit later still, after reads that found them are done), so
+  // nothing on disk or in flight sees them until the commit that maps them
+  io_batch_t batch;
+  io_begin(&batch);
+  int written = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    uint32_t end = ranges[ii].start + ranges[ii].len;
+    for (uint32_t bnum = ranges[ii].start; bnum < end; ++bnum) {
+      if (!journal_is_dirty(bnum) || is_meta(bnum)) {
+        continue;
+      }
+      uint32_t stop = bnum + 1;
+      while (stop < end && journal_is_dirty(stop) && !is_meta(stop)) {
+        stop++;
+      }
+      io_write(&batch, blocks_get_block(bnum),
+               (size_t) (stop - bnum) * BLOCK_SIZE, (off_t) bnum * BLOCK_SIZE);
+      written++;
+      bnum = stop;
+    }
+  }
+  if (io_end(&batch) < 0) {
+    return -EIO;
+  }
+  if (!written) {
+    return 0;
+  }
+  if (flush() < 0) {
+    return -EIO;
+  }
+
+  // the image file now holds these blocks, so they are clean again; but
+  // those with an old copy in the log stay dirty, so that the commit
+  // mapping them empties the log first (see data_logged())
+  for (int ii = 0; ii < count; ++ii) {
+    uint32_t end = ranges[ii].start + ranges[ii].len;
+    for (uint32_t bnum = ranges[ii].start; bnum < end; ++bnum) {
+      if (is_meta(bnum) || test_bit(logged_bits, bnum)) {
+        continue;
+      }
+      uint64_t bit = 1ull << (bnum % 64);
+      uint64_t old =
+          __atomic_fetch_and(&dirty_bits[bnum / 64], ~bit, __ATOMIC_RELEASE);
+      if (old & bit) {
+        __atomic_fetch_sub(&dirty_count, 1, __ATOMIC_RELAXED);
+        blocks_evict(bnum, 1);
+      }
+    }
+  }
+  return 0;
+}
+
+// Commit every interval, or sooner when journal_end() asks for it.
+static void *commit_thread(void *arg) {
+  pthread_mutex_lock(&thread_lock);
+  while (!stopping) {
+    if (!pressure) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += commit_interval;
+      pthread_cond_timedwait(&wake, &thread_lock, &deadline);
+    }
+    pressure = 0;
+    pthread_mutex_unlock(&thread_lock);
+    journal_commit();
+    pthread_mutex_lock(&thread_lock);
+  }
+  pthread_mutex_unlock(&thread_lock);
+  return 0;
+}
+
+// Start committing in the background every interval seconds.
+void journal_start(int interval) {
+  commit_interval = interval > 0 ? interval : JOURNAL_COMMIT_INTERVAL;
+  stopping = 0;
+  running = pthread_create(&committer, 0, commit_thread, 0) == 0;
+}
+
+// Commit outstanding changes, stop the background thread and leave an
+// empty journal behind.
+void journal_stop() {
+  if (running) {
+    pthread_mutex_lock(&thread_lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&thread_lock);
+    pthread_join(committer, 0);
+    running = 0;
+  }
+  if (dirty_bits && journal_commit() == 0 && flush() == 0) {
+    reset_log();
+    flush();
+  }
+  free(dirty_bits);
+  free(meta_bits);
+  free(logged_bits);
+  dirty_bits = 0;
+  meta_bits = 0;
+  logged_bits = 0;
+}
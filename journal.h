@@ -0,0 +1,177 @@
+/**
+ * @file journal.h
+ *
+ * Write-ahead journal for metadata updates.
+ *
+ * The image is mapped privately, so changes made through the mapping stay
+ * in memory until a commit writes them out. Every change marks the blocks it
+ * touched as dirty, either as metadata (superblock, bitmaps, inode table,
+ * directory blocks, extent tree nodes) or as file data.
+ *
+ * A commit batches every operation since the previous one into a single
+ * transaction. Dirty data blocks are written straight to their home
+ * locations; dirty metadata blocks are first appended to the journal region
+ * as one transaction, made durable together with the data by one flush, and
+ * only then copied to their home locations. Mounting replays every complete
+ * transaction still in the journal, so a crash can't leave metadata half
+ * updated.
+ *
+ * On disk the journal region starts with a header block naming the sequence
+ * number of the first transaction to replay. A transaction is one or more
+ * descriptor blocks (each followed by the copies of the blocks it lists)
+ * and a commit block carrying a checksum of everything before it.
+ *
+ * A transaction too big for the log has its descriptors and copies written
+ * to blocks that are free both in memory and on disk instead. The log then
+ * holds spill blocks listing those blocks in order, and the commit block,
+ * whose checksum also covers the spilled blocks. The log is emptied as
+ * soon as such a transaction is checkpointed, before the blocks are used.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+
+#define JOURNAL_HEADER 1     // first block of the journal region
+#define JOURNAL_DESCRIPTOR 2 // lists the home blocks of the copies after it
+#define JOURNAL_COMMIT 3     // ends a transaction
+#define JOURNAL_SPILL 4      // lists blocks holding a transaction outside it
+
+typedef struct journal_block {
+  uint32_t magic;    // JOURNAL_MAGIC
+  uint32_t type;     // JOURNAL_HEADER, _DESCRIPTOR, _COMMIT or _SPILL
+  uint64_t seq;      // transaction (for the header: first to replay)
+  uint32_t count;    // descriptor, spill: blocks listed; commit: log blocks
+                     // before it
+  uint32_t _reserved;
+  uint64_t checksum; // commit: checksum of the transaction's other blocks
+} journal_block_t;
+
+// number of block numbers that fit in a descriptor or spill block
+#define JOURNAL_DESC_MAX \
+  ((BLOCK_SIZE - sizeof(journal_block_t)) / sizeof(uint32_t))
+
+#define JOURNAL_COMMIT_INTERVAL 5 // default seconds between commits
+
+// a run of blocks, e.g. the data a file has changed since the last commit
+typedef struct journal_range {
+  uint32_t start;
+  uint32_t len;
+} journal_range_t;
+
+/**
+ * Write an empty journal to a freshly formatted image.
+ */
+void journal_format();
+
+/**
+ * Open the journal of the mounted image, replaying committed transactions.
+ *
+ * @return 0 on success, -1 if the journal is damaged or out of memory.
+ */
+int journal_open();
+
+/**
+ * Start committing in the background every interval seconds.
+ *
+ * Must be called from the process that will serve requests (i.e. after
+ * FUSE has daemonized).
+ *
+ * @param interval Seconds between commits.
+ */
+void journal_start(int interval);
+
+/**
+ * Commit outstanding changes, stop the background thread and leave an
+ * empty journal behind.
+ */
+void journal_stop();
+
+/**
+ * Mark the start of an operation that changes the image.
+ *
+ * Commits wait for operations in progress, so a transaction never holds
+ * half an operation. Operations must not nest.
+ */
+void journal_begin();
+
+/**
+ * Mark the start of an operation that must run alone.
+ *
+ * Like journal_begin(), but waits for every other operation to end and
+ * keeps new ones (and commits) out until journal_end().
+ */
+void journal_begin_exclusive();
+
+/**
+ * Mark the end of an operation started with journal_begin() or
+ * journal_begin_exclusive().
+ */
+void journal_end();
+
+/**
+ * Ask the background thread to commit now rather than at the end of the
+ * interval.
+ */
+void journal_wake();
+
+/**
+ * Record that a range of the mapped image has been (or is about to be)
+ * changed.
+ *
+ * @param ptr Start of the range, a pointer into the mapping.
+ * @param len Length of the range in bytes.
+ * @param meta Nonzero if the range holds metadata, which is journaled.
+ */
+void journal_dirty(const void *ptr, size_t len, int meta);
+
+/**
+ * Check whether a block has changes that haven't been committed yet.
+ *
+ * Until they are, the image file holds an older version of the block.
+ *
+ * @param bnum The block to check.
+ *
+ * @return 1 if the block is dirty, 0 if not.
+ */
+int journal_is_dirty(int bnum);
+
+/**
+ * Commit every change made so far and wait until it is durable.
+ *
+ * @return 0 on success, -EIO if the image couldn't be written.
+ */
+int journal_commit();
+
+/**
+ * Get the number of the transaction that changes are currently going into.
+ *
+ * It grows by one with every commit, so a change recorded under an older
+ * number is already durable.
+ *
+ * @return The current transaction number.
+ */
+uint64_t journal_generation();
+
+/**
+ * Write dirty data blocks home without a commit and wait until they are
+ * durable.
+ *
+ * Only data blocks whose mapping in the image is already committed may be
+ * written this way; metadata in the ranges is skipped. Must be called
+ * between journal_begin() and journal_end(), with nothing else changing the
+ * blocks.
+ *
+ * @param ranges Block ranges to write, sorted and not overlapping.
+ * @param count Number of ranges.
+ *
+ * @return 0 on success, -EIO if the image couldn't be written.
+ */
+int journal_sync_data(const journal_range_t *ranges, int count);
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * @file lz4.c
+ *
+ * LZ4 block format compressor and decompressor.
+ *
+ * A block is a series of sequences, each a token byte (literal count in the
+ * high nibble, match length minus 4 in the low one), extra literal count
+ * bytes, the literals, a little-endian 16-bit match offset and extra match
+ * length bytes. A nibble of 15 means extra bytes follow, each added to it,
+ * until one is below 255. The last sequence has literals only; the format
+ * requires the last 5 bytes to be literals and the last match to start at
+ * least 12 bytes before the end.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // bytes at the end that are always literals
+#define MATCH_LIMIT 12   // no match starts in this many bytes at the end
+#define MAX_OFFSET 65535
+#define HASH_LOG 12      // the compressor remembers 4096 positions
+
+// Hash the 4 bytes at p (Knuth's multiplicative hash).
+static uint32_t hash4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Write the extra bytes of a length whose nibble was 15.
+static uint8_t *put_length(uint8_t *out, size_t n) {
+  while (n >= 255) {
+    *out++ = 255;
+    n -= 255;
+  }
+  *out++ = (uint8_t) n;
+  return out;
+}
+
+// Write a sequence of lit literals and then a match of mlen bytes at the
+// given offset back (mlen 0 for the last sequence). Returns the new end of
+// the output, or NULL if it doesn't fit.
+static uint8_t *put_sequence(uint8_t *out, uint8_t *end, const uint8_t *lits,
+                             size_t lit, size_t offset, size_t mlen) {
+  size_t need = 1 + lit / 255 + 1 + lit + (mlen ? 2 + mlen / 255 + 1 : 0);
+  if ((size_t) (end - out) < need) {
+    return NULL;
+  }
+  uint8_t *token = out++;
+  *token = (uint8_t) ((lit < 15 ? lit : 15) << 4);
+  if (lit >= 15) {
+    out = put_length(out, lit - 15);
+  }
+  memcpy(out, lits, lit);
+  out += lit;
+  if (mlen == 0) {
+    return out;
+  }
+
+  out[0] = (uint8_t) offset;
+  out[1] = (uint8_t) (offset >> 8);
+  out += 2;
+  mlen -= MIN_MATCH;
+  *token |= (uint8_t) (mlen < 15 ? mlen : 15);
+  if (mlen >= 15) {
+    out = put_length(out, mlen - 15);
+  }
+  return out;
+}
+
+// Compress a buffer.
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t max) {
+  const uint8_t *in = src;
+  const uint8_t *end = in + len;
+  uint8_t *out = dst;
+  uint8_t *out_end = out + max;
+  const uint8_t *anchor = in; // first byte not yet written out
+
+  if (len > MATCH_LIMIT) {
+    // 1 + the position last seen with each hash, 0 for none
+    uint32_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+    const uint8_t *limit = end - MATCH_LIMIT;
+    const uint8_t *match_end = end - LAST_LITERALS;
+    const uint8_t *ip = in;
+    unsigned misses = 0;
+
+    while (ip < limit) {
+      uint32_t h = hash4(ip);
+      const uint8_t *ref = table[h] ? in + table[h] - 1 : NULL;
+      table[h] = ip - in + 1;
+      if (!ref || ip - ref > MAX_OFFSET || memcmp(ref, ip, MIN_MATCH)) {
+        // skip ahead faster the longer nothing matches
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *p = ip + MIN_MATCH;
+      const uint8_t *q = ref + MIN_MATCH;
+      while (p < match_end && *p == *q) {
+        p++;
+        q++;
+      }
+
+      out = put_sequence(out, out_end, anchor, ip - anchor, ip - ref, p - ip);
+      if (!out) {
+        return 0;
+      }
+      if (p - 2 < limit) {
+        table[hash4(p - 2)] = p - 2 - in + 1;
+      }
+      ip = anchor = p;
+    }
+  }
+
+  out = put_sequence(out, out_end, anchor, end - anchor, 0, 0);
+  return out ? (size_t) (out - (uint8_t *) dst) : 0;
+}
+
+// Read the extra bytes of a length whose nibble was 15. Returns -1 if the
+// input runs out first.
+static long get_length(const uint8_t **in, const uint8_t *end) {
+  long n = 0;
+  uint8_t b;
+  do {
+    if (*in >= end) {
+      return -1;
+    }
+    b = *(*in)++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+// Decompress a buffer produced by lz4_compress().
+long lz4_decompress(const void *src, size_t len, void *dst, size_t max) {
+  const uint8_t *in = src;
+  const uint8_t *end = in + len;
+  uint8_t *out = dst;
+  uint8_t *out_end = out + max;
+
+  while (in < end) {
+    uint8_t token = *in++;
+    size_t lit = token >> 4;
+    if (lit == 15) {
+      long more = get_length(&in, end);
+      if (more < 0) {
+        return -1;
+      }
+      lit += more;
+    }
+    if (lit > (size_t) (end - in) || lit > (size_t) (out_end - out)) {
+      return -1;
+    }
+    memcpy(out, in, lit);
+    in += lit;
+    out += lit;
+    if (in == end) {
+      break; // the last sequence has no match
+    }
+
+    if (end - in < 2) {
+      return -1;
+    }
+    size_t offset = in[0] | (size_t) in[1] << 8;
+    in += 2;
+    if (offset == 0 || offset > (size_t) (out - (uint8_t *) dst)) {
+      return -1;
+    }
+    size_t mlen = token & 15;
+    if (mlen == 15) {
+      long more = get_length(&in, end);
+      if (more < 0) {
+        return -1;
+      }
+      mlen += more;
+    }
+    mlen += MIN_MATCH;
+    if (mlen > (size_t) (out_end - out)) {
+      return -1;
+    }
+
+    // a match may overlap the bytes it produces (runs of a short pattern)
+    const uint8_t *ref = out - offset;
+    if (offset >= mlen) {
+      memcpy(out, ref, mlen);
+    } else {
+      for (size_t ii = 0; ii < mlen; ++ii) {
+        out[ii] = ref[ii];
+      }
+    }
+    out += mlen;
+  }
+  return out - (uint8_t *) dst;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file lz4.h
+ *
+ * Compression in the LZ4 block format.
+ *
+ * A small implementation of the format (not the frame format: no header,
+ * checksum or size prefix), so the data it produces can be read by any LZ4
+ * block decoder and vice versa. The compressor is the greedy single-pass
+ * one, which trades some ratio for speed; the decompressor checks every
+ * length and offset, so corrupt input can't make it write out of bounds.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+
+/**
+ * Compress a buffer.
+ *
+ * @param src Data to compress.
+ * @param len Length of the data.
+ * @param dst Buffer for the compressed data.
+ * @param max Room in dst.
+ *
+ * @return Length of the compressed data, or 0 if it doesn't fit in max.
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t max);
+
+/**
+ * Decompress a buffer produced by lz4_compress().
+ *
+ * @param src Compressed data.
+ * @param len Length of the compressed data.
+ * @param dst Buffer for the decompressed data.
+ * @param max Room in dst.
+ *
+ * @return Length of the decompressed data, or -1 if src is corrupt or
+ *         decompresses to more than max bytes.
+ */
+long lz4_decompress(const void *src, size_t len, void *dst, size_t max);
+
+#endif
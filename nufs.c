@@ -3,7 +3,10 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,6 +16,9 @@
 
 #include "storage.h"
 #include "directory.h"
+#include "nufs_ioctl.h"
+#include "nufs_ll.h"
+#include "nufs_read.h"
 
 // implementation for: man 2 access
 // Checks if a file exists.
@@ -32,26 +38,11 @@ int nufs_getattr(const char *path, struct stat *st) {
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, with each entry's attributes, resuming
+// at offset when the listing didn't fit in one reply
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
-  int rv;
-  char temp[strlen(path)+15];
-  slist_t* list = storage_list(path);
-  while(list != NULL){
-    struct stat st;
-    memset(temp, 0, strlen(path)+DIR_NAME_LENGTH);
-    strcpy(temp, path);
-    if(strcmp(path, "/")) {
-      strcat(temp, "/");
-    }
-    strcat(temp, list->data);
-    int stats = storage_stat(temp, &st);
-    filler(buf, list->data, &st, 0);
-    list = list->next;
-  }
-  s_free(list);
-  return 0;
+  return storage_readdir(path, offset, filler, buf);
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -85,7 +76,7 @@ int nufs_link(const char *from, const char *to) {
 
 int nufs_rmdir(const char *path) {
   int rv = -1;
-  rv = storage_unlink(path);
+  rv = storage_rmdir(path);
   return rv;
 }
 
@@ -105,18 +96,34 @@ int nufs_chmod(const char *path, mode_t mode) {
 
 int nufs_truncate(const char *path, off_t size) {
   int rv = 0;
-  rv = storage_truncate(path);
+  rv = storage_truncate(path, size);
   return rv;
 }
 
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Get the open file stored in fi by nufs_open().
+static storage_file_t *get_fh(struct fuse_file_info *fi) {
+  return (storage_file_t *) (uintptr_t) fi->fh;
+}
+
+// Opens a file, keeping a handle to it in fi->fh so reads and writes
+// don't have to resolve the path again.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = -1;
-  rv = storage_find(path);
+  storage_file_t *fh;
+  int rv = storage_open(path, &fh);
+  if (rv == 0) {
+    fi->fh = (uintptr_t) fh;
+  }
+  return rv;
+}
+
+// implementation for: man 2 creat
+// Creates and opens a file in one go.
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  int rv = storage_mknod(path, mode);
+  if (rv == 0) {
+    rv = nufs_open(path, fi);
+  }
   return rv;
 }
 
@@ -124,7 +131,21 @@ int nufs_open(const char *path, struct fuse_file_info *fi) {
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
   int rv = 6;
-  rv = storage_read(path, buf, size, offset);
+  rv = storage_read_fh(get_fh(fi), buf, size, offset);
+  return rv;
+}
+
+// Reads without copying (see nufs_read_map()). FUSE frees the bufvec and
+// the memory buffers in it, and only sends it once we have returned, so the
+// file can't stay locked meanwhile; freed blocks are kept from reuse for a
+// commit instead (see blocks_release_freed()).
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  storage_file_t *fh = get_fh(fi);
+  int rv = nufs_read_map(fh, size, offset, bufp);
+  if (rv == 0) {
+    storage_map_end(fh);
+  }
   return rv;
 }
 
@@ -132,10 +153,83 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
   int rv = -1;
-  rv = storage_write(path, buf, size, offset);
+  rv = storage_write_fh(get_fh(fi), buf, size, offset);
+  return rv;
+}
+
+// Writes in place: the range is mapped first, then FUSE copies the data
+// straight into the mapped blocks, reading it from the pipe when the request
+// arrives in one (mount with -o splice_write), so the request is never
+// assembled in an intermediate buffer.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  storage_file_t *fh = get_fh(fi);
+  size_t size = fuse_buf_size(buf);
+  int max = STORAGE_MAP_RUNS(size);
+  storage_run_t *runs = malloc(max * sizeof(storage_run_t));
+  struct fuse_bufvec *dst =
+      malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  if (!runs || !dst) {
+    free(runs);
+    free(dst);
+    return -ENOMEM;
+  }
+
+  ssize_t rv = storage_write_begin(fh, size, offset, runs, max);
+  if (rv >= 0) {
+    *dst = FUSE_BUFVEC_INIT(0);
+    dst->count = rv;
+    for (int ii = 0; ii < rv; ++ii) {
+      struct fuse_buf *out = &dst->buf[ii];
+      memset(out, 0, sizeof(struct fuse_buf));
+      out->size = runs[ii].len;
+      out->mem = runs[ii].data;
+    }
+    rv = fuse_buf_copy(dst, buf, 0);
+    storage_write_end(fh, offset, offset + (rv > 0 ? rv : 0));
+  }
+  free(runs);
+  free(dst);
   return rv;
 }
 
+// Called on every close(2) of a file descriptor. Durability is fsync's job
+// (or the next commit's), so there is nothing to push out here.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  return 0;
+}
+
+// Make a file's changes durable. There are no timestamps, so fdatasync
+// has nothing less to do than fsync.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  return storage_fsync(get_fh(fi));
+}
+
+// Make a directory's changes durable. Directory updates are metadata, which
+// only a commit makes durable.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  return storage_sync();
+}
+
+// Preallocate space in a file or punch a hole in it.
+// Implementation for: man 2 fallocate
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                   struct fuse_file_info *fi) {
+  return storage_fallocate(get_fh(fi), mode, offset, len);
+}
+
+// Report the size and free space of the file system, e.g. for df.
+// Implementation for: man 2 statfs
+int nufs_statfs(const char *path, struct statvfs *st) {
+  return storage_statfs(st);
+}
+
+// Called once the last descriptor sharing an open file is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  storage_release(get_fh(fi));
+  return 0;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
   int rv = -1;
@@ -143,10 +237,25 @@ int nufs_utimens(const char *path, const struct timespec ts[2]) {
 }
 
 // Extended operations
+// See nufs_ioctl.h for the supported commands.
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = -1;
-  return rv;
+  // cmd arrives as an int, so pass it on without sign extension
+  storage_file_t *fh = fi && fi->fh ? get_fh(fi) : NULL;
+  return nufs_ioctl_run((unsigned int) cmd, data, fh);
+}
+
+// Called once FUSE is serving requests (and has daemonized), with the
+// journal commit interval as user data.
+void *nufs_init(struct fuse_conn_info *conn) {
+  int *commit = fuse_get_context()->private_data;
+  storage_start(*commit);
+  return commit;
+}
+
+// Called on unmount: commit everything and close the image.
+void nufs_destroy(void *data) {
+  storage_destroy();
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
@@ -163,19 +272,128 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->create = nufs_create;
   ops->read = nufs_read;
+  ops->read_buf = nufs_read_buf;
   ops->write = nufs_write;
+  ops->write_buf = nufs_write_buf;
+  ops->flush = nufs_flush;
+  ops->fsync = nufs_fsync;
+  ops->fsyncdir = nufs_fsyncdir;
+  ops->release = nufs_release;
+  ops->fallocate = nufs_fallocate;
+  ops->statfs = nufs_statfs;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// nufs-specific mount options, e.g. -o size=4G,inodes=100000
+struct nufs_config {
+  char *size;  // size of a newly created image (K/M/G suffixes allowed)
+  int inodes;  // inode count of a newly created image
+  int commit;  // seconds between journal commits
+  int lowlevel; // serve the low-level (inode-based) API instead
+  char *snapshot; // serve this snapshot, read-only, instead
+  int compress; // compress file data as it is written
+  char *cache;  // most file data to keep in memory (K/M/G suffixes allowed)
+  int populate; // fault the metadata in at mount
+  int hugepages; // back the image mapping with huge pages
+  char *access; // how file data is read: normal, random or sequential
+  int iodepth;  // writes a commit keeps in flight, 0 for synchronous
+};
+
+#define NUFS_OPT(t, p) { t, offsetof(struct nufs_config, p), 0 }
+#define NUFS_FLAG(t, p) { t, offsetof(struct nufs_config, p), 1 }
+
+static struct fuse_opt nufs_opts[] = {
+  NUFS_OPT("size=%s", size),
+  NUFS_OPT("inodes=%d", inodes),
+  NUFS_OPT("commit=%d", commit),
+  NUFS_FLAG("lowlevel", lowlevel),
+  NUFS_OPT("snapshot=%s", snapshot),
+  NUFS_FLAG("compress", compress),
+  NUFS_OPT("cache=%s", cache),
+  NUFS_FLAG("populate", populate),
+  NUFS_FLAG("hugepages", hugepages),
+  NUFS_OPT("access=%s", access),
+  NUFS_OPT("iodepth=%d", iodepth),
+  FUSE_OPT_END
+};
+
+// Parse a byte count with an optional K, M, G or T suffix.
+static size_t parse_size(const char *text) {
+  char *end;
+  size_t size = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'T': case 't': size <<= 10; // fall through
+  case 'G': case 'g': size <<= 10; // fall through
+  case 'M': case 'm': size <<= 10; // fall through
+  case 'K': case 'k': size <<= 10;
+  }
+  return size;
+}
+
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
   argc--;
-  printf("TODO: mount %s as data file\n", argv[argc]);
-  storage_init(argv[argc]);
-  nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+
+  struct nufs_config conf;
+  memset(&conf, 0, sizeof(conf));
+  conf.iodepth = -1;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &conf, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+
+  size_t size = conf.size ? parse_size(conf.size) : 0;
+  if (storage_init(argv[argc], size, conf.inodes) != 0) {
+    return 1;
+  }
+  if (conf.snapshot) {
+    if (storage_mount_snapshot(conf.snapshot) < 0) {
+      fprintf(stderr, "%s: no snapshot named %s\n", argv[argc], conf.snapshot);
+      storage_destroy();
+      return 1;
+    }
+    // the kernel then turns away every change
+    fuse_opt_add_arg(&args, "-oro");
+  }
+  storage_compress(conf.compress);
+  if (conf.cache && storage_cache(parse_size(conf.cache)) < 0) {
+    fprintf(stderr, "%s: out of memory for the cache\n", argv[argc]);
+    storage_destroy();
+    return 1;
+  }
+  int mapping = (conf.populate ? BLOCKS_MAP_POPULATE : 0) |
+                (conf.hugepages ? BLOCKS_MAP_HUGEPAGE : 0);
+  if (conf.access && !strcmp(conf.access, "random")) {
+    mapping |= BLOCKS_MAP_RANDOM;
+  } else if (conf.access && !strcmp(conf.access, "sequential")) {
+    mapping |= BLOCKS_MAP_SEQUENTIAL;
+  } else if (conf.access && strcmp(conf.access, "normal")) {
+    fprintf(stderr, "%s: access must be normal, random or sequential\n",
+            argv[argc]);
+    storage_destroy();
+    return 1;
+  }
+  if (storage_mapping(mapping) < 0) {
+    // only a hint, so mount anyway
+    fprintf(stderr, "%s: mapping options not fully applied\n", argv[argc]);
+  }
+  if (conf.iodepth >= 0) {
+    storage_io_depth(conf.iodepth);
+  }
+  int rv;
+  if (conf.lowlevel) {
+    rv = nufs_ll_main(&args, &conf.commit);
+  } else {
+    nufs_init_ops(&nufs_ops);
+    rv = fuse_main(args.argc, args.argv, &nufs_ops, &conf.commit);
+  }
+  fuse_opt_free_args(&args);
+  return rv;
 }
@@ -0,0 +1,50 @@
+/**
+ * @file nufs_ioctl.c
+ *
+ * ioctl commands understood by the nufs driver.
+ */
+
+#include <errno.h>
+
+#include "nufs_ioctl.h"
+
+#include "dcache.h"
+#include "storage.h"
+
+// Run an ioctl command on behalf of either FUSE frontend.
+int nufs_ioctl_run(unsigned int cmd, void *data, storage_file_t *fh) {
+  switch (cmd) {
+  case NUFS_IOC_DCACHE_STATS:
+    dcache_get_stats((dcache_stats_t *) data);
+    return 0;
+  case NUFS_IOC_SNAP_CREATE:
+  case NUFS_IOC_SNAP_DELETE: {
+    // the name comes from the caller, so don't trust it to be terminated
+    nufs_snapshot_name_t *arg = data;
+    arg->name[SNAPSHOT_NAME_LENGTH] = 0;
+    return cmd == NUFS_IOC_SNAP_CREATE ? storage_snapshot(arg->name)
+                                       : storage_snapshot_delete(arg->name);
+  }
+  case NUFS_IOC_SNAP_LIST: {
+    nufs_snapshot_list_t *list = data;
+    list->count = storage_snapshot_list(list->snapshots, SNAPSHOT_MAX);
+    list->_reserved = 0;
+    return 0;
+  }
+  case NUFS_IOC_DEDUP:
+    return storage_dedup((dedup_stats_t *) data);
+  case NUFS_IOC_SEEK: {
+    nufs_seek_t *arg = data;
+    if (!fh) {
+      return -EINVAL;
+    }
+    off_t pos = storage_seek(fh, arg->offset, arg->whence);
+    if (pos < 0) {
+      return pos;
+    }
+    arg->offset = pos;
+    return 0;
+  }
+  }
+  return -ENOTTY;
+}
@@ -0,0 +1,66 @@
+/**
+ * @file nufs_ioctl.h
+ *
+ * ioctl commands understood by the nufs driver, issued on any file or
+ * directory of a mounted nufs file system.
+ */
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "dcache.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "storage.h"
+
+typedef struct nufs_snapshot_name {
+  char name[SNAPSHOT_NAME_LENGTH + 1]; // NUL-terminated
+} nufs_snapshot_name_t;
+
+typedef struct nufs_seek {
+  int64_t offset; // where to start looking; set to what was found
+  int32_t whence; // SEEK_DATA or SEEK_HOLE
+  uint32_t _reserved;
+} nufs_seek_t;
+
+typedef struct nufs_snapshot_list {
+  uint32_t count; // snapshots filled in, oldest first
+  uint32_t _reserved;
+  snapshot_t snapshots[SNAPSHOT_MAX];
+} nufs_snapshot_list_t;
+
+// Read the dentry cache hit/miss counters.
+#define NUFS_IOC_DCACHE_STATS _IOR('N', 1, dcache_stats_t)
+
+// Take a snapshot of the whole file system.
+#define NUFS_IOC_SNAP_CREATE _IOW('N', 2, nufs_snapshot_name_t)
+
+// Delete a snapshot.
+#define NUFS_IOC_SNAP_DELETE _IOW('N', 3, nufs_snapshot_name_t)
+
+// List the snapshots.
+#define NUFS_IOC_SNAP_LIST _IOR('N', 4, nufs_snapshot_list_t)
+
+// Deduplicate the blocks of every file and report the ratio.
+#define NUFS_IOC_DEDUP _IOR('N', 5, dedup_stats_t)
+
+// lseek(2) with SEEK_DATA or SEEK_HOLE on an open file, which FUSE 2.9 has
+// no operation for (the kernel treats the whole file as data).
+#define NUFS_IOC_SEEK _IOWR('N', 6, nufs_seek_t)
+
+/**
+ * Run an ioctl command on behalf of either FUSE frontend.
+ *
+ * @param cmd The command.
+ * @param data The command's argument: _IOC_SIZE(cmd) bytes, read for _IOW
+ *        commands and filled in for _IOR ones.
+ * @param fh The open file the command was issued on, or NULL for a
+ *        directory.
+ *
+ * @return 0 on success, or a negative errno (-ENOTTY for an unknown command).
+ */
+int nufs_ioctl_run(unsigned int cmd, void *data, storage_file_t *fh);
+
+#endif
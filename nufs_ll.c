@@ -0,0 +1,399 @@
+/**
+ * @file nufs_ll.c
+ *
+ * Low-level FUSE frontend: requests name files by inode number.
+ *
+ * FUSE inode numbers are our inums (the root is inum 1, which is also
+ * FUSE_ROOT_ID). Every entry handed to the kernel, by lookup, mknod, mkdir
+ * or create, takes a reference on the inode, and forget drops them again,
+ * so an inode the kernel still knows about is never freed and reused.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "nufs_ll.h"
+
+#include "nufs_ioctl.h"
+#include "nufs_read.h"
+#include "storage.h"
+
+#define NUFS_LL_TIMEOUT 1.0 // seconds the kernel may cache names and attrs
+
+// Get the open file stored in fi by nufs_ll_open().
+static storage_file_t *get_fh(struct fuse_file_info *fi) {
+  return (storage_file_t *) (uintptr_t) fi->fh;
+}
+
+// Reply with an entry (or the error) from storage_lookup() and friends,
+// which took a reference the kernel now holds.
+static void reply_entry(fuse_req_t req, int inum, struct stat *st) {
+  if (inum < 0) {
+    fuse_reply_err(req, -inum);
+    return;
+  }
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = inum;
+  e.attr = *st;
+  e.attr_timeout = NUFS_LL_TIMEOUT;
+  e.entry_timeout = NUFS_LL_TIMEOUT;
+  if (fuse_reply_entry(req, &e) != 0) {
+    storage_forget(inum, 1); // the kernel never got it
+  }
+}
+
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  reply_entry(req, storage_lookup(parent, name, &st), &st);
+}
+
+// The kernel dropped nlookup references to an inode.
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                           unsigned long nlookup) {
+  storage_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count,
+                                 struct fuse_forget_data *forgets) {
+  for (size_t ii = 0; ii < count; ++ii) {
+    storage_forget(forgets[ii].ino, forgets[ii].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  // FUSE inode numbers are 64 bits wide, ours aren't
+  int rv = ino > INT32_MAX ? -ENOENT : storage_stat_inum(ino, &st);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fuse_reply_attr(req, &st, NUFS_LL_TIMEOUT);
+}
+
+// Handles chmod and truncate. There are no owners or timestamps to set, so
+// those changes are accepted and ignored.
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  int rv = 0;
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    rv = storage_chmod_inum(ino, attr->st_mode);
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    rv = storage_truncate_inum(ino, attr->st_size);
+  }
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  nufs_ll_getattr(req, ino, fi);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  reply_entry(req, storage_mknod_at(parent, name, mode, &st), &st);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+  nufs_ll_mknod(req, parent, name, mode | 040000, 0);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  fuse_reply_err(req, -storage_unlink_at(parent, name));
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+                          const char *name) {
+  fuse_reply_err(req, -storage_rmdir_at(parent, name));
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+  fuse_reply_err(req, -storage_rename_at(parent, name, newparent, newname));
+}
+
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  storage_file_t *fh;
+  int rv = storage_open_inum(ino, &fh);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fi->fh = (uintptr_t) fh;
+  if (fuse_reply_open(req, fi) != 0) {
+    storage_release(fh); // interrupted; no release will come
+  }
+}
+
+// Creates and opens a file in one go.
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent,
+                           const char *name, mode_t mode,
+                           struct fuse_file_info *fi) {
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  int inum = storage_mknod_at(parent, name, mode, &e.attr);
+  if (inum < 0) {
+    fuse_reply_err(req, -inum);
+    return;
+  }
+  storage_file_t *fh;
+  int rv = storage_open_inum(inum, &fh);
+  if (rv < 0) {
+    storage_forget(inum, 1);
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fi->fh = (uintptr_t) fh;
+  e.ino = inum;
+  e.attr_timeout = NUFS_LL_TIMEOUT;
+  e.entry_timeout = NUFS_LL_TIMEOUT;
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    storage_release(fh);
+    storage_forget(inum, 1);
+  }
+}
+
+// Reads without copying, like nufs_read_buf(). Here the reply is sent
+// before we return, so the file stays locked until the data is out, and
+// the bufvec stays ours to free.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi) {
+  storage_file_t *fh = get_fh(fi);
+  struct fuse_bufvec *bufv;
+  int rv = nufs_read_map(fh, size, off, &bufv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  storage_map_end(fh);
+  nufs_read_free(bufv);
+}
+
+// Writes in place, like nufs_write_buf().
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec *buf, off_t off,
+                              struct fuse_file_info *fi) {
+  storage_file_t *fh = get_fh(fi);
+  size_t size = fuse_buf_size(buf);
+  int max = STORAGE_MAP_RUNS(size);
+  storage_run_t *runs = malloc(max * sizeof(storage_run_t));
+  struct fuse_bufvec *dst =
+      malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  if (!runs || !dst) {
+    free(runs);
+    free(dst);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  ssize_t rv = storage_write_begin(fh, size, off, runs, max);
+  if (rv >= 0) {
+    *dst = FUSE_BUFVEC_INIT(0);
+    dst->count = rv;
+    for (int ii = 0; ii < rv; ++ii) {
+      struct fuse_buf *out = &dst->buf[ii];
+      memset(out, 0, sizeof(struct fuse_buf));
+      out->size = runs[ii].len;
+      out->mem = runs[ii].data;
+    }
+    rv = fuse_buf_copy(dst, buf, 0);
+    storage_write_end(fh, off, off + (rv > 0 ? rv : 0));
+  }
+  free(runs);
+  free(dst);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  fuse_reply_err(req, 0);
+}
+
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  storage_release(get_fh(fi));
+  fuse_reply_err(req, 0);
+}
+
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  fuse_reply_err(req, -storage_fsync(get_fh(fi)));
+}
+
+static void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                              off_t offset, off_t length,
+                              struct fuse_file_info *fi) {
+  fuse_reply_err(req, -storage_fallocate(get_fh(fi), mode, offset, length));
+}
+
+static void nufs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct statvfs st;
+  storage_statfs(&st);
+  fuse_reply_statfs(req, &st);
+}
+
+typedef struct dirbuf {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+} dirbuf_t;
+
+// Add an entry to a readdir reply, stopping once the reply is full.
+static int add_entry(void *ctx, const char *name, const struct stat *st,
+                     off_t next) {
+  dirbuf_t *db = ctx;
+  size_t len = fuse_add_direntry(db->req, db->buf + db->used,
+                                 db->size - db->used, name, st, next);
+  if (len > db->size - db->used) {
+    return 1;
+  }
+  db->used += len;
+  return 0;
+}
+
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+  dirbuf_t db = {req, malloc(size), size, 0};
+  if (!db.buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int rv = storage_readdir_inum(ino, off, add_entry, &db);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_buf(req, db.buf, db.used);
+  }
+  free(db.buf);
+}
+
+static void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *fi) {
+  fuse_reply_err(req, -storage_sync());
+}
+
+// Extended operations
+// See nufs_ioctl.h for the supported commands.
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags,
+                          const void *in_buf, size_t in_bufsz,
+                          size_t out_bufsz) {
+  // restricted ioctls carry exactly the argument the command encodes
+  unsigned int ucmd = cmd; // without sign extension
+  size_t size = _IOC_SIZE(ucmd);
+  char *data = calloc(1, size ? size : 1);
+  if (!data) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  if ((_IOC_DIR(ucmd) & _IOC_WRITE) && in_bufsz >= size) {
+    memcpy(data, in_buf, size);
+  }
+  int rv = nufs_ioctl_run(ucmd, data, fi && fi->fh ? get_fh(fi) : NULL);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else if (_IOC_DIR(ucmd) & _IOC_READ) {
+    fuse_reply_ioctl(req, 0, data, size);
+  } else {
+    fuse_reply_ioctl(req, 0, NULL, 0);
+  }
+  free(data);
+}
+
+// Called once FUSE is serving requests (and has daemonized), with the
+// journal commit interval as user data.
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  storage_start(*(int *) userdata);
+}
+
+// Called on unmount: commit everything and close the image.
+static void nufs_ll_destroy(void *userdata) {
+  storage_destroy();
+}
+
+static void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init = nufs_ll_init;
+  ops->destroy = nufs_ll_destroy;
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->forget_multi = nufs_ll_forget_multi;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->open = nufs_ll_open;
+  ops->create = nufs_ll_create;
+  ops->read = nufs_ll_read;
+  ops->write_buf = nufs_ll_write_buf;
+  ops->flush = nufs_ll_flush;
+  ops->release = nufs_ll_release;
+  ops->fsync = nufs_ll_fsync;
+  ops->fallocate = nufs_ll_fallocate;
+  ops->statfs = nufs_ll_statfs;
+  ops->readdir = nufs_ll_readdir;
+  ops->fsyncdir = nufs_ll_fsyncdir;
+  ops->ioctl = nufs_ll_ioctl;
+}
+
+// Mount the file system and serve requests until it is unmounted.
+int nufs_ll_main(struct fuse_args *args, int *commit) {
+  struct fuse_lowlevel_ops ops;
+  nufs_ll_init_ops(&ops);
+
+  char *mountpoint;
+  int multithreaded;
+  int foreground;
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) < 0) {
+    return 1;
+  }
+
+  int rv = -1;
+  struct fuse_chan *ch = fuse_mount(mountpoint, args);
+  if (ch) {
+    struct fuse_session *se =
+        fuse_lowlevel_new(args, &ops, sizeof(ops), commit);
+    if (se) {
+      if (fuse_set_signal_handlers(se) == 0) {
+        fuse_session_add_chan(se, ch);
+        if (fuse_daemonize(foreground) == 0) {
+          rv = multithreaded ? fuse_session_loop_mt(se)
+                             : fuse_session_loop(se);
+        }
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  return rv == 0 ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+/**
+ * @file nufs_ll.h
+ *
+ * Low-level FUSE frontend, selected at mount time with -o lowlevel.
+ *
+ * FUSE names files by inode number instead of by path, and those map
+ * directly to our inums, so no request walks a path.
+ */
+#ifndef NUFS_LL_H
+#define NUFS_LL_H
+
+#include <fuse_opt.h>
+
+/**
+ * Mount the file system and serve requests until it is unmounted.
+ *
+ * The image must already be open (storage_init()).
+ *
+ * @param args FUSE's command line: the mount point and FUSE options.
+ * @param commit Seconds between journal commits (0 for the default).
+ *
+ * @return 0 after a clean unmount, 1 on failure.
+ */
+int nufs_ll_main(struct fuse_args *args, int *commit);
+
+#endif
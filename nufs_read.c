@@ -0,0 +1,95 @@
+/**
+ * @file nufs_read.c
+ *
+ * Zero-copy reads, shared by the path-based and the low-level frontend.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_common.h>
+
+#include "nufs_read.h"
+
+/**
+ * Maps a read of an open file into a bufvec for FUSE
+ *
+ * @param fh Handle from storage_open()
+ * @param size Size of data to be read
+ * @param offset Offset to be read from
+ * @param bufp Set to the malloc'd bufvec
+ *
+ * @return int 0 on success, with the file left locked until
+ *         storage_map_end(), or -ENOMEM or -EIO if nothing could be read.
+ */
+int nufs_read_map(storage_file_t *fh, size_t size, off_t offset,
+                  struct fuse_bufvec **bufp) {
+  int max = STORAGE_MAP_RUNS(size);
+  storage_run_t *runs = malloc(max * sizeof(storage_run_t));
+  struct fuse_bufvec *bufv =
+      malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  if (!runs || !bufv) {
+    free(runs);
+    free(bufv);
+    return -ENOMEM;
+  }
+
+  int count = storage_map_fh(fh, size, offset, runs, max);
+  if (count < 0) {
+    free(runs);
+    free(bufv);
+    return count;
+  }
+  *bufv = FUSE_BUFVEC_INIT(0);
+  int ii;
+  for (ii = 0; ii < count; ++ii) {
+    struct fuse_buf *buf = &bufv->buf[ii];
+    memset(buf, 0, sizeof(struct fuse_buf));
+    buf->size = runs[ii].len;
+    if (runs[ii].pos >= 0) {
+      buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      buf->fd = blocks_get_fd();
+      buf->pos = runs[ii].pos;
+    } else if (runs[ii].owned) {
+      buf->mem = runs[ii].data; // already a copy of its own
+    } else if (!(buf->mem = calloc(1, buf->size))) {
+      break; // return what we have as a short read
+    } else if (runs[ii].data) {
+      memcpy(buf->mem, runs[ii].data, buf->size);
+    }
+  }
+  for (int jj = ii; jj < count; ++jj) {
+    if (runs[jj].owned) {
+      free(runs[jj].data);
+    }
+  }
+  free(runs);
+
+  if (count && ii == 0) {
+    storage_map_end(fh);
+    free(bufv);
+    return -ENOMEM;
+  }
+  // an empty read keeps the single empty buffer FUSE_BUFVEC_INIT made
+  if (count) {
+    bufv->count = ii;
+  }
+  *bufp = bufv;
+  return 0;
+}
+
+/**
+ * Frees a bufvec from nufs_read_map() along with its memory buffers
+ *
+ * @param bufv The bufvec
+ */
+void nufs_read_free(struct fuse_bufvec *bufv) {
+  for (size_t ii = 0; ii < bufv->count; ++ii) {
+    if (!(bufv->buf[ii].flags & FUSE_BUF_IS_FD)) {
+      free(bufv->buf[ii].mem);
+    }
+  }
+  free(bufv);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file nufs_read.h
+ *
+ * Zero-copy reads, shared by the path-based and the low-level frontend.
+ */
+#ifndef NUFS_READ_H
+#define NUFS_READ_H
+
+#include <sys/types.h>
+
+#include "storage.h"
+
+struct fuse_bufvec;
+
+/**
+ * Maps a read of an open file into a bufvec for FUSE
+ *
+ * Every committed extent of the range becomes a range of the image file,
+ * which FUSE splices straight out of the page cache when the kernel
+ * supports it (and preads otherwise). Data that is only in our mapping so
+ * far is copied out into a buffer of its own, holes get calloc'd zeros, and
+ * compressed data comes decompressed. The read comes up short where a copy
+ * can't be made.
+ *
+ * @param fh Handle from storage_open()
+ * @param size Size of data to be read
+ * @param offset Offset to be read from
+ * @param bufp Set to the malloc'd bufvec; its memory buffers are malloc'd
+ *        too (see nufs_read_free())
+ *
+ * @return int 0 on success, with the file left locked until
+ *         storage_map_end(), or -ENOMEM or -EIO if nothing could be read.
+ */
+int nufs_read_map(storage_file_t *fh, size_t size, off_t offset,
+                  struct fuse_bufvec **bufp);
+
+/**
+ * Frees a bufvec from nufs_read_map() along with its memory buffers
+ *
+ * @param bufv The bufvec
+ */
+void nufs_read_free(struct fuse_bufvec *bufv);
+
+#endif
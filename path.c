@@ -0,0 +1,35 @@
+/**
+ * @file path.c
+ *
+ * Allocation-free path parsing.
+ */
+
+#include <string.h>
+
+#include "path.h"
+
+// Get the next component of a path, advancing the cursor past it.
+int path_next(const char **path, path_part_t *part) {
+  const char *p = *path;
+  while (*p == '/') {
+    p++;
+  }
+  if (!*p) {
+    *path = p;
+    return 0;
+  }
+
+  part->name = p;
+  while (*p && *p != '/') {
+    p++;
+  }
+  part->len = p - part->name;
+  *path = p;
+  return 1;
+}
+
+// Get the last component of a path.
+const char *path_basename(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
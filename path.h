@@ -0,0 +1,39 @@
+/**
+ * @file path.h
+ *
+ * Allocation-free path parsing.
+ *
+ * Paths are walked in place: each component is returned as a slice (pointer
+ * and length) into the original string, so resolving a path never copies or
+ * allocates.
+ */
+#ifndef PATH_H
+#define PATH_H
+
+typedef struct path_part {
+  const char *name; // start of the component, not NUL-terminated
+  int len;          // length of the component
+} path_part_t;
+
+/**
+ * Get the next component of a path.
+ *
+ * Leading and repeated slashes are skipped, so "/a//b/" yields "a" and "b".
+ *
+ * @param path Cursor into the path; advanced past the returned component.
+ * @param part Filled in with the component.
+ *
+ * @return 1 if a component was found, 0 at the end of the path.
+ */
+int path_next(const char **path, path_part_t *part);
+
+/**
+ * Get the last component of a path.
+ *
+ * @param path The path, without a trailing slash (as FUSE passes them).
+ *
+ * @return Pointer to the last component inside path ("" for "/").
+ */
+const char *path_basename(const char *path);
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * @file snapshot.c
+ *
+ * Point-in-time snapshots of the whole file system.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "snapshot.h"
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+
+// Get the snapshot table.
+snapshot_t *get_snapshots() {
+  return (snapshot_t *) (get_superblock() + 1);
+}
+
+// Find a snapshot by name.
+snapshot_t *snapshot_find(const char *name) {
+  snapshot_t *table = get_snapshots();
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    if (table[ii].name[0] &&
+        !strncmp(table[ii].name, name, sizeof(table[ii].name))) {
+      return &table[ii];
+    }
+  }
+  return NULL;
+}
+
+// Remove the extent trees of the copied inodes below end, dropping their
+// owner of every data block.
+static void drop_inodes(void *ibm, inode_t *table, int end) {
+  for (int inum = bitmap_next_one(ibm, end, 1); inum >= 0;
+       inum = bitmap_next_one(ibm, end, inum + 1)) {
+    extent_header_t *tree = &table[inum].tree;
+    extent_remove(tree, 0, extent_end(tree));
+  }
+}
+
+// Take a snapshot of the file system as it is now.
+int snapshot_create(const char *name) {
+  if (!name[0]) {
+    return -EINVAL;
+  }
+  if (strlen(name) > SNAPSHOT_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  if (snapshot_find(name)) {
+    return -EEXIST;
+  }
+  snapshot_t *slot = NULL;
+  for (int ii = 0; ii < SNAPSHOT_MAX && !slot; ++ii) {
+    if (!get_snapshots()[ii].name[0]) {
+      slot = &get_snapshots()[ii];
+    }
+  }
+  if (!slot) {
+    return -ENOSPC;
+  }
+
+  // the inode bitmap and table lie next to each other, so one run holds
+  // the copy of both; on a fragmented disk it may take a search of the
+  // whole bitmap to find
+  superblock_t *sb = get_superblock();
+  int count = sb->journal_start - sb->inode_bitmap_start;
+  int start = alloc_run(count);
+  if (start < 0) {
+    return -ENOSPC;
+  }
+  void *ibm = blocks_get_blocks(start, count);
+  inode_t *table = blocks_get_block(start + sb->inode_bitmap_blocks);
+  memcpy(ibm, get_inode_bitmap(), (size_t) count * BLOCK_SIZE);
+  journal_dirty(ibm, (size_t) count * BLOCK_SIZE, 1);
+
+  int total = sb->inode_count;
+  for (int inum = bitmap_next_one(ibm, total, 1); inum >= 0;
+       inum = bitmap_next_one(ibm, total, inum + 1)) {
+    if (inode_unlinked(inum)) {
+      bitmap_put(ibm, inum, 0);
+      memset(&table[inum], 0, sizeof(inode_t));
+      continue;
+    }
+    if (extent_clone(&table[inum].tree) < 0) {
+      drop_inodes(ibm, table, inum + 1);
+      free_blocks(start, count);
+      return -ENOSPC;
+    }
+  }
+
+  memset(slot, 0, sizeof(snapshot_t));
+  strcpy(slot->name, name);
+  slot->created = time(NULL);
+  slot->start = start;
+  slot->blocks = count;
+  journal_dirty(slot, sizeof(snapshot_t), 1);
+  return 0;
+}
+
+// Delete a snapshot, freeing the blocks only it still owns.
+int snapshot_delete(const char *name) {
+  snapshot_t *snap = snapshot_find(name);
+  if (!snap) {
+    return -ENOENT;
+  }
+  superblock_t *sb = get_superblock();
+  void *ibm = blocks_get_blocks(snap->start, snap->blocks);
+  inode_t *table = blocks_get_block(snap->start + sb->inode_bitmap_blocks);
+  drop_inodes(ibm, table, sb->inode_count);
+  free_blocks(snap->start, snap->blocks);
+
+  memset(snap, 0, sizeof(snapshot_t));
+  journal_dirty(snap, sizeof(snapshot_t), 1);
+  return 0;
+}
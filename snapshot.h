@@ -0,0 +1,80 @@
+/**
+ * @file snapshot.h
+ *
+ * Point-in-time snapshots of the whole file system.
+ *
+ * A snapshot is a frozen copy of the inode bitmap and inode table, kept in
+ * data blocks. Each copied inode gets its own extent tree nodes, but the
+ * file and directory blocks they map are shared with the live file system
+ * through the share table (see blocks.h); whichever side changes a shared
+ * block first copies it (inode_unshare()). Taking a snapshot therefore
+ * costs a copy of the inode table and tree nodes plus a walk over every
+ * extent, however much data the files hold.
+ *
+ * The snapshot table fills the rest of block 0, after the superblock. A
+ * snapshot can be mounted read-only by serving its copy of the inodes in
+ * place of the live ones (blocks_view_inodes()).
+ *
+ * The functions here change the image, so they must run inside
+ * journal_begin_exclusive()/journal_end().
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define SNAPSHOT_NAME_LENGTH 31
+
+typedef struct snapshot {
+  char name[SNAPSHOT_NAME_LENGTH + 1]; // NUL-terminated; empty if unused
+  int64_t created;                     // seconds since the epoch
+  uint32_t start;  // first block of the copy of the inode bitmap and table
+  uint32_t blocks; // length of the copy in blocks
+} snapshot_t;
+
+// number of snapshots that fit in block 0 after the superblock
+#define SNAPSHOT_MAX \
+  ((BLOCK_SIZE - sizeof(superblock_t)) / sizeof(snapshot_t))
+
+/**
+ * Get the snapshot table.
+ *
+ * @return The SNAPSHOT_MAX slots of the table, in block 0.
+ */
+snapshot_t *get_snapshots();
+
+/**
+ * Find a snapshot by name.
+ *
+ * @param name Name of the snapshot.
+ *
+ * @return Its slot in the table, or NULL if there is none by that name.
+ */
+snapshot_t *snapshot_find(const char *name);
+
+/**
+ * Take a snapshot of the file system as it is now.
+ *
+ * Files that are open but no longer linked aren't part of the snapshot.
+ * Must be called with every operation shut out (journal_begin_exclusive()).
+ *
+ * @param name Name of the new snapshot.
+ *
+ * @return 0 on success, -EINVAL or -ENAMETOOLONG for a bad name, -EEXIST
+ *         if the name is taken, -ENOSPC if the table is full or no free run
+ *         on the disk is long enough for the copy of the inode table.
+ */
+int snapshot_create(const char *name);
+
+/**
+ * Delete a snapshot, freeing the blocks only it still owns.
+ *
+ * @param name Name of the snapshot.
+ *
+ * @return 0 on success, -ENOENT if there is no such snapshot.
+ */
+int snapshot_delete(const char *name);
+
+#endif
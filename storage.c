@@ -1,6 +1,12 @@
+#define _GNU_SOURCE // FALLOC_FL_*, SEEK_DATA and SEEK_HOLE
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
@@ -12,14 +18,114 @@
 #include "inode.h"
 #include "directory.h"
 #include "bitmap.h"
+#include "path.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "dcache.h"
+#include "compress.h"
+#include "dedup.h"
+#include "io.h"
+
+// nonzero while a snapshot is mounted instead of the live file system
+static int snapshot_view = 0;
+
+// nonzero to compress clusters as writes complete them
+static int compress_data = 0;
+
+// queue depth storage_start() sets the ring up with, -1 for the default
+static int io_depth = -1;
 
 /**
  * Initializes filesystem with image
  *
  * @param path Path to image file
+ * @param size Size in bytes of a new image (0 for the default)
+ * @param inodes Inode count of a new image (0 to derive from size)
+ *
+ * @return int 0 on success, -1 if the image can't be used.
+ */
+int storage_init(const char *path, size_t size, int inodes) {
+  snapshot_view = 0;
+  compress_init();
+  if (blocks_init(path, size, inodes) < 0) {
+    return -1;
+  }
+  // persist a newly formatted image right away
+  return journal_commit() < 0 ? -1 : 0;
+}
+
+/**
+ * Starts background work for a mounted image
+ *
+ * @param commit_interval Seconds between journal commits (0 for default)
+ */
+void storage_start(int commit_interval) {
+  // a ring only works in the process that set it up, and FUSE forks to
+  // daemonize after the image is opened, so until now writes are synchronous
+  int depth = io_depth < 0 ? IO_QUEUE_DEPTH : io_depth;
+  if (!io_init(blocks_get_fd(), depth) && io_depth > 0) {
+    fprintf(stderr, "storage: no io_uring, writing synchronously\n");
+  }
+  // files being appended to when the image was last mounted may still have
+  // blocks mapped ahead of their end, which no one will trim otherwise
+  journal_begin();
+  int trimmed = inode_trim_crashed();
+  journal_end();
+  if (trimmed) {
+    fprintf(stderr, "storage: freed blocks mapped ahead of %d file(s)\n",
+            trimmed);
+  }
+  journal_start(commit_interval);
+}
+
+/**
+ * Turns compression of file data on or off
+ *
+ * @param enable Nonzero to compress data written from now on
  */
-void storage_init(const char *path) {
-  blocks_init(path);
+void storage_compress(int enable) {
+  compress_data = enable;
+}
+
+/**
+ * Bounds the memory holding file data
+ *
+ * @param bytes Most bytes of file data to keep in memory, 0 for no bound
+ *
+ * @return int 0 on success, -ENOMEM if out of memory.
+ */
+int storage_cache(size_t bytes) {
+  return blocks_set_cache(bytes) < 0 ? -ENOMEM : 0;
+}
+
+/**
+ * Tunes how the image is mapped in
+ *
+ * @param flags BLOCKS_MAP_* flags
+ *
+ * @return int 0 on success, -EINVAL if the kernel turned some of it down.
+ */
+int storage_mapping(int flags) {
+  return blocks_set_mapping(flags) < 0 ? -EINVAL : 0;
+}
+
+/**
+ * Sets how many writes a commit keeps in flight
+ *
+ * @param depth Queue depth, or 0 to write synchronously
+ */
+void storage_io_depth(int depth) {
+  io_depth = depth;
+}
+
+/**
+ * Commits outstanding changes and closes the image
+ */
+void storage_destroy() {
+  journal_stop();
+  blocks_free();
+  compress_free();
+  dedup_free();
 }
 
 /**
@@ -27,10 +133,23 @@ void storage_init(const char *path) {
  *
  * @param path Item to be found
  *
- * @return int 0 if exists, -1 if doesn't
+ * @return int 0 if exists, -ENOENT if doesn't
  */
 int storage_find(const char *path) {
-  return directory_find(path) ? 0 : -1;
+  directory_lock(0);
+  int inum = directory_find(path);
+  directory_unlock();
+  return inum >= 0 ? 0 : -ENOENT;
+}
+
+// Fill in the attributes of an inode that isn't locked yet.
+static void fill_stat(int inum, struct stat *st) {
+  inode_lock(inum, 0);
+  inode_t *node = get_inode(inum);
+  st->st_ino = inum;
+  st->st_mode = node->mode;
+  st->st_size = node->size;
+  inode_unlock(inum);
 }
 
 /**
@@ -42,16 +161,137 @@ int storage_find(const char *path) {
  * @return int 0 on success, -2 if DNE
  */
 int storage_stat(const char *path, struct stat *st) {
+  directory_lock(0);
   int inum = directory_find(path);
-  if(inum < 0 || inum > INODE_COUNT) {
-    return -2; //ENOENT = 2
+  if (inum >= 0) {
+    fill_stat(inum, st);
+  }
+  directory_unlock();
+  return inum >= 0 ? 0 : -2; //ENOENT = 2
+}
+
+// Find the run of file data starting at byte pos: the rest of the extent
+// (or hole) it falls in, capped at max bytes. Sets *ptr to the mapped bytes,
+// or to NULL for a hole or compressed data, fills in the extent and returns
+// the length of the run.
+static size_t map_run(inode_t *node, off_t pos, size_t max, char **ptr,
+                      extent_t *ext) {
+  uint32_t lblk = pos / BLOCK_SIZE;
+  int mapped = inode_get_extent(node, lblk, ext);
+
+  uint64_t run = ((uint64_t) ext->lblk + ext->len) * BLOCK_SIZE - pos;
+  if (run > max) {
+    run = max;
+  }
+  *ptr = NULL;
+  if (mapped && !ext->zlen) {
+    uint32_t last = (pos + run - 1) / BLOCK_SIZE;
+    char *block = blocks_get_blocks(ext->start + (lblk - ext->lblk),
+                                    last - lblk + 1);
+    *ptr = block + pos % BLOCK_SIZE;
+  }
+  return run;
+}
+
+// Copy a run of compressed data that map_run() found at byte pos. Returns
+// 0, or -1 if the data is corrupt.
+static int unpack_run(extent_t *ext, off_t pos, char *buf, size_t len) {
+  return compress_read(ext, pos - (off_t) ext->lblk * BLOCK_SIZE, buf, len);
+}
+
+// Read from an inode locked for reading.
+static int read_inode(inode_t *node, char *buf, size_t size, off_t offset) {
+  assert(!(node->mode & 040000)); //file should NOT be a directory
+
+  if (offset >= node->size) {
+    return 0;
+  }
+  if (offset + size > node->size) {
+    size = node->size - offset;
+  }
+  if (size) {
+    inode_readahead(node, offset / BLOCK_SIZE,
+                    (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1);
+  }
+
+  // one copy per extent rather than per block
+  size_t read = 0;
+  while (read < size) {
+    char *src;
+    extent_t ext;
+    size_t run = map_run(node, offset + read, size - read, &src, &ext);
+    if (src) {
+      memcpy(buf + read, src, run);
+    } else if (!ext.zlen) {
+      memset(buf + read, 0, run);
+    } else if (unpack_run(&ext, offset + read, buf + read, run) < 0) {
+      return -EIO;
+    }
+    read += run;
+  }
+  return (int)read;
+}
+
+// Map the blocks a write will change, leaving any gap before them a hole,
+// and make sure no snapshot shares them. Writes through an open file map
+// ahead when appending (see inode_map_append()). Returns 0, -EFBIG if the
+// write goes past the largest file size, or -ENOSPC if the disk is full.
+static int prepare_write(inode_t *node, size_t size, off_t offset,
+                         int open) {
+  if (offset + (int64_t) size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  uint32_t first = offset / BLOCK_SIZE;
+  uint32_t last = (offset + size - 1) / BLOCK_SIZE;
+  int rv = open ? inode_map_append(node, first, last - first + 1)
+                : inode_map(node, first, last - first + 1);
+  if (rv < 0 || inode_unshare(node, first, last - first + 1) < 0) {
+    return -ENOSPC;
   }
-  inode_t *node = get_inode(inum);
-  st->st_mode = node->mode;
-  st->st_size = node->size;
   return 0;
 }
 
+// Compress the clusters a write of size bytes at offset completed, if
+// compression is on.
+static void finish_write(inode_t *node, size_t size, off_t offset) {
+  if (compress_data && size && !(node->mode & 040000)) {
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t last = (offset + size - 1) / BLOCK_SIZE;
+    inode_compress(node, first, last - first + 1);
+  }
+}
+
+// Write to an inode locked for writing, through an open file if open.
+static int write_inode(inode_t *node, const char *buf, size_t size,
+                       off_t offset, int open) {
+  assert(!(node->mode & 040000)); //file should NOT be a directory
+  int rv = prepare_write(node, size, offset, open);
+  if (rv < 0) {
+    return rv;
+  }
+
+  // one copy per extent rather than per block
+  size_t written = 0;
+  while (written < size) {
+    char *dst;
+    extent_t ext;
+    size_t run = map_run(node, offset + written, size - written, &dst, &ext);
+    assert(dst);
+    memcpy(dst, buf + written, run);
+    inode_dirty_data(node, dst, run);
+    written += run;
+  }
+  if (offset + size > node->size) {
+    node->size = offset + size;
+    inode_dirty(node);
+  }
+  finish_write(node, size, offset);
+  return (int)written;
+}
+
 /**
  * Reads data from file
  *
@@ -63,87 +303,500 @@ int storage_stat(const char *path, struct stat *st) {
  * @return int Bytes read
  */
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+  int rv = -2; //ENOENT (file does not exist)
+  directory_lock(0);
   int inum = directory_find(path);
-  if(inum < 0) return -2; //ENOENT (file does not exist)
+  if (inum >= 0) {
+    inode_lock(inum, 0);
+    rv = read_inode(get_inode(inum), buf, size, offset);
+    inode_unlock(inum);
+  }
+  directory_unlock();
+  return rv;
+}
+
+/**
+ * Writes data to file
+ *
+ * @param path File to be written to
+ * @param buf Data buffer
+ * @param size Size of data to write
+ * @param offset Offset to write to
+ *
+ * @return int Bytes written
+ */
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+  int rv = -2; //ENOENT (file does not exist)
+  journal_begin();
+  directory_lock(0);
+  int inum = directory_find(path);
+  if (inum >= 0) {
+    inode_lock(inum, 1);
+    rv = write_inode(get_inode(inum), buf, size, offset, 0);
+    inode_unlock(inum);
+  }
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+// Create a node in a directory, with the tree locked for writing.
+// Returns the new inum, or a negative errno.
+static int create_locked(int parentinum, const char *name, mode_t mode) {
+  inode_t *parent = get_inode(parentinum);
+  if (!(parent->mode & 040000)) {
+    return -ENOTDIR;
+  }
+  if (strlen(name) > DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  if (directory_lookup(parent, name) >= 0) {
+    return -EEXIST;
+  }
+
+  int inum = alloc_inode(parentinum, (mode & 040000) != 0);
+  if (inum < 0) {
+    return -ENOSPC;
+  }
+
   inode_t *node = get_inode(inum);
-  assert(!(node->mode & 040000)); //file should NOT be a directory
+  node->mode = mode;
+  node->size = 0;
+  if (mode & 040000) {
+    // directories always have their entry block; without one, entries
+    // would be written over block 0
+    if (grow_inode(node, BLOCK_SIZE) < 0) {
+      free_inode(inum);
+      return -ENOSPC;
+    }
+    node->size = BLOCK_SIZE;
+  }
+  inode_dirty(node);
 
-  int block = offset / BLOCK_SIZE;
-  int blockoffset = offset % BLOCK_SIZE;
-  size_t left = size;
+  if (directory_put(parent, name, inum) < 0) {
+    free_inode(inum);
+    return -ENOSPC;
+  }
+  return inum;
+}
 
-  if (offset + left > node->size) {
-    left = node->size - offset;
+// Create a node with the directory tree locked for writing.
+static int mknod_locked(const char *path, const char *last, mode_t mode) {
+  int parentinum = directory_find_parent(path);
+  if (parentinum < 0) {
+    return -1;
   }
+  return create_locked(parentinum, last, mode) < 0 ? -1 : 0;
+}
 
-  int endblock = (offset + left) / BLOCK_SIZE;
-  if ((offset + left) % BLOCK_SIZE == 0) {
-    endblock--;
+/**
+ * Opens a file
+ *
+ * @param path Path of the file to open
+ * @param fh Set to the new handle, to be closed with storage_release()
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOMEM if out of memory.
+ */
+int storage_open(const char *path, storage_file_t **fh) {
+  storage_file_t *file = malloc(sizeof(storage_file_t));
+  if (!file) {
+    return -ENOMEM;
   }
-  size_t read = 0;
 
-  for (int i = block; i <= endblock; i++) {
-    char *blockptr = blocks_get_block(inode_get_bnum(node, i));
-    int readsize = left > BLOCK_SIZE ? BLOCK_SIZE : left;
-    if (blockoffset) {
-      int readsize = readsize + blockoffset > BLOCK_SIZE ? BLOCK_SIZE - blockoffset : readsize;
-      memcpy(buf, blockptr + blockoffset, readsize);
-      read += readsize;
-      left -= readsize;
-      blockoffset = 0;
-    } else {
-      memcpy(buf + read, blockptr, readsize);
-      read += readsize;
-      left -= readsize;
+  // pin while the tree is locked, so an unlink can't free it in between
+  directory_lock(0);
+  int inum = directory_find(path);
+  if (inum >= 0) {
+    inode_pin(inum);
+  }
+  directory_unlock();
+
+  if (inum < 0) {
+    free(file);
+    return -ENOENT;
+  }
+  file->inum = inum;
+  file->node = get_inode(inum);
+  *fh = file;
+  return 0;
+}
+
+/**
+ * Reads data from an open file
+ *
+ * @param fh Handle from storage_open()
+ * @param buf Data buffer
+ * @param size Size of data to be read
+ * @param offset Offset to be read from
+ *
+ * @return int Bytes read
+ */
+int storage_read_fh(storage_file_t *fh, char *buf, size_t size, off_t offset) {
+  inode_lock(fh->inum, 0);
+  int rv = read_inode(fh->node, buf, size, offset);
+  inode_unlock(fh->inum);
+  return rv;
+}
+
+/**
+ * Locates data of an open file in the image without copying it
+ *
+ * @param fh Handle from storage_open()
+ * @param size Size of data to be read
+ * @param offset Offset to be read from
+ * @param runs Filled with the runs, in file order
+ * @param max Room in runs; STORAGE_MAP_RUNS(size) is always enough
+ *
+ * @return int Number of runs filled in, or -ENOMEM or -EIO if not even the
+ *         first one could be.
+ */
+int storage_map_fh(storage_file_t *fh, size_t size, off_t offset,
+                   storage_run_t *runs, int max) {
+  inode_t *node = fh->node;
+  inode_lock(fh->inum, 0);
+  assert(!(node->mode & 040000)); //file should NOT be a directory
+
+  if (offset >= node->size) {
+    size = 0;
+  } else if (offset + size > node->size) {
+    size = node->size - offset;
+  }
+  if (size) {
+    inode_readahead(node, offset / BLOCK_SIZE,
+                    (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1);
+  }
+
+  int count = 0;
+  int rv = 0;
+  size_t mapped = 0;
+  while (mapped < size && count < max) {
+    char *src;
+    extent_t ext;
+    size_t run = map_run(node, offset + mapped, size - mapped, &src, &ext);
+    runs[count].data = src;
+    runs[count].pos = -1;
+    runs[count].owned = 0;
+    if (ext.zlen) {
+      // the read comes up short where no copy can be made
+      char *copy = malloc(run);
+      if (!copy) {
+        rv = -ENOMEM;
+        break;
+      }
+      if (unpack_run(&ext, offset + mapped, copy, run) < 0) {
+        free(copy);
+        rv = -EIO;
+        break;
+      }
+      runs[count].data = copy;
+      runs[count].owned = 1;
+    } else if (src) {
+      // uncommitted blocks differ from the image file; split the run where
+      // that changes and only point clean parts at the file
+      off_t pos = src - (char *) blocks_get_block(0);
+      int bnum = pos / BLOCK_SIZE;
+      int dirty = journal_is_dirty(bnum);
+      size_t same = BLOCK_SIZE - pos % BLOCK_SIZE;
+      while (same < run && journal_is_dirty(++bnum) == dirty) {
+        same += BLOCK_SIZE;
+      }
+      run = same < run ? same : run;
+      runs[count].pos = dirty ? -1 : pos;
     }
+    runs[count].len = run;
+    count++;
+    mapped += run;
   }
-  return (int)read;
+  if (count == 0 && rv < 0) {
+    inode_unlock(fh->inum);
+    return rv;
+  }
+  return count;
 }
 
 /**
- * Writes data to file
+ * Lets go of the file a successful storage_map_fh() left locked
  *
- * @param path File to be written to
+ * @param fh Handle passed to storage_map_fh()
+ */
+void storage_map_end(storage_file_t *fh) {
+  inode_unlock(fh->inum);
+}
+
+/**
+ * Writes data to an open file
+ *
+ * @param fh Handle from storage_open()
  * @param buf Data buffer
  * @param size Size of data to write
  * @param offset Offset to write to
  *
- * @return int Bytes written
+ * @return int Bytes written, -EFBIG if past the largest file size, or
+ *         -ENOSPC if the disk is full.
  */
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-  int inum = directory_find(path);
-  if(inum < 0) return -2; //ENOENT (file does not exist)
-  inode_t *node = get_inode(inum);
+int storage_write_fh(storage_file_t *fh, const char *buf, size_t size,
+                     off_t offset) {
+  journal_begin();
+  inode_lock(fh->inum, 1);
+  int rv = write_inode(fh->node, buf, size, offset, 1);
+  inode_unlock(fh->inum);
+  journal_end();
+  return rv;
+}
+
+/**
+ * Starts writing to an open file in place
+ *
+ * @param fh Handle from storage_open()
+ * @param size Size of data to be written
+ * @param offset Offset to write to
+ * @param runs Filled with the runs, in file order
+ * @param max Room in runs; STORAGE_MAP_RUNS(size) is always enough
+ *
+ * @return int Number of runs filled in, -EFBIG if past the largest file
+ *         size, or -ENOSPC if the disk is full.
+ */
+int storage_write_begin(storage_file_t *fh, size_t size, off_t offset,
+                        storage_run_t *runs, int max) {
+  inode_t *node = fh->node;
+  journal_begin();
+  inode_lock(fh->inum, 1);
   assert(!(node->mode & 040000)); //file should NOT be a directory
-  grow_inode(node, offset + size);
+  int rv = prepare_write(node, size, offset, 1);
+  if (rv < 0) {
+    inode_unlock(fh->inum);
+    journal_end();
+    return rv;
+  }
 
-  int block = offset / BLOCK_SIZE;
-  int blockoffset = offset % BLOCK_SIZE;
-  size_t left = size;
+  int count = 0;
+  size_t mapped = 0;
+  while (mapped < size && count < max) {
+    char *dst;
+    extent_t ext;
+    size_t run = map_run(node, offset + mapped, size - mapped, &dst, &ext);
+    assert(dst);
+    inode_dirty_data(node, dst, run);
+    runs[count].data = dst;
+    runs[count].pos = -1;
+    runs[count].len = run;
+    runs[count].owned = 0;
+    count++;
+    mapped += run;
+  }
+  return count;
+}
 
-  int endblock = (offset + left) / BLOCK_SIZE;
-  if ((offset + left) % BLOCK_SIZE == 0) {
-    endblock--;
-  } 
-  size_t written = 0;
-  for (int i = block; i <= endblock; i++) {
-    int bnum = inode_get_bnum(node, i);
-    char *blockptr = blocks_get_block(bnum);
-    int writesize = left > BLOCK_SIZE ? BLOCK_SIZE : left;
-    if (blockoffset) {
-      int writesize = writesize + blockoffset > BLOCK_SIZE ? BLOCK_SIZE - blockoffset : writesize;
-      memcpy(blockptr + blockoffset, buf, writesize); 
-      written += writesize;
-      left -= writesize;
-      blockoffset = 0;
-    } else {
-      memcpy(blockptr, buf + written, writesize);
-      written += writesize;
-      left -= writesize;
+/**
+ * Finishes a write started with storage_write_begin()
+ *
+ * @param fh Handle from storage_open()
+ * @param offset Offset the write started at
+ * @param end Offset just past the last byte actually written
+ */
+void storage_write_end(storage_file_t *fh, off_t offset, off_t end) {
+  inode_t *node = fh->node;
+  if (end > node->size) {
+    node->size = end;
+    inode_dirty(node);
+  }
+  // blocks a short write mapped past the end stay mapped, like blocks
+  // preallocated with storage_fallocate(); they are zeros until written
+  if (end > offset) {
+    finish_write(node, end - offset, offset);
+  }
+  inode_unlock(fh->inum);
+  journal_end();
+}
+
+// Zero bytes [from, to) of a single block of an inode locked for writing,
+// unless the block is a hole. Returns 0, or -ENOSPC if the disk is full.
+static int zero_partial(inode_t *node, off_t from, off_t to) {
+  uint32_t lblk = from / BLOCK_SIZE;
+  extent_t ext;
+  if (from >= to || !inode_get_extent(node, lblk, &ext)) {
+    return 0;
+  }
+  if (inode_unshare(node, lblk, 1) < 0) {
+    return -ENOSPC;
+  }
+  char *block = blocks_get_block(inode_get_bnum(node, lblk));
+  memset(block + from % BLOCK_SIZE, 0, to - from);
+  inode_dirty_data(node, block + from % BLOCK_SIZE, to - from);
+  return 0;
+}
+
+// Make bytes [offset, end) of an inode locked for writing a hole: whole
+// blocks are unmapped, the partial ones at either end zeroed.
+static int punch_inode(inode_t *node, off_t offset, off_t end) {
+  off_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE; // first whole block
+  off_t last = end / BLOCK_SIZE; // just past the last whole block
+  if (first > last) {
+    return zero_partial(node, offset, end); // within one block
+  }
+  int rv = zero_partial(node, offset, first * BLOCK_SIZE);
+  if (rv == 0) {
+    rv = zero_partial(node, last * BLOCK_SIZE, end);
+  }
+  if (rv == 0 && first < last && inode_punch(node, first, last - first) < 0) {
+    rv = -ENOSPC;
+  }
+  return rv;
+}
+
+/**
+ * Allocates or deallocates space in an open file
+ *
+ * @param fh Handle from storage_open()
+ * @param mode 0, FALLOC_FL_KEEP_SIZE, or FALLOC_FL_PUNCH_HOLE with
+ *        FALLOC_FL_KEEP_SIZE
+ * @param offset Start of the range
+ * @param len Length of the range
+ *
+ * @return int 0 on success, -EINVAL for a bad range, -EOPNOTSUPP for
+ *         another mode, -EFBIG past the largest file size, -ENOSPC if the
+ *         disk is full.
+ */
+int storage_fallocate(storage_file_t *fh, int mode, off_t offset, off_t len) {
+  int punch = mode & FALLOC_FL_PUNCH_HOLE;
+  if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) ||
+      (punch && !(mode & FALLOC_FL_KEEP_SIZE))) {
+    return -EOPNOTSUPP;
+  }
+  if (offset < 0 || len <= 0) {
+    return -EINVAL;
+  }
+
+  inode_t *node = fh->node;
+  int rv = 0;
+  journal_begin();
+  inode_lock(fh->inum, 1);
+  assert(!(node->mode & 040000)); //file should NOT be a directory
+  if (punch) {
+    // nothing is mapped past the largest file size
+    if (offset < INODE_MAX_SIZE) {
+      off_t end = len < INODE_MAX_SIZE - offset ? offset + len : INODE_MAX_SIZE;
+      rv = punch_inode(node, offset, end);
+    }
+  } else if (len > INODE_MAX_SIZE - offset) {
+    rv = -EFBIG;
+  } else {
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t last = (offset + len - 1) / BLOCK_SIZE;
+    if (inode_map(node, first, last - first + 1) < 0) {
+      rv = -ENOSPC;
+    } else if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > node->size) {
+      node->size = offset + len;
+      inode_dirty(node);
     }
   }
-  node->size = size + offset;
-  return (int)written;
+  inode_unlock(fh->inum);
+  journal_end();
+  return rv;
+}
+
+/**
+ * Finds the next data or hole in an open file
+ *
+ * @param fh Handle from storage_open()
+ * @param offset Where to start looking
+ * @param whence SEEK_DATA or SEEK_HOLE
+ *
+ * @return off_t Offset of the data or hole, -ENXIO if offset isn't inside
+ *         the file (or there's no data after it), -EINVAL for another whence.
+ */
+off_t storage_seek(storage_file_t *fh, off_t offset, int whence) {
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return -EINVAL;
+  }
+  inode_t *node = fh->node;
+  inode_lock(fh->inum, 0);
+  off_t size = node->size;
+  off_t pos = offset;
+  // extent by extent; compressed clusters and preallocated blocks are data
+  while (pos >= 0 && pos < size) {
+    extent_t ext;
+    int mapped = inode_get_extent(node, pos / BLOCK_SIZE, &ext);
+    if (mapped == (whence == SEEK_DATA)) {
+      break;
+    }
+    pos = ((off_t) ext.lblk + ext.len) * BLOCK_SIZE;
+  }
+  inode_unlock(fh->inum);
+
+  if (offset < 0 || offset >= size || (whence == SEEK_DATA && pos >= size)) {
+    return -ENXIO;
+  }
+  // the end of the file counts as a hole
+  return pos < size ? pos : size;
+}
+
+/**
+ * Makes the changes to an open file durable
+ *
+ * @param fh Handle from storage_open()
+ *
+ * @return int 0 on success, -EIO if the image couldn't be written.
+ */
+int storage_fsync(storage_file_t *fh) {
+  journal_begin();
+  inode_lock(fh->inum, 1);
+  int rv = inode_sync(fh->node);
+  inode_unlock(fh->inum);
+  journal_end();
+  // metadata changed as well, and only a commit covers that
+  if (rv > 0) {
+    rv = journal_commit();
+  }
+  return rv;
+}
+
+/**
+ * Makes every change so far durable
+ *
+ * @return int 0 on success, -EIO if the image couldn't be written.
+ */
+int storage_sync() {
+  return journal_commit();
+}
+
+/**
+ * Gets the size and free space of the file system
+ *
+ * @param st Filled in like statvfs(3) would.
+ *
+ * @return int 0 on success.
+ */
+int storage_statfs(struct statvfs *st) {
+  superblock_t *sb = get_superblock();
+  memset(st, 0, sizeof(struct statvfs));
+  st->f_bsize = BLOCK_SIZE;
+  st->f_frsize = BLOCK_SIZE;
+  st->f_blocks = sb->block_count - sb->data_start;
+  st->f_bfree = __atomic_load_n(&sb->free_blocks, __ATOMIC_RELAXED);
+  st->f_bavail = st->f_bfree;
+  st->f_files = sb->inode_count - 1;
+  st->f_ffree = __atomic_load_n(&sb->free_inodes, __ATOMIC_RELAXED);
+  st->f_favail = st->f_ffree;
+  st->f_namemax = DIR_NAME_LENGTH;
+  st->f_flag = snapshot_view ? ST_RDONLY : 0;
+  return 0;
+}
+
+/**
+ * Closes an open file, freeing it if it was unlinked while open
+ *
+ * @param fh Handle from storage_open()
+ */
+void storage_release(storage_file_t *fh) {
+  journal_begin();
+  // give back the blocks mapped ahead of appends
+  inode_lock(fh->inum, 1);
+  inode_trim(fh->node);
+  inode_unlock(fh->inum);
+  inode_unpin(fh->inum);
+  journal_end();
+  free(fh);
 }
 
 /**
@@ -155,30 +808,17 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
  * @return int 0 on success, -1 on failure.
  */
 int storage_mknod(const char *path, mode_t mode) {
-  int rv = -1;
-  slist_t *list = s_explode(path, '/');
-  char *last = s_get_last(list);
+  const char *last = path_basename(path);
 
   if (strlen(last) > DIR_NAME_LENGTH) {
     return -1;
   }
 
-  int inum = alloc_inode();
-  int block = alloc_block();
-
-  inode_t *node = get_inode(inum);
-  node->block = block;
-  node->mode = mode;
-  node->size = 0;
-  node->iblock = 0;
-  int parentinum = directory_find_parent(path);
-
-  inode_t *parent = get_inode(parentinum);
-
-  rv = directory_put(parent, last, inum);
-
-  s_free(list);
-
+  journal_begin();
+  directory_lock(1);
+  int rv = mknod_locked(path, last, mode);
+  directory_unlock();
+  journal_end();
   return rv;
 }
 
@@ -191,34 +831,149 @@ int storage_mknod(const char *path, mode_t mode) {
  */
 int storage_unlink(const char *path) {
   int rv = -1;
+  journal_begin();
+  directory_lock(1);
   int inum = directory_find_parent(path);
+  if (inum >= 0) {
+    rv = directory_delete(get_inode(inum), path_basename(path));
+  }
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+// Remove a name from a directory, with the tree locked for writing, like
+// unlink(2), or rmdir(2) if dir is set. Returns 0 or a negative errno.
+static int remove_at_locked(int parent, const char *name, int dir) {
+  inode_t *parentnode = get_inode(parent);
+  if (!(parentnode->mode & 040000)) {
+    return -ENOTDIR;
+  }
+  int inum = directory_lookup(parentnode, name);
+  if (inum < 0) {
+    return -ENOENT;
+  }
   inode_t *node = get_inode(inum);
-  slist_t *list = s_explode(path, '/');
-  rv = directory_delete(node, s_get_last(list));
-  s_free(list);
+  if (!(node->mode & 040000)) {
+    if (dir) {
+      return -ENOTDIR;
+    }
+  } else if (!dir) {
+    return -EISDIR;
+  } else if (!directory_is_empty(node, inum)) {
+    return -ENOTEMPTY;
+  }
+  return directory_delete(parentnode, name) < 0 ? -ENOENT : 0;
+}
+
+/**
+ * Deletes an empty directory
+ *
+ * @param path Path of the directory
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if not a directory,
+ *         -ENOTEMPTY if it has entries.
+ */
+int storage_rmdir(const char *path) {
+  int rv = -ENOENT;
+  journal_begin();
+  directory_lock(1);
+  int inum = directory_find_parent(path);
+  if (inum >= 0) {
+    rv = remove_at_locked(inum, path_basename(path), 1);
+  }
+  directory_unlock();
+  journal_end();
   return rv;
 }
 
+// Rename a directory entry, with the tree locked for writing. Returns 0
+// or a negative errno.
+static int rename_at_locked(int fromdir, const char *fromname, int todir,
+                            const char *toname) {
+  inode_t *fromdirnode = get_inode(fromdir);
+  inode_t *todirnode = get_inode(todir);
+  if (!(fromdirnode->mode & 040000) || !(todirnode->mode & 040000)) {
+    return -ENOTDIR;
+  }
+  if (strlen(toname) > DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  int inum = directory_lookup(fromdirnode, fromname);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  // like rename(2), replace an existing target (unless it's the same file),
+  // but only with one of the same type, and never a directory with entries
+  int target = directory_lookup(todirnode, toname);
+  if (target == inum) {
+    return 0;
+  }
+  if (target >= 0) {
+    inode_t *targetnode = get_inode(target);
+    int isdir = get_inode(inum)->mode & 040000;
+    if (targetnode->mode & 040000) {
+      if (!isdir) {
+        return -EISDIR;
+      }
+      if (!directory_is_empty(targetnode, target)) {
+        return -ENOTEMPTY;
+      }
+    } else if (isdir) {
+      return -ENOTDIR;
+    }
+    if (directory_delete(todirnode, toname) < 0) {
+      return -ENOSPC;
+    }
+  }
+
+  // add the new name before dropping the old one, so a failure leaves the
+  // file reachable (a replaced target's slot is free for it)
+  if (directory_put(todirnode, toname, inum) < 0) {
+    return -ENOSPC;
+  }
+  if (directory_unlink(fromdirnode, fromname) < 0) {
+    directory_unlink(todirnode, toname);
+    return -ENOSPC;
+  }
+  return 0;
+}
+
+// Rename with the directory tree locked for writing.
+static int rename_locked(const char *from, const char *to) {
+  int fromdir = directory_find_parent(from);
+  int todir = directory_find_parent(to);
+  if (fromdir < 0 || todir < 0) {
+    return -ENOENT;
+  }
+  return rename_at_locked(fromdir, path_basename(from), todir,
+                          path_basename(to));
+}
+
 /**
  * Renames item (allows moving to different path)
  *
  * @param from Path of item to be renamed
  * @param to Path of item after rename
  *
- * @return int 0 on success, -1 on failure.
+ * @return int 0 on success, or a negative errno.
  */
 int storage_rename(const char *from, const char *to) {
-  int inum = directory_find(from);
-  inode_t *fromdirnode = get_inode(directory_find_parent(from));
-  inode_t *todirnode = get_inode(directory_find_parent(to));
-  slist_t *fromlist = s_explode(from, '/');
-  slist_t *tolist = s_explode(to, '/');
-
-  int sv = directory_unlink(fromdirnode, inum) | directory_put(todirnode, s_get_last(tolist), inum);
+  journal_begin();
+  directory_lock(1);
+  int rv = rename_locked(from, to);
+  directory_unlock();
+  journal_end();
+  return rv;
+}
 
-  s_free(fromlist);
-  s_free(tolist);
-  return sv;
+// Change the mode of an inode that isn't locked yet.
+static void set_mode(int inum, mode_t mode) {
+  inode_lock(inum, 1);
+  get_inode(inum)->mode = mode;
+  inode_dirty(get_inode(inum));
+  inode_unlock(inum);
 }
 
 /**
@@ -230,12 +985,30 @@ int storage_rename(const char *from, const char *to) {
  * @return int 0 on success, -1 on failure.
  */
 int storage_chmod(const char *path, mode_t mode) {
+  journal_begin();
+  directory_lock(0);
   int inum = directory_find(path);
-  if (inum == -1) {
-    return -1;
+  if (inum >= 0) {
+    set_mode(inum, mode);
+  }
+  directory_unlock();
+  journal_end();
+  return inum >= 0 ? 0 : -1;
+}
+
+// Resize an inode locked for writing.
+static int resize_inode(inode_t *node, off_t size) {
+  assert(!(node->mode & 040000)); //file should NOT be directory
+  if (size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+  if (size > node->size) {
+    // the new part is a hole until written
+    node->size = size;
+    inode_dirty(node);
+  } else if (truncate_inode(node, size) < 0) {
+    return -ENOSPC;
   }
-  inode_t *node = get_inode(inum);
-  node->mode = mode;
   return 0;
 }
 
@@ -243,27 +1016,77 @@ int storage_chmod(const char *path, mode_t mode) {
  * Truncates file
  *
  * @param path Path of item to be modified
- * @param mode Mode to set
+ * @param size New size of the file
  *
  * @return int 0 on success, -1 on failure.
  */
-int storage_truncate(const char *path) {
-  int inum = directory_find(path);
-
-  slist_t *list = s_explode(path, '/');
-  char *last = s_get_last(list);
-  if (strlen(last) > DIR_NAME_LENGTH) {
+int storage_truncate(const char *path, off_t size) {
+  if (strlen(path_basename(path)) > DIR_NAME_LENGTH) {
     return 0;
   }
-  if (inum == -1) {
-    return -1;
+
+  int rv = -1;
+  journal_begin();
+  directory_lock(0);
+  int inum = directory_find(path);
+  if (inum >= 0) {
+    inode_lock(inum, 1);
+    rv = resize_inode(get_inode(inum), size);
+    inode_unlock(inum);
   }
-  inode_t *node = get_inode(inum);
-  assert(!(node->mode & 040000)); //file should NOT be directory
-  truncate_inode(node);
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+typedef struct readdir_ctx {
+  storage_fill_t fill;
+  void *ctx;
+} readdir_ctx_t;
+
+// Add the attributes to an entry found by directory_read().
+static int fill_entry(void *ctx, const char *name, int inum, off_t next) {
+  readdir_ctx_t *rc = ctx;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  fill_stat(inum, &st);
+  return rc->fill(rc->ctx, name, &st, next);
+}
+
+// Read a directory with the tree locked for reading.
+static int readdir_locked(int inum, off_t offset, storage_fill_t fill,
+                          void *ctx) {
+  inode_t *di = get_inode(inum);
+  if (!(di->mode & 040000)) {
+    return -ENOTDIR;
+  }
+  readdir_ctx_t rc = {fill, ctx};
+  directory_read(di, offset, fill_entry, &rc);
   return 0;
 }
 
+/**
+ * Reads directory entries together with their attributes
+ *
+ * @param path Path of directory
+ * @param offset 0 to start at the first entry, or an offset passed to fill
+ * @param fill Called for each entry in turn, until it returns nonzero
+ * @param ctx Passed to fill
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if not a directory.
+ */
+int storage_readdir(const char *path, off_t offset, storage_fill_t fill,
+                    void *ctx) {
+  int rv = -ENOENT;
+  directory_lock(0);
+  int inum = directory_find(path);
+  if (inum >= 0) {
+    rv = readdir_locked(inum, offset, fill, ctx);
+  }
+  directory_unlock();
+  return rv;
+}
+
 /**
  * Lists directory contents
  *
@@ -272,7 +1095,341 @@ int storage_truncate(const char *path) {
  * @return slist_t* Pointer to list of items
  */
 slist_t* storage_list(const char *path){
+  slist_t *list = 0;
+  directory_lock(0);
   int inum = directory_find(path);
-  inode_t *di = get_inode(inum);
-  return directory_list(di);
-}
\ No newline at end of file
+  if (inum >= 0) {
+    list = directory_list(get_inode(inum));
+  }
+  directory_unlock();
+  return list;
+}
+
+/**
+ * Looks up a name in a directory and takes a reference to what it finds
+ *
+ * @param parent Inum of the directory
+ * @param name Name to look up
+ * @param st Filled with the attributes of the entry
+ *
+ * @return int Inum of the entry, -ENOENT if DNE, -ENOTDIR if parent isn't
+ *         a directory.
+ */
+int storage_lookup(int parent, const char *name, struct stat *st) {
+  int rv = -ENOTDIR;
+  directory_lock(0);
+  if (get_inode(parent)->mode & 040000) {
+    rv = directory_lookup(get_inode(parent), name);
+    if (rv >= 0) {
+      inode_pin(rv);
+      fill_stat(rv, st);
+    } else {
+      rv = -ENOENT;
+    }
+  }
+  directory_unlock();
+  return rv;
+}
+
+/**
+ * Drops references taken by storage_lookup() and storage_mknod_at()
+ *
+ * @param inum Inode referred to
+ * @param count Number of references to drop
+ */
+void storage_forget(int inum, uint64_t count) {
+  journal_begin();
+  while (count--) {
+    inode_unpin(inum);
+  }
+  journal_end();
+}
+
+/**
+ * Gets the attributes of an inode
+ *
+ * @param inum Inode to look at
+ * @param st Structure for data return
+ *
+ * @return int 0 on success, -ENOENT if no inode by that number is in use.
+ */
+int storage_stat_inum(int inum, struct stat *st) {
+  if (!inode_is_used(inum)) {
+    return -ENOENT;
+  }
+  fill_stat(inum, st);
+  return 0;
+}
+
+/**
+ * Creates a node in a directory and takes a reference to it
+ *
+ * @param parent Inum of the directory
+ * @param name Name of the new node
+ * @param mode Mode of the new node
+ * @param st Filled with the attributes of the new node
+ *
+ * @return int Inum of the new node, or -ENOTDIR, -ENAMETOOLONG, -EEXIST or
+ *         -ENOSPC.
+ */
+int storage_mknod_at(int parent, const char *name, mode_t mode,
+                     struct stat *st) {
+  journal_begin();
+  directory_lock(1);
+  int rv = create_locked(parent, name, mode);
+  if (rv >= 0) {
+    inode_pin(rv);
+    fill_stat(rv, st);
+  }
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+/**
+ * Removes a file's name from a directory
+ *
+ * @param parent Inum of the directory
+ * @param name Name to remove
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if parent isn't a
+ *         directory, -EISDIR if the name is a directory's.
+ */
+int storage_unlink_at(int parent, const char *name) {
+  journal_begin();
+  directory_lock(1);
+  int rv = remove_at_locked(parent, name, 0);
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+/**
+ * Removes an empty directory from its parent
+ *
+ * @param parent Inum of the parent directory
+ * @param name Name of the directory
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if parent or the
+ *         name isn't a directory, -ENOTEMPTY if it has entries.
+ */
+int storage_rmdir_at(int parent, const char *name) {
+  journal_begin();
+  directory_lock(1);
+  int rv = remove_at_locked(parent, name, 1);
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+/**
+ * Renames a directory entry (allows moving to another directory)
+ *
+ * @param parent Inum of the directory holding the entry
+ * @param name Name of the entry
+ * @param newparent Inum of the directory to move it to
+ * @param newname Name of the entry after the rename
+ *
+ * @return int 0 on success, or a negative errno.
+ */
+int storage_rename_at(int parent, const char *name, int newparent,
+                      const char *newname) {
+  journal_begin();
+  directory_lock(1);
+  int rv = rename_at_locked(parent, name, newparent, newname);
+  directory_unlock();
+  journal_end();
+  return rv;
+}
+
+/**
+ * Changes the permissions of an inode
+ *
+ * @param inum Inode to modify
+ * @param mode Mode to set
+ *
+ * @return int 0 on success.
+ */
+int storage_chmod_inum(int inum, mode_t mode) {
+  journal_begin();
+  set_mode(inum, mode);
+  journal_end();
+  return 0;
+}
+
+/**
+ * Truncates a file given by inode
+ *
+ * @param inum Inode to modify
+ * @param size New size of the file
+ *
+ * @return int 0 on success, -EISDIR for a directory, -EFBIG past the
+ *         largest file size, -ENOSPC if the disk is full.
+ */
+int storage_truncate_inum(int inum, off_t size) {
+  int rv = -EISDIR;
+  journal_begin();
+  inode_lock(inum, 1);
+  if (!(get_inode(inum)->mode & 040000)) {
+    rv = resize_inode(get_inode(inum), size);
+  }
+  inode_unlock(inum);
+  journal_end();
+  return rv;
+}
+
+/**
+ * Opens a file given by inode
+ *
+ * @param inum Inode to open, which the caller holds a reference to
+ * @param fh Set to the new handle, to be closed with storage_release()
+ *
+ * @return int 0 on success, -ENOMEM if out of memory.
+ */
+int storage_open_inum(int inum, storage_file_t **fh) {
+  storage_file_t *file = malloc(sizeof(storage_file_t));
+  if (!file) {
+    return -ENOMEM;
+  }
+  inode_pin(inum);
+  file->inum = inum;
+  file->node = get_inode(inum);
+  *fh = file;
+  return 0;
+}
+
+/**
+ * Reads directory entries of a directory given by inode
+ *
+ * @param inum Inode of the directory
+ * @param offset 0 to start at the first entry, or an offset passed to fill
+ * @param fill Called for each entry in turn, until it returns nonzero
+ * @param ctx Passed to fill
+ *
+ * @return int 0 on success, -ENOTDIR if not a directory.
+ */
+int storage_readdir_inum(int inum, off_t offset, storage_fill_t fill,
+                         void *ctx) {
+  directory_lock(0);
+  int rv = readdir_locked(inum, offset, fill, ctx);
+  directory_unlock();
+  return rv;
+}
+
+/**
+ * Takes a snapshot of the whole file system
+ *
+ * @param name Name of the new snapshot
+ *
+ * @return int 0 on success, -EROFS if a snapshot is mounted, -EIO if it
+ *         couldn't be committed, or an error from snapshot_create().
+ */
+int storage_snapshot(const char *name) {
+  if (snapshot_view) {
+    return -EROFS;
+  }
+  // nothing may change while the inodes are copied
+  journal_begin_exclusive();
+  int rv = snapshot_create(name);
+  journal_end();
+  if (rv == 0) {
+    rv = journal_commit();
+  }
+  return rv;
+}
+
+/**
+ * Deletes a snapshot
+ *
+ * @param name Name of the snapshot
+ *
+ * @return int 0 on success, -ENOENT if DNE, -EROFS if a snapshot is mounted.
+ */
+int storage_snapshot_delete(const char *name) {
+  if (snapshot_view) {
+    return -EROFS;
+  }
+  journal_begin_exclusive();
+  int rv = snapshot_delete(name);
+  journal_end();
+  return rv;
+}
+
+// Order snapshots by creation time, for qsort().
+static int snapshot_cmp(const void *a, const void *b) {
+  int64_t x = ((const snapshot_t *) a)->created;
+  int64_t y = ((const snapshot_t *) b)->created;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Lists the snapshots
+ *
+ * @param list Filled with the snapshots, oldest first
+ * @param max Room in list; SNAPSHOT_MAX is always enough
+ *
+ * @return int Number of snapshots filled in.
+ */
+int storage_snapshot_list(snapshot_t *list, int max) {
+  int count = 0;
+  journal_begin();
+  snapshot_t *table = get_snapshots();
+  for (int ii = 0; ii < SNAPSHOT_MAX && count < max; ++ii) {
+    if (table[ii].name[0]) {
+      list[count++] = table[ii];
+    }
+  }
+  journal_end();
+  qsort(list, count, sizeof(snapshot_t), snapshot_cmp);
+  return count;
+}
+
+/**
+ * Deduplicates the blocks of every file
+ *
+ * @param stats Filled in with what the pass found
+ *
+ * @return int 0 on success, -EROFS if a snapshot is mounted, -EIO if it
+ *         couldn't be committed, or an error from dedup_begin().
+ */
+int storage_dedup(dedup_stats_t *stats) {
+  if (snapshot_view) {
+    return -EROFS;
+  }
+  int rv = dedup_begin(stats);
+  if (rv < 0) {
+    return rv;
+  }
+  for (int more = 1; more && rv == 0;) {
+    uint64_t merged = stats->merged;
+    journal_begin();
+    more = dedup_batch();
+    journal_end();
+    // one batch per transaction, however big the file system
+    if (stats->merged != merged) {
+      rv = journal_commit();
+    }
+  }
+  dedup_end();
+  return rv;
+}
+
+/**
+ * Serves a snapshot, read-only, instead of the live file system
+ *
+ * Must be called right after storage_init(), before anything is looked up.
+ *
+ * @param name Name of the snapshot
+ *
+ * @return int 0 on success, -ENOENT if DNE.
+ */
+int storage_mount_snapshot(const char *name) {
+  snapshot_t *snap = snapshot_find(name);
+  if (!snap) {
+    return -ENOENT;
+  }
+  blocks_view_inodes(snap->start);
+  dcache_init();
+  snapshot_view = 1;
+  return 0;
+}
@@ -1,6 +1,11 @@
 // Disk storage abstracttion.
 //
 // Feel free to use as inspiration. Provided as-is.
+//
+// Every storage_* function other than storage_init may be called from
+// several FUSE threads at once: each takes the directory tree lock (shared
+// for lookups and file I/O, exclusive for namespace changes) and then the
+// lock of the inode it touches, so reads of different files run in parallel.
 
 // based on cs3650 starter code
 
@@ -8,25 +13,122 @@
 #define NUFS_STORAGE_H
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "blocks.h"
+#include "dedup.h"
 #include "slist.h"
+#include "snapshot.h"
+
+struct inode;
+
+// An open file. Holds the file's inode pinned, so reads and writes through
+// the handle skip path resolution and keep working after an unlink.
+typedef struct storage_file {
+  int inum;           // inode of the open file
+  struct inode *node; // its entry in the inode table
+} storage_file_t;
+
+// A run of file data as it sits in the image.
+typedef struct storage_run {
+  char *data; // the data in the mapping, or NULL for a hole
+  off_t pos;  // offset of the data in the image file, or -1 if the file
+              // doesn't hold it yet (holes and uncommitted changes)
+  size_t len;
+  int owned;  // data is a malloc'd copy (of compressed data) the caller
+              // must free
+} storage_run_t;
+
+// most runs storage_map_fh() can produce for a read of size bytes
+#define STORAGE_MAP_RUNS(size) ((size) / BLOCK_SIZE + 2)
 
 /**
  * Initializes filesystem with image
  *
+ * A missing or empty image file is created and formatted with the given
+ * geometry; an existing image keeps its own.
+ *
  * @param path Path to image file
+ * @param size Size in bytes of a new image (0 for the default)
+ * @param inodes Inode count of a new image (0 to derive from size)
+ *
+ * @return int 0 on success, -1 if the image can't be used.
+ */
+int storage_init(const char *path, size_t size, int inodes);
+
+/**
+ * Starts background work for a mounted image
+ *
+ * Call from the process that serves requests, once FUSE has daemonized,
+ * before any file is opened. Sets up io_uring for commits (see
+ * storage_io_depth()); until then, and in offline tools, the image is
+ * written synchronously. Frees blocks mapped ahead of appends that a crash
+ * left behind (see inode_trim_crashed()).
+ *
+ * @param commit_interval Seconds between journal commits (0 for default)
+ */
+void storage_start(int commit_interval);
+
+/**
+ * Turns compression of file data on or off
+ *
+ * While on, every cluster of a file that a write completes is stored
+ * compressed when that saves space (see compress.h). Compressed data is
+ * read back the same either way.
+ *
+ * @param enable Nonzero to compress data written from now on
+ */
+void storage_compress(int enable);
+
+/**
+ * Bounds the memory holding file data
+ *
+ * Data blocks not used recently are dropped from memory at commits once
+ * there are more than this (see blocks_set_cache()); they read back from
+ * the image. Without a bound, the kernel decides what stays mapped in.
+ *
+ * @param bytes Most bytes of file data to keep in memory, 0 for no bound
+ *
+ * @return int 0 on success, -ENOMEM if out of memory.
+ */
+int storage_cache(size_t bytes);
+
+/**
+ * Tunes how the image is mapped in
+ *
+ * See blocks_set_mapping(); none of it changes what is read or written.
+ *
+ * @param flags BLOCKS_MAP_* flags
+ *
+ * @return int 0 on success, -EINVAL if the kernel turned some of it down.
  */
-void storage_init(const char *path);
+int storage_mapping(int flags);
+
+/**
+ * Sets how many writes a commit keeps in flight
+ *
+ * The default is IO_QUEUE_DEPTH through io_uring (see io.h). Takes effect
+ * when storage_start() sets the ring up, which warns if a depth was asked
+ * for and there is no io_uring.
+ *
+ * @param depth Queue depth, or 0 to write synchronously
+ */
+void storage_io_depth(int depth);
+
+/**
+ * Commits outstanding changes and closes the image
+ */
+void storage_destroy();
 
 /**
  * Checks existence of item
  *
  * @param path Item to be found
  *
- * @return int 0 if exists, -1 if doesn't
+ * @return int 0 if exists, -ENOENT if doesn't
  */
 int storage_find(const char *path);
 
@@ -63,6 +165,190 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset);
  * @return int Bytes written
  */
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+
+/**
+ * Opens a file
+ *
+ * @param path Path of the file to open
+ * @param fh Set to the new handle, to be closed with storage_release()
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOMEM if out of memory.
+ */
+int storage_open(const char *path, storage_file_t **fh);
+
+/**
+ * Reads data from an open file
+ *
+ * @param fh Handle from storage_open()
+ * @param buf Data buffer
+ * @param size Size of data to be read
+ * @param offset Offset to be read from
+ *
+ * @return int Bytes read
+ */
+int storage_read_fh(storage_file_t *fh, char *buf, size_t size, off_t offset);
+
+/**
+ * Locates data of an open file in the image without copying it
+ *
+ * Fills runs with where the file's data sits, one run per extent or hole
+ * (split where committed and uncommitted blocks meet). Runs with a file
+ * offset can be spliced straight out of the image file (see
+ * blocks_get_fd()); the others must be copied from the mapping. Compressed
+ * data has no place in the mapping, so those runs get a decompressed copy
+ * instead, which the caller owns.
+ *
+ * On success the file stays read-locked until storage_map_end(), so no
+ * write or truncate changes the bytes behind the runs, and no block in
+ * them is freed, while the caller sends them. A caller that lets go
+ * earlier may see newer data in them; blocks freed meanwhile are still
+ * not reused until a commit after the one that frees them.
+ *
+ * @param fh Handle from storage_open()
+ * @param size Size of data to be read
+ * @param offset Offset to be read from
+ * @param runs Filled with the runs, in file order
+ * @param max Room in runs; STORAGE_MAP_RUNS(size) is always enough
+ *
+ * @return int Number of runs filled in (fewer than needed if a copy
+ *         couldn't be made), or -ENOMEM or -EIO if not even the first
+ *         one could.
+ */
+int storage_map_fh(storage_file_t *fh, size_t size, off_t offset,
+                   storage_run_t *runs, int max);
+
+/**
+ * Lets go of the file a successful storage_map_fh() left locked
+ *
+ * @param fh Handle passed to storage_map_fh()
+ */
+void storage_map_end(storage_file_t *fh);
+
+/**
+ * Writes data to an open file
+ *
+ * @param fh Handle from storage_open()
+ * @param buf Data buffer
+ * @param size Size of data to write
+ * @param offset Offset to write to
+ *
+ * @return int Bytes written, -EFBIG if past the largest file size, or
+ *         -ENOSPC if the disk is full.
+ */
+int storage_write_fh(storage_file_t *fh, const char *buf, size_t size,
+                     off_t offset);
+
+/**
+ * Starts writing to an open file in place
+ *
+ * Maps every block of the range and fills runs with where the range sits
+ * in the mapping, so the caller can copy the data straight into place. The
+ * file stays locked until storage_write_end(), which must be called unless
+ * this fails.
+ *
+ * @param fh Handle from storage_open()
+ * @param size Size of data to be written
+ * @param offset Offset to write to
+ * @param runs Filled with the runs, in file order
+ * @param max Room in runs; STORAGE_MAP_RUNS(size) is always enough
+ *
+ * @return int Number of runs filled in, -EFBIG if past the largest file
+ *         size, or -ENOSPC if the disk is full.
+ */
+int storage_write_begin(storage_file_t *fh, size_t size, off_t offset,
+                        storage_run_t *runs, int max);
+
+/**
+ * Finishes a write started with storage_write_begin()
+ *
+ * Grows the file to cover what was written and unlocks it. Blocks that were
+ * mapped for a write that came up short stay mapped past the end, as if
+ * preallocated with storage_fallocate().
+ *
+ * @param fh Handle from storage_open()
+ * @param offset Offset the write started at
+ * @param end Offset just past the last byte actually written
+ */
+void storage_write_end(storage_file_t *fh, off_t offset, off_t end);
+
+/**
+ * Allocates or deallocates space in an open file
+ *
+ * Like fallocate(2). Mode 0 maps zeroed blocks to the holes in the range
+ * and grows the file to cover it; FALLOC_FL_KEEP_SIZE leaves the size
+ * alone, so blocks can be mapped past the end. FALLOC_FL_PUNCH_HOLE (which
+ * needs FALLOC_FL_KEEP_SIZE) unmaps the whole blocks of the range and
+ * zeroes the rest of it, so it reads back as zeros.
+ *
+ * @param fh Handle from storage_open()
+ * @param mode 0, FALLOC_FL_KEEP_SIZE, or FALLOC_FL_PUNCH_HOLE with
+ *        FALLOC_FL_KEEP_SIZE
+ * @param offset Start of the range
+ * @param len Length of the range
+ *
+ * @return int 0 on success, -EINVAL for a bad range, -EOPNOTSUPP for
+ *         another mode, -EFBIG past the largest file size, -ENOSPC if the
+ *         disk is full.
+ */
+int storage_fallocate(storage_file_t *fh, int mode, off_t offset, off_t len);
+
+/**
+ * Finds the next data or hole in an open file
+ *
+ * Like lseek(2) with SEEK_DATA or SEEK_HOLE. Holes are found a block at a
+ * time; the end of the file counts as a hole.
+ *
+ * @param fh Handle from storage_open()
+ * @param offset Where to start looking
+ * @param whence SEEK_DATA or SEEK_HOLE
+ *
+ * @return off_t Offset of the data or hole, -ENXIO if offset isn't inside
+ *         the file (or there's no data after it), -EINVAL for another whence.
+ */
+off_t storage_seek(storage_file_t *fh, off_t offset, int whence);
+
+/**
+ * Makes the changes to an open file durable
+ *
+ * If only data in already-allocated blocks changed, just those blocks are
+ * written, so the cost follows the file's dirty data rather than the size of
+ * the image; otherwise everything outstanding is committed.
+ *
+ * @param fh Handle from storage_open()
+ *
+ * @return int 0 on success, -EIO if the image couldn't be written.
+ */
+int storage_fsync(storage_file_t *fh);
+
+/**
+ * Makes every change so far durable
+ *
+ * @return int 0 on success, -EIO if the image couldn't be written.
+ */
+int storage_sync();
+
+/**
+ * Gets the size and free space of the file system
+ *
+ * Reads counts kept up to date by the allocators, so it takes constant
+ * time however large the image is.
+ *
+ * @param st Filled in like statvfs(3) would.
+ *
+ * @return int 0 on success.
+ */
+int storage_statfs(struct statvfs *st);
+
+/**
+ * Closes an open file, freeing it if it was unlinked while open
+ *
+ * Blocks mapped ahead of appends through the handle that the file didn't
+ * grow into are freed again (see inode_map_append()).
+ *
+ * @param fh Handle from storage_open()
+ */
+void storage_release(storage_file_t *fh);
+
 /**
  * Creates node
  *
@@ -82,13 +368,23 @@ int storage_mknod(const char *path, mode_t mode);
  */
 int storage_unlink(const char *path);
 
+/**
+ * Deletes an empty directory
+ *
+ * @param path Path of the directory
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if not a directory,
+ *         -ENOTEMPTY if it has entries.
+ */
+int storage_rmdir(const char *path);
+
 /**
  * Renames item (allows moving to different path)
  *
  * @param from Path of item to be renamed
  * @param to Path of item after rename
  *
- * @return int 0 on success, -1 on failure.
+ * @return int 0 on success, or a negative errno.
  */
 int storage_rename(const char *from, const char *to);
 
@@ -105,12 +401,44 @@ int storage_chmod(const char *path, mode_t mode);
 /**
  * Truncates file
  *
+ * Shrinking frees the blocks past the new end; growing leaves a hole,
+ * which reads back as zeros and takes no blocks until written.
+ *
  * @param path Path of item to be modified
- * @param mode Mode to set
+ * @param size New size of the file
  *
  * @return int 0 on success, -1 on failure.
  */
-int storage_truncate(const char *path);
+int storage_truncate(const char *path, off_t size);
+
+/**
+ * Called by storage_readdir() for each entry; same shape as FUSE's filler
+ *
+ * @param ctx Context passed to storage_readdir()
+ * @param name Name of the entry
+ * @param st Attributes of the entry
+ * @param next Offset to resume reading just past the entry
+ *
+ * @return int 0 to keep reading, nonzero to stop.
+ */
+typedef int (*storage_fill_t)(void *ctx, const char *name,
+                              const struct stat *st, off_t next);
+
+/**
+ * Reads directory entries together with their attributes
+ *
+ * The attributes come straight from the inodes the entries refer to, so no
+ * entry's path is looked up.
+ *
+ * @param path Path of directory
+ * @param offset 0 to start at the first entry, or an offset passed to fill
+ * @param fill Called for each entry in turn, until it returns nonzero
+ * @param ctx Passed to fill
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if not a directory.
+ */
+int storage_readdir(const char *path, off_t offset, storage_fill_t fill,
+                    void *ctx);
 
 /**
  * Lists directory contents
@@ -121,4 +449,199 @@ int storage_truncate(const char *path);
  */
 slist_t* storage_list(const char *path);
 
+// Entry points that name files by inum rather than by path, for the
+// low-level FUSE frontend. An inum passed to them must be referenced, by
+// storage_lookup() or storage_mknod_at(), so it can't be freed and reused
+// meanwhile; the root (inum 1) always is.
+
+/**
+ * Looks up a name in a directory and takes a reference to what it finds
+ *
+ * The entry's inode stays allocated, even if it is unlinked, until the
+ * reference is dropped with storage_forget().
+ *
+ * @param parent Inum of the directory
+ * @param name Name to look up
+ * @param st Filled with the attributes of the entry
+ *
+ * @return int Inum of the entry, -ENOENT if DNE, -ENOTDIR if parent isn't
+ *         a directory.
+ */
+int storage_lookup(int parent, const char *name, struct stat *st);
+
+/**
+ * Drops references taken by storage_lookup() and storage_mknod_at()
+ *
+ * Frees the inode once nothing refers to it and it has been unlinked.
+ *
+ * @param inum Inode referred to
+ * @param count Number of references to drop
+ */
+void storage_forget(int inum, uint64_t count);
+
+/**
+ * Gets the attributes of an inode
+ *
+ * @param inum Inode to look at
+ * @param st Structure for data return
+ *
+ * @return int 0 on success, -ENOENT if no inode by that number is in use.
+ */
+int storage_stat_inum(int inum, struct stat *st);
+
+/**
+ * Creates a node in a directory and takes a reference to it
+ *
+ * @param parent Inum of the directory
+ * @param name Name of the new node
+ * @param mode Mode of the new node
+ * @param st Filled with the attributes of the new node
+ *
+ * @return int Inum of the new node, or -ENOTDIR, -ENAMETOOLONG, -EEXIST or
+ *         -ENOSPC.
+ */
+int storage_mknod_at(int parent, const char *name, mode_t mode,
+                     struct stat *st);
+
+/**
+ * Removes a file's name from a directory
+ *
+ * @param parent Inum of the directory
+ * @param name Name to remove
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if parent isn't a
+ *         directory, -EISDIR if the name is a directory's.
+ */
+int storage_unlink_at(int parent, const char *name);
+
+/**
+ * Removes an empty directory from its parent
+ *
+ * @param parent Inum of the parent directory
+ * @param name Name of the directory
+ *
+ * @return int 0 on success, -ENOENT if DNE, -ENOTDIR if parent or the
+ *         name isn't a directory, -ENOTEMPTY if it has entries.
+ */
+int storage_rmdir_at(int parent, const char *name);
+
+/**
+ * Renames a directory entry (allows moving to another directory)
+ *
+ * @param parent Inum of the directory holding the entry
+ * @param name Name of the entry
+ * @param newparent Inum of the directory to move it to
+ * @param newname Name of the entry after the rename
+ *
+ * @return int 0 on success, or a negative errno.
+ */
+int storage_rename_at(int parent, const char *name, int newparent,
+                      const char *newname);
+
+/**
+ * Changes the permissions of an inode
+ *
+ * @param inum Inode to modify
+ * @param mode Mode to set
+ *
+ * @return int 0 on success.
+ */
+int storage_chmod_inum(int inum, mode_t mode);
+
+/**
+ * Truncates a file given by inode
+ *
+ * @param inum Inode to modify
+ * @param size New size of the file
+ *
+ * @return int 0 on success, -EISDIR for a directory, -EFBIG past the
+ *         largest file size, -ENOSPC if the disk is full.
+ */
+int storage_truncate_inum(int inum, off_t size);
+
+/**
+ * Opens a file given by inode
+ *
+ * @param inum Inode to open
+ * @param fh Set to the new handle, to be closed with storage_release()
+ *
+ * @return int 0 on success, -ENOMEM if out of memory.
+ */
+int storage_open_inum(int inum, storage_file_t **fh);
+
+/**
+ * Reads directory entries of a directory given by inode
+ *
+ * @param inum Inode of the directory
+ * @param offset 0 to start at the first entry, or an offset passed to fill
+ * @param fill Called for each entry in turn, until it returns nonzero
+ * @param ctx Passed to fill
+ *
+ * @return int 0 on success, -ENOTDIR if not a directory.
+ */
+int storage_readdir_inum(int inum, off_t offset, storage_fill_t fill,
+                         void *ctx);
+
+// Snapshots of the whole file system (see snapshot.h).
+
+/**
+ * Takes a snapshot of the whole file system
+ *
+ * Every other operation waits while the inodes are copied, and the snapshot
+ * is committed before this returns.
+ *
+ * @param name Name of the new snapshot
+ *
+ * @return int 0 on success, -EROFS if a snapshot is mounted, -EIO if it
+ *         couldn't be committed, or an error from snapshot_create().
+ */
+int storage_snapshot(const char *name);
+
+/**
+ * Deletes a snapshot
+ *
+ * @param name Name of the snapshot
+ *
+ * @return int 0 on success, -ENOENT if DNE, -EROFS if a snapshot is mounted.
+ */
+int storage_snapshot_delete(const char *name);
+
+/**
+ * Lists the snapshots
+ *
+ * @param list Filled with the snapshots, oldest first
+ * @param max Room in list; SNAPSHOT_MAX is always enough
+ *
+ * @return int Number of snapshots filled in.
+ */
+int storage_snapshot_list(snapshot_t *list, int max);
+
+// Deduplication of identical file blocks (see dedup.h).
+
+/**
+ * Deduplicates the blocks of every file
+ *
+ * The pass runs in batches alongside other operations (see dedup.h), and
+ * each batch that merged blocks is committed before the next one starts.
+ *
+ * @param stats Filled in with what the pass found
+ *
+ * @return int 0 on success, -EROFS if a snapshot is mounted, -EIO if it
+ *         couldn't be committed, or an error from dedup_begin().
+ */
+int storage_dedup(dedup_stats_t *stats);
+
+/**
+ * Serves a snapshot, read-only, instead of the live file system
+ *
+ * Must be called right after storage_init(), before anything is looked up.
+ * The snapshot can't be changed, so the frontend has to refuse writes
+ * (e.g. by mounting read-only).
+ *
+ * @param name Name of the snapshot
+ *
+ * @return int 0 on success, -ENOENT if DNE.
+ */
+int storage_mount_snapshot(const char *name);
+
 #endif
@@ -2,8 +2,9 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 70;
 use IO::Handle;
+use POSIX ();
 
 sub mount {
     system("(make mount 2>&1) >> test.log &");
@@ -180,4 +181,386 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# Snapshots";
+
+system("./snapshot.nufs create mnt snap1 >> test.log 2>&1");
+ok($? == 0, "Took a snapshot");
+write_text("large.txt", "changed");
+ok(read_text("large.txt") eq "changed", "Changed a file after the snapshot");
+
+unmount();
+sleep 1;
+system("(./nufs -f -o snapshot=snap1 mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+my $large = "1_2_3_4_5_6_7_8_" x (256 + 128);
+ok(read_text("large.txt") eq $large, "Snapshot keeps the old contents");
+write_text("new.txt", "nope");
+ok(!-e "mnt/new.txt", "Snapshot is mounted read-only");
+
+unmount();
+sleep 1;
+
+say "# Compression";
+
+system("(./nufs -f -o compress mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+my $log = join("", map { "2026-10-17 12:00:00 INFO request $_ served\n" } 1..20000);
+$log =~ s/\s*$//;
+write_text("log.txt", $log);
+ok(read_text("log.txt") eq $log, "Read back a compressed file");
+unmount();
+sleep 1;
+mount();
+ok(read_text("log.txt") eq $log, "Compressed file reads back without -o compress");
+unmount();
+sleep 1;
+
+say "# Bounded cache";
+
+system("(./nufs -f -o cache=64K mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+ok(read_text("log.txt") eq $log && read_text("larger.txt") eq $content,
+   "Files read back through a 64K cache");
+unmount();
+sleep 1;
+
+say "# Mapping options";
+
+system("(./nufs -f -o populate,hugepages,access=random mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+ok(read_text("log.txt") eq $log && read_text("larger.txt") eq $content,
+   "Files read back with the metadata prefaulted and huge pages");
+unmount();
+sleep 1;
+
+say "# Synchronous writes";
+
+system("(./nufs -f -o iodepth=0 mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+my $sync = "1_2_3_4_5_6_7_8_" x 4096;
+write_text("sync.txt", $sync);
+write_text("large.txt", "rewritten");
+ok(read_text("sync.txt") eq $sync, "Read back a file written without io_uring");
+unmount();
+sleep 1;
+mount();
+ok(read_text("sync.txt") eq $sync && read_text("large.txt") eq "rewritten",
+   "Synchronous commits survive a remount");
+unmount();
+sleep 1;
+
+say "# Deduplication";
+
+mount();
+write_text("larger-copy.txt", $content);
+my $stats = `./dedup.nufs mnt 2>> test.log`;
+say "# $stats";
+my ($merged) = $stats =~ /(\d+) merged/;
+ok(($merged || 0) > 0, "Deduplicated a copied file");
+write_text("larger-copy.txt", "changed");
+ok(read_text("larger.txt") eq $content, "Changing a copy leaves the original alone");
+unmount();
+sleep 1;
+mount();
+ok(read_text("larger.txt") eq $content, "Deduplicated file survives a remount");
+unmount();
+sleep 1;
+
+say "# Sparse files";
+
+mount();
+open my $sparse, ">", "mnt/sparse.txt";
+seek $sparse, 1 << 30, 0;
+print $sparse "end";
+close $sparse;
+ok((-s "mnt/sparse.txt") == (1 << 30) + 3 && read_text_slice("sparse.txt", 3, 1 << 30) eq "end",
+   "Wrote past the end of the disk into a hole");
+ok(read_text_slice("sparse.txt", 4, 12345) eq "\0" x 4, "Hole reads back as zeros");
+write_text("punch.txt", "x" x 12287);
+system("fallocate -p -o 4096 -l 4096 mnt/punch.txt >> test.log 2>&1");
+ok(read_text_slice("punch.txt", 4096, 4096) eq "\0" x 4096 &&
+   read_text_slice("punch.txt", 4096, 8192) eq "x" x 4095 . "\n",
+   "Punched a hole in a file");
+
+open my $log1, ">", "mnt/append1.txt";
+open my $log2, ">", "mnt/append2.txt";
+$log1->autoflush(1);
+$log2->autoflush(1);
+for my $ii (1..2000) {
+    $log1->print("one $ii\n");
+    $log2->print("two $ii\n");
+}
+close $log1;
+close $log2;
+ok(read_text("append1.txt") eq join("\n", map { "one $_" } 1..2000) &&
+   read_text("append2.txt") eq join("\n", map { "two $_" } 1..2000),
+   "Two files appended to in turn read back intact");
+my ($free1) = `stat -f -c %f mnt` =~ /(\d+)/;
+write_text("df.txt", "d" x 409600);
+my ($free2) = `stat -f -c %f mnt` =~ /(\d+)/;
+ok(defined $free1 && defined $free2 && $free1 - $free2 >= 100,
+   "statfs shows the blocks a new file takes");
+unmount();
+sleep 1;
+
+say "# Large directories";
+
+system("rm -f big.nufs");
+system("(./nufs -f -o size=256M,inodes=32768 mnt big.nufs 2>&1) >> test.log &");
+sleep 1;
+mkdir("mnt/big");
+for my $ii (1..20000) {
+    open my $fh, ">", "mnt/big/f$ii" or last;
+    close $fh;
+}
+opendir my $dh, "mnt/big";
+my @entries = grep { !/^\./ } readdir $dh;
+closedir $dh;
+say "# listed " . scalar(@entries);
+ok(@entries == 20000, "Listed all 20000 entries of a large directory");
+ok(-e "mnt/big/f1" && -e "mnt/big/f12345" && -e "mnt/big/f20000" &&
+   !-e "mnt/big/f20001", "Looked up names in a large directory");
+unmount();
+sleep 1;
+system("(./nufs -f mnt big.nufs 2>&1) >> test.log &");
+sleep 1;
+unlink map { "mnt/big/f$_" } grep { $_ % 2 } 1..20000;
+opendir $dh, "mnt/big";
+@entries = grep { !/^\./ } readdir $dh;
+closedir $dh;
+ok(@entries == 10000 && -e "mnt/big/f2" && !-e "mnt/big/f3",
+   "Large directory after a remount and deleting half of it");
+unmount();
+sleep 1;
+system("rm -f big.nufs");
+
+say "# Listing a directory while it grows";
+
+mount();
+mkdir("mnt/rd");
+for my $ii (1..1500) {
+    open my $fh, ">", "mnt/rd/old$ii" or last;
+    close $fh;
+}
+my %seen;
+opendir my $rd, "mnt/rd";
+for (1..100) {
+    my $name = readdir $rd;
+    $seen{$name}++ if defined $name;
+}
+# enough new names to split most leaves under the open listing
+for my $ii (1..1500) {
+    open my $fh, ">", "mnt/rd/new$ii" or last;
+    close $fh;
+}
+while (defined(my $name = readdir $rd)) {
+    $seen{$name}++;
+}
+closedir $rd;
+my @twice = grep { $seen{$_} > 1 } keys %seen;
+my @missed = grep { !$seen{"old$_"} } 1..1500;
+say "# " . scalar(@missed) . " missed, " . scalar(@twice) . " seen twice";
+ok(!@twice && !@missed, "Each entry listed once while creates split the directory");
+system("rm -rf mnt/rd");
+unmount();
+sleep 1;
+
+say "# Crash recovery";
+
+system("(./nufs -f -o commit=1 mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+mkdir("mnt/crash");
+write_text("crash/kept.txt", $msg4);
+my ($free0) = `stat -f -c %f mnt` =~ /(\d+)/;
+# a file still being appended to has blocks mapped ahead of its end
+open my $appender, ">", "mnt/crash/appended.txt";
+$appender->print("a" x (100 * 4096));
+$appender->flush;
+sleep 3;
+system("pkill -9 -x nufs");
+close $appender;
+sleep 1;
+unmount();
+# lose the free counts the last commit wrote home; the journal still has them
+open my $img, "+<", "data.nufs";
+seek $img, 64, 0;
+print $img "\0" x 8;
+close $img;
+my $replays = () = `cat test.log` =~ /replayed/g;
+system("(./nufs -f -o commit=1 mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+ok(read_text("crash/kept.txt") eq $msg4, "Committed changes survive a crash");
+my $replays2 = () = `cat test.log` =~ /replayed/g;
+my ($free) = `stat -f -c %f mnt` =~ /(\d+)/;
+ok($replays2 > $replays && ($free || 0) > 0,
+   "The journal is replayed after a crash");
+# freed blocks count as free two commits later
+sleep 3;
+($free) = `stat -f -c %f mnt` =~ /(\d+)/;
+say "# $free0 blocks free before appending 100, $free after the crash";
+ok(-s "mnt/crash/appended.txt" == 100 * 4096 && $free0 - $free < 110,
+   "Blocks mapped ahead of an append are freed after a crash");
+unmount();
+sleep 1;
+system("./fsck.nufs -n data.nufs >> test.log 2>&1");
+ok($? == 0, "fsck finds the image clean after a crash");
+
+say "# fsync";
+
+# commits only come from fsync before the crash
+system("(./nufs -f -o commit=600 mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+open my $synced, ">", "mnt/synced.txt";
+$synced->print("x" x 8191 . "\n");
+$synced->flush;
+$synced->sync;
+close $synced;
+system("printf yyyy | dd of=mnt/synced.txt bs=1 seek=4096 conv=notrunc,fdatasync " .
+       "status=none >> test.log 2>&1");
+system("pkill -9 -x nufs");
+sleep 1;
+unmount();
+mount();
+ok(-s "mnt/synced.txt" == 8192 && read_text_slice("synced.txt", 4, 0) eq "xxxx",
+   "A file made durable with fsync survives a crash");
+ok(read_text_slice("synced.txt", 6, 4094) eq "xxyyyy",
+   "A change in place made durable with fdatasync survives a crash");
+unmount();
+sleep 1;
+
+say "# Low-level API";
+
+system("(./nufs -f -o lowlevel mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+ok(mkdir("mnt/ll") && -d "mnt/ll", "Create a directory through the low-level API");
+write_text("ll/a.txt", $msg0);
+ok(read_text("ll/a.txt") eq $msg0 && read_text("large.txt") eq "rewritten",
+   "Read back files through the low-level API");
+rename("mnt/ll/a.txt", "mnt/ll/b.txt");
+$files = `ls mnt/ll`;
+ok($files =~ /b\.txt/ && $files !~ /a\.txt/ && read_text("ll/b.txt") eq $msg0 &&
+   unlink("mnt/ll/b.txt") && rmdir("mnt/ll"),
+   "Rename, list and remove through the low-level API");
+mkdir("mnt/ll2");
+write_text("ll2/keep.txt", $msg0);
+ok(!rmdir("mnt/ll2") && $!{ENOTEMPTY} && !rmdir("mnt/ll2/keep.txt") &&
+   $!{ENOTDIR} && read_text("ll2/keep.txt") eq $msg0 &&
+   unlink("mnt/ll2/keep.txt") && rmdir("mnt/ll2"),
+   "rmdir through the low-level API only removes empty directories");
+unmount();
+sleep 1;
+
+say "# Concurrent access";
+
+# a block of lines naming the file and the block, so misplaced data shows
+sub tagged_block {
+    my ($tag, $i) = @_;
+    my $line = sprintf("%s:%06d\n", $tag, $i);
+    return $line x int(4096 / length($line));
+}
+
+mount();
+mkdir("mnt/par");
+mkdir("mnt/par/churn");
+for my $r (0..3) {
+    write_text("par/r$r", join("", map { tagged_block("r$r", $_) } 0..255));
+}
+my @pids;
+# each child exits 0 if everything it saw was right
+sub spawn {
+    my ($body) = @_;
+    my $pid = fork();
+    if ($pid == 0) {
+        POSIX::_exit($body->() ? 0 : 1);
+    }
+    push @pids, $pid;
+}
+for my $w (0..3) {
+    spawn(sub {
+        open my $fh, ">", "mnt/par/w$w" or return 0;
+        for my $i (0..255) {
+            $fh->print(tagged_block("w$w", $i)) && $fh->flush or return 0;
+        }
+        return close $fh;
+    });
+}
+for my $r (0..3) {
+    spawn(sub {
+        my $want = join("", map { tagged_block("r$r", $_) } 0..255);
+        for (1..20) {
+            return 0 if read_text("par/r$r") ne substr($want, 0, -1);
+        }
+        return 1;
+    });
+}
+spawn(sub {
+    for my $i (0..499) {
+        write_text("par/churn/c$i", "churn $i");
+        return 0 if read_text("par/churn/c$i") ne "churn $i";
+        unlink("mnt/par/churn/c" . ($i - 1)) or return 0 if $i;
+    }
+    return unlink("mnt/par/churn/c499");
+});
+my $failed = 0;
+for my $pid (@pids) {
+    waitpid($pid, 0);
+    $failed++ if $?;
+}
+ok(!$failed, "Parallel readers, writers and creates and unlinks in one directory");
+my $whole = 1;
+for my $w (0..3) {
+    my $want = join("", map { tagged_block("w$w", $_) } 0..255);
+    $whole &&= read_text("par/w$w") eq substr($want, 0, -1);
+}
+opendir my $churn, "mnt/par/churn";
+my @left = grep { !/^\./ } readdir $churn;
+closedir $churn;
+ok($whole && !@left, "Files written in parallel read back whole");
+system("rm -rf mnt/par");
+unmount();
+sleep 1;
+system("./fsck.nufs -n data.nufs >> test.log 2>&1");
+ok($? == 0, "fsck finds the image clean after concurrent access");
+
+say "# Dentry cache";
+
+# NUFS_IOC_DCACHE_STATS: _IOR('N', 1, dcache_stats_t), four 64-bit counters
+my $dcache_stats = (2 << 30) | (32 << 16) | (ord("N") << 8) | 1;
+sub dcache_stats {
+    open my $dir, "<", "mnt" or return ();
+    my $buf = "\0" x 32;
+    ioctl($dir, $dcache_stats, $buf) or return ();
+    close $dir;
+    my %stats;
+    @stats{qw(hits negative misses evictions)} = unpack("Q4", $buf);
+    return %stats;
+}
+
+# without the kernel's own caches every stat comes down to us
+system("(./nufs -f -o attr_timeout=0,entry_timeout=0,negative_timeout=0 " .
+       "mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+mkdir("mnt/dc");
+write_text("dc/a.txt", $msg0);
+stat("mnt/dc/a.txt");
+my %before = dcache_stats();
+stat("mnt/dc/a.txt") for 1..100;
+my %after = dcache_stats();
+ok(%before && %after && $after{hits} - $before{hits} >= 100 &&
+   $after{misses} - $before{misses} < 10,
+   "Repeated stats are answered by the dentry cache");
+%before = %after;
+my $missing = grep { !-e "mnt/dc/nope.txt" } 1..50;
+%after = dcache_stats();
+ok($missing == 50 && %before && %after &&
+   $after{negative} - $before{negative} >= 49,
+   "Repeated lookups of a missing name hit a negative entry");
+rename("mnt/dc/a.txt", "mnt/dc/b.txt");
+ok(!stat("mnt/dc/a.txt") && $!{ENOENT} && read_text("dc/b.txt") eq $msg0,
+   "A renamed file's old name is gone from the dentry cache");
+system("rm -rf mnt/dc");
+unmount();
+sleep 1;
+
+system("./fsck.nufs -n data.nufs >> test.log 2>&1");
+ok($? == 0, "fsck finds the image clean");
@@ -0,0 +1,45 @@
+/**
+ * @file dedup.c
+ *
+ * Deduplicates the blocks of a mounted nufs file system.
+ *
+ * Usage: dedup.nufs mountpoint
+ *
+ * Runs one pass through the NUFS_IOC_DEDUP ioctl (see dedup.h) and prints
+ * what it found.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: dedup.nufs mountpoint\n");
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  dedup_stats_t stats;
+  int rv = ioctl(fd, NUFS_IOC_DEDUP, &stats);
+  close(fd);
+  if (rv < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  printf("%" PRIu64 " blocks, %" PRIu64 " unique, %" PRIu64 " merged\n",
+         stats.blocks, stats.unique, stats.merged);
+  printf("ratio %.2f\n",
+         stats.unique ? (double) stats.blocks / stats.unique : 1.0);
+  return 0;
+}
@@ -0,0 +1,624 @@
+/**
+ * @file fsck.c
+ *
+ * Offline consistency checker for nufs images.
+ *
+ * Usage: fsck.nufs [-n] [-j threads] image
+ *
+ * The image is opened through the storage layer, so a journal left behind
+ * by a crash is replayed first. The check then runs in four passes:
+ *
+ *  1. every allocated inode's extent tree (and directory layout) is
+ *     validated, in parallel over slices of the inode table, decompressing
+ *     every compressed extent;
+ *  2. the directory tree is walked from the root, dropping entries that
+ *     point at free or damaged inodes and noting which inodes are reachable;
+ *  3. the blocks of every reachable inode are collected, again in parallel,
+ *     catching blocks claimed twice (data blocks may be shared by several
+ *     files after deduplication, but tree blocks never are); then the same
+ *     is done for the inodes of each snapshot (checked as in pass 1, but
+ *     never repaired), counting how many owners every block has;
+ *  4. the block and inode bitmaps are rebuilt from that and compared with
+ *     the ones on disk, in parallel over slices of the bitmaps. Blocks
+ *     marked in use that nothing owns (e.g. leaked by an interrupted
+ *     truncate) are freed, and so are unreachable inodes. The share table
+ *     is checked against the owner counts as well, and the superblock's
+ *     free counts against the bitmaps.
+ *
+ * Repairs go through the journal like any other change. With -n nothing is
+ * changed and the problems are only reported.
+ *
+ * Exit status follows e2fsck: 0 if the image was clean, 1 if problems were
+ * fixed, 4 if problems were left, 8 if the image couldn't be checked.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "compress.h"
+#include "directory.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "storage.h"
+
+#define INODE_CHUNK 1024 // inodes a worker claims at a time
+#define MAX_THREADS 64
+#define MAX_DEPTH 8      // deeper extent trees than this are damaged
+
+typedef struct counts {
+  long files;
+  long dirs;
+  long blocks;     // data and tree blocks owned by reachable inodes
+  long damaged;    // inodes with a broken extent tree or layout
+  long duplicates; // blocks claimed by more than one inode
+  long leaked;     // blocks marked in use that nothing owns
+  long missing;    // blocks in use but marked free
+  long orphans;    // allocated inodes no directory reaches
+  long shares;     // blocks with a wrong count in the share table
+  long free_counts; // wrong free block and inode counts in the superblock
+} counts_t;
+
+// what a worker thread of a pass gets
+typedef struct slice {
+  int index;         // which of the nthreads workers
+  counts_t *counts;  // the worker's own counters
+} slice_t;
+
+static superblock_t *sb;
+static int readonly = 0;
+static int nthreads = 1;
+
+static uint8_t *damaged;   // per inode: nonzero if pass 1 rejected it
+static uint8_t *reachable; // inode bitmap rebuilt by pass 2
+static uint8_t *used;      // block bitmap rebuilt by pass 3
+static uint8_t *claimed;   // blocks claimed by the tree being walked
+static uint8_t *nodes;     // ...of those, the ones that aren't file data
+static uint16_t *owners;   // per block: file blocks using it, in any tree
+static uint8_t *owned;     // inodes whose blocks pass 3 collects
+static const char *where = ""; // names the snapshot being checked
+static long bad_entries;   // directory entries dropped by pass 2
+static int next_inum;      // next slice of the inode table to hand out
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Get the entries that follow an extent tree node header.
+static extent_t *entries(extent_header_t *hdr) {
+  return (extent_t *) (hdr + 1);
+}
+
+// Check whether a run of blocks lies inside the data area.
+static int in_data(uint32_t start, uint32_t len) {
+  return start >= sb->data_start && len <= sb->block_count &&
+         start <= sb->block_count - len;
+}
+
+// Check that a compressed extent is a cluster that decompresses.
+static int check_compressed(extent_t *ent) {
+  char data[COMPRESS_CLUSTER_BYTES];
+  if (ent->len > COMPRESS_CLUSTER || ent->lblk % COMPRESS_CLUSTER ||
+      ent->zlen >= (uint64_t) ent->len * BLOCK_SIZE) {
+    return -1;
+  }
+  return compress_unpack(ent, data);
+}
+
+// Check an extent tree node and everything below it. Entries must be
+// sorted and stay within [lo, hi) of the file.
+static int check_tree(extent_header_t *hdr, int depth, uint32_t lo,
+                      uint32_t hi) {
+  if (hdr->count > hdr->max || hdr->depth != depth || depth > MAX_DEPTH) {
+    return -1;
+  }
+  extent_t *ents = entries(hdr);
+  for (int ii = 0; ii < hdr->count; ++ii) {
+    extent_t *ent = &ents[ii];
+    uint32_t end = ii + 1 < hdr->count ? ents[ii + 1].lblk : hi;
+    if (ent->lblk < lo || ent->lblk > end || (ii && ent->lblk == lo)) {
+      return -1;
+    }
+    if (depth == 0) {
+      if (ent->len == 0 || ent->len > end - ent->lblk ||
+          !in_data(ent->start, extent_disk_blocks(ent))) {
+        return -1;
+      }
+      if (ent->zlen && check_compressed(ent) < 0) {
+        return -1;
+      }
+    } else {
+      if (!in_data(ent->start, 1)) {
+        return -1;
+      }
+      extent_header_t *child = blocks_get_block(ent->start);
+      if (child->max != EXTENT_BLOCK_MAX ||
+          check_tree(child, depth - 1, ent->lblk, end) < 0) {
+        return -1;
+      }
+    }
+    lo = ent->lblk;
+  }
+  return 0;
+}
+
+// Check the layout of a directory: whole blocks, all of them mapped, and
+// a sane index if it's hashed.
+static int check_dir(inode_t *node) {
+  if (node->size <= 0 || node->size % BLOCK_SIZE) {
+    return -1;
+  }
+  int nblocks = node->size / BLOCK_SIZE;
+  for (int lblk = 0; lblk < nblocks; ++lblk) {
+    if (!inode_get_bnum(node, lblk)) {
+      return -1;
+    }
+  }
+  if (node->flags & INODE_DIR_HASHED) {
+    dir_index_t *index = blocks_get_block(inode_get_bnum(node, 0));
+    if (index->count == 0 || index->count > DIR_INDEX_COUNT) {
+      return -1;
+    }
+    for (int ii = 0; ii < index->count; ++ii) {
+      uint32_t lblk = index->leaves[ii].lblk;
+      if (lblk < 1 || lblk >= nblocks ||
+          (ii && index->leaves[ii].hash < index->leaves[ii - 1].hash)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Pass 1: validate a slice of the inode table at a time.
+static void *check_inodes(void *arg) {
+  counts_t *counts = ((slice_t *) arg)->counts;
+  void *ibm = get_inode_bitmap();
+  for (;;) {
+    int first = __atomic_fetch_add(&next_inum, INODE_CHUNK, __ATOMIC_RELAXED);
+    if (first >= sb->inode_count) {
+      break;
+    }
+    int last = first + INODE_CHUNK;
+    if (last > sb->inode_count) {
+      last = sb->inode_count;
+    }
+    for (int inum = first < 1 ? 1 : first; inum < last; ++inum) {
+      if (!bitmap_get(ibm, inum)) {
+        continue;
+      }
+      inode_t *node = get_inode(inum);
+      int type = node->mode & 0170000;
+      int ok = (type == 0100000 || type == 040000) && node->size >= 0 &&
+               node->tree.max == INODE_EXTENTS &&
+               check_tree(&node->tree, node->tree.depth, 0, UINT32_MAX) == 0;
+      if (ok && type == 040000) {
+        ok = check_dir(node) == 0;
+      }
+      if (!ok) {
+        damaged[inum] = 1;
+        counts->damaged++;
+        printf("%sinode %d: damaged%s\n", where, inum,
+               where[0] ? "" : ", detaching");
+      }
+    }
+  }
+  return 0;
+}
+
+// Remove a directory entry.
+static void drop_entry(dirent_t *entry) {
+  bad_entries++;
+  if (!readonly) {
+    memset(entry, 0, sizeof(dirent_t));
+    journal_dirty(entry, sizeof(dirent_t), 1);
+  }
+}
+
+// Pass 2: walk the tree from the root, breadth first.
+static int walk_tree() {
+  void *ibm = get_inode_bitmap();
+  int *queue = malloc(sb->inode_count * sizeof(int));
+  if (!queue) {
+    return -1;
+  }
+  int head = 0;
+  int tail = 0;
+  queue[tail++] = 1;
+  bitmap_put(reachable, 1, 1);
+
+  while (head < tail) {
+    int dinum = queue[head++];
+    inode_t *di = get_inode(dinum);
+    int hashed = di->flags & INODE_DIR_HASHED;
+    int end = hashed ? di->size / BLOCK_SIZE : 1;
+    for (int lblk = hashed ? 1 : 0; lblk < end; ++lblk) {
+      dirent_t *entries = blocks_get_block(inode_get_bnum(di, lblk));
+      for (int ii = 0; ii < DIRENT_COUNT; ++ii) {
+        dirent_t *entry = &entries[ii];
+        if (!entry->name[0]) {
+          continue;
+        }
+        int inum = entry->inum;
+        if (inum < 1 || inum >= sb->inode_count || !bitmap_get(ibm, inum) ||
+            damaged[inum]) {
+          printf("inode %d: entry '%.*s' points at bad inode %d\n", dinum,
+                 DIR_NAME_LENGTH, entry->name, inum);
+          drop_entry(entry);
+          continue;
+        }
+        if (bitmap_get(reachable, inum)) {
+          continue; // "." or another link
+        }
+        bitmap_put(reachable, inum, 1);
+        if (get_inode(inum)->mode & 040000) {
+          queue[tail++] = inum;
+        }
+      }
+    }
+  }
+  free(queue);
+  return 0;
+}
+
+// Claim a block for an inode of the tree being walked. Only file data
+// blocks may be claimed more than once.
+static void claim(uint32_t bnum, int data, counts_t *counts) {
+  uint8_t bit = 1 << (bnum % 8);
+  // mark before testing the other bitmap, so that of a data and a tree
+  // claim racing for a block at least one sees the other
+  int dup;
+  if (data) {
+    dup = __atomic_fetch_or(&claimed[bnum / 8], bit, __ATOMIC_SEQ_CST) & bit;
+    if (__atomic_load_n(&nodes[bnum / 8], __ATOMIC_SEQ_CST) & bit) {
+      counts->duplicates++;
+      printf("%sblock %u: claimed as data and tree block\n", where, bnum);
+      return;
+    }
+  } else {
+    __atomic_fetch_or(&nodes[bnum / 8], bit, __ATOMIC_SEQ_CST);
+    dup = __atomic_fetch_or(&claimed[bnum / 8], bit, __ATOMIC_SEQ_CST) & bit;
+    if (dup) {
+      counts->duplicates++;
+      printf("%sblock %u: claimed more than once\n", where, bnum);
+      return;
+    }
+  }
+  __atomic_fetch_add(&owners[bnum], 1, __ATOMIC_RELAXED);
+  if (!dup) {
+    __atomic_fetch_or(&used[bnum / 8], bit, __ATOMIC_RELAXED);
+    counts->blocks++;
+  }
+}
+
+// Claim every block of an extent tree (already validated).
+static void claim_tree(extent_header_t *hdr, counts_t *counts) {
+  extent_t *ents = entries(hdr);
+  for (int ii = 0; ii < hdr->count; ++ii) {
+    if (hdr->depth == 0) {
+      for (uint32_t jj = 0; jj < extent_disk_blocks(&ents[ii]); ++jj) {
+        claim(ents[ii].start + jj, 1, counts);
+      }
+    } else {
+      claim(ents[ii].start, 0, counts);
+      claim_tree(blocks_get_block(ents[ii].start), counts);
+    }
+  }
+}
+
+// Pass 3: collect the blocks of the inodes in owned (the reachable ones,
+// or a snapshot's), a slice at a time.
+static void *claim_blocks(void *arg) {
+  counts_t *counts = ((slice_t *) arg)->counts;
+  for (;;) {
+    int first = __atomic_fetch_add(&next_inum, INODE_CHUNK, __ATOMIC_RELAXED);
+    if (first >= sb->inode_count) {
+      break;
+    }
+    int last = first + INODE_CHUNK;
+    if (last > sb->inode_count) {
+      last = sb->inode_count;
+    }
+    for (int inum = first; inum < last; ++inum) {
+      if (!bitmap_get(owned, inum) || damaged[inum]) {
+        continue;
+      }
+      inode_t *node = get_inode(inum);
+      if (node->mode & 040000) {
+        counts->dirs++;
+      } else {
+        counts->files++;
+      }
+      claim_tree(&node->tree, counts);
+    }
+  }
+  return 0;
+}
+
+// Get the byte range [*first, *last) of a bitmap of the given number of
+// bits that slice index covers.
+static void slice_bytes(int index, int bits, int *first, int *last) {
+  int bytes = (bits + 7) / 8;
+  int per = (bytes + nthreads - 1) / nthreads;
+  *first = index * per < bytes ? index * per : bytes;
+  *last = *first + per < bytes ? *first + per : bytes;
+}
+
+// Only the bits of byte ii that stand for one of count items.
+static uint8_t valid_bits(int ii, int count) {
+  int left = count - ii * 8;
+  return left >= 8 ? 0xff : (1 << left) - 1;
+}
+
+// Pass 4: compare a slice of both bitmaps with the rebuilt ones.
+static void *fix_bitmaps(void *arg) {
+  slice_t *slice = arg;
+  counts_t *counts = slice->counts;
+  uint8_t *bbm = get_blocks_bitmap();
+  uint8_t *ibm = get_inode_bitmap();
+  uint16_t *shares = get_share_table();
+  int first;
+  int last;
+
+  slice_bytes(slice->index, sb->block_count, &first, &last);
+  for (int ii = first; ii < last; ++ii) {
+    uint8_t mask = valid_bits(ii, sb->block_count);
+    for (int bnum = ii * 8; bnum < ii * 8 + 8 && bnum < sb->block_count;
+         ++bnum) {
+      uint16_t want = owners[bnum] ? owners[bnum] - 1 : 0;
+      if (shares[bnum] != want) {
+        counts->shares++;
+        if (!readonly) {
+          shares[bnum] = want;
+          journal_dirty(&shares[bnum], sizeof(uint16_t), 1);
+        }
+      }
+    }
+    uint8_t diff = (bbm[ii] ^ used[ii]) & mask;
+    if (!diff) {
+      continue;
+    }
+    counts->leaked += __builtin_popcount(diff & bbm[ii]);
+    counts->missing += __builtin_popcount(diff & used[ii]);
+    if (!readonly) {
+      bbm[ii] ^= diff;
+      journal_dirty(&bbm[ii], 1, 1);
+    }
+  }
+
+  slice_bytes(slice->index, sb->inode_count, &first, &last);
+  for (int ii = first; ii < last; ++ii) {
+    uint8_t mask = valid_bits(ii, sb->inode_count) & (ii ? 0xff : 0xfe);
+    uint8_t diff = (ibm[ii] ^ reachable[ii]) & mask;
+    if (!diff) {
+      continue;
+    }
+    counts->orphans += __builtin_popcount(diff);
+    if (readonly) {
+      continue;
+    }
+    for (int bit = 0; bit < 8; ++bit) {
+      if (diff & (1 << bit)) {
+        inode_t *node = get_inode(ii * 8 + bit);
+        memset(node, 0, sizeof(inode_t));
+        journal_dirty(node, sizeof(inode_t), 1);
+      }
+    }
+    ibm[ii] ^= diff;
+    journal_dirty(&ibm[ii], 1, 1);
+  }
+  return 0;
+}
+
+// Run a pass on nthreads threads, each with its own counters, and add
+// them up into total.
+static void run_pass(void *(*pass)(void *), counts_t *total) {
+  pthread_t threads[MAX_THREADS];
+  counts_t counts[MAX_THREADS];
+  slice_t slices[MAX_THREADS];
+  memset(counts, 0, sizeof(counts));
+  next_inum = 0;
+  for (int ii = 0; ii < nthreads; ++ii) {
+    slices[ii].index = ii;
+    slices[ii].counts = &counts[ii];
+    pthread_create(&threads[ii], 0, pass, &slices[ii]);
+  }
+  for (int ii = 0; ii < nthreads; ++ii) {
+    pthread_join(threads[ii], 0);
+    // counts_t is nothing but longs
+    long *from = (long *) &counts[ii];
+    long *to = (long *) total;
+    for (int jj = 0; jj < sizeof(counts_t) / sizeof(long); ++jj) {
+      to[jj] += from[jj];
+    }
+  }
+}
+
+// Check the inodes of every snapshot and collect their blocks. Returns the
+// number of snapshots that couldn't be checked at all.
+static long check_snapshots(counts_t *snap_counts) {
+  long bad = 0;
+  static char label[SNAPSHOT_NAME_LENGTH + 16];
+  snapshot_t *table = get_snapshots();
+  int count = sb->journal_start - sb->inode_bitmap_start;
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    snapshot_t *snap = &table[ii];
+    if (!snap->name[0]) {
+      continue;
+    }
+    snprintf(label, sizeof(label), "snapshot %.*s: ", SNAPSHOT_NAME_LENGTH,
+             snap->name);
+    if (snap->blocks != count || !in_data(snap->start, snap->blocks)) {
+      printf("%sbad inode table copy\n", label);
+      bad++;
+      continue;
+    }
+    where = label;
+    memset(claimed, 0, (sb->block_count + 7) / 8);
+    memset(nodes, 0, (sb->block_count + 7) / 8);
+    for (uint32_t bnum = snap->start; bnum < snap->start + count; ++bnum) {
+      claim(bnum, 0, snap_counts);
+    }
+    blocks_view_inodes(snap->start);
+    memset(damaged, 0, sb->inode_count);
+    owned = get_inode_bitmap();
+    run_pass(check_inodes, snap_counts);
+    run_pass(claim_blocks, snap_counts);
+    blocks_view_inodes(0);
+  }
+  where = "";
+  return bad;
+}
+
+// Count the clear bits among the first count of a bitmap.
+static uint32_t count_zeros(uint8_t *bm, int count) {
+  uint32_t ones = 0;
+  for (int ii = 0; ii < (count + 7) / 8; ++ii) {
+    ones += __builtin_popcount(bm[ii] & valid_bits(ii, count));
+  }
+  return count - ones;
+}
+
+// Check the superblock's free counts against the bitmaps, once those have
+// been fixed.
+static void fix_free_counts(counts_t *counts) {
+  uint32_t blocks = count_zeros(get_blocks_bitmap(), sb->block_count);
+  // inode 0 is never handed out, whatever its bit says
+  uint8_t *ibm = get_inode_bitmap();
+  uint32_t inodes = count_zeros(ibm, sb->inode_count) - !bitmap_get(ibm, 0);
+  if (sb->free_blocks != blocks || sb->free_inodes != inodes) {
+    counts->free_counts++;
+    if (!readonly) {
+      sb->free_blocks = blocks;
+      sb->free_inodes = inodes;
+      journal_dirty(sb, sizeof(superblock_t), 1);
+    }
+  }
+}
+
+static void usage() {
+  fprintf(stderr, "usage: fsck.nufs [-n] [-j threads] image\n");
+  exit(8);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "nj:")) != -1) {
+    switch (opt) {
+    case 'n':
+      readonly = 1;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+
+  // storage_init() would format an empty file
+  const char *image = argv[optind];
+  struct stat st;
+  if (stat(image, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "%s: not a nufs image\n", image);
+    return 8;
+  }
+  if (storage_init(image, 0, 0) < 0) {
+    return 8;
+  }
+  sb = get_superblock();
+
+  double t0 = now();
+  damaged = calloc(sb->inode_count, 1);
+  reachable = calloc((sb->inode_count + 7) / 8, 1);
+  used = calloc((sb->block_count + 7) / 8, 1);
+  claimed = calloc((sb->block_count + 7) / 8, 1);
+  nodes = calloc((sb->block_count + 7) / 8, 1);
+  owners = calloc(sb->block_count, sizeof(uint16_t));
+  if (!damaged || !reachable || !used || !claimed || !nodes || !owners) {
+    fprintf(stderr, "fsck.nufs: out of memory\n");
+    return 8;
+  }
+  for (int bnum = 0; bnum < sb->data_start; ++bnum) {
+    bitmap_put(used, bnum, 1);
+  }
+
+  counts_t counts;
+  memset(&counts, 0, sizeof(counts));
+  run_pass(check_inodes, &counts);
+  inode_t *root = get_inode(1);
+  if (damaged[1] || !bitmap_get(get_inode_bitmap(), 1) ||
+      !(root->mode & 040000)) {
+    fprintf(stderr, "%s: root directory is damaged\n", image);
+    blocks_free();
+    return 4;
+  }
+  if (walk_tree() < 0) {
+    fprintf(stderr, "fsck.nufs: out of memory\n");
+    return 8;
+  }
+  owned = reachable;
+  run_pass(claim_blocks, &counts);
+  counts_t snap_counts;
+  memset(&snap_counts, 0, sizeof(snap_counts));
+  long bad_snapshots = check_snapshots(&snap_counts);
+  run_pass(fix_bitmaps, &counts);
+  fix_free_counts(&counts);
+
+  printf("%s: %ld files, %ld directories, %ld/%u blocks (%.2fs, %d threads)\n",
+         image, counts.files, counts.dirs, counts.blocks + sb->data_start,
+         sb->block_count, now() - t0, nthreads);
+  long fixable = counts.damaged + bad_entries + counts.leaked +
+                 counts.missing + counts.orphans + counts.shares +
+                 counts.free_counts;
+  if (fixable) {
+    printf("%s: %ld damaged inodes, %ld bad entries, %ld unreachable inodes, "
+           "%ld leaked blocks, %ld blocks marked free, %ld wrong share "
+           "counts, %s free counts%s\n",
+           image, counts.damaged, bad_entries, counts.orphans, counts.leaked,
+           counts.missing, counts.shares,
+           counts.free_counts ? "wrong" : "right", readonly ? "" : " (fixed)");
+  }
+  long duplicates = counts.duplicates + snap_counts.duplicates;
+  if (duplicates) {
+    printf("%s: %ld blocks claimed more than once (not fixed)\n", image,
+           duplicates);
+  }
+  long snap_problems = bad_snapshots + snap_counts.damaged;
+  if (snap_problems) {
+    printf("%s: %ld damaged snapshots or snapshot inodes (not fixed)\n",
+           image, snap_problems);
+  }
+
+  int rv = 0;
+  if (readonly || !fixable) {
+    blocks_free(); // nothing to keep
+  } else {
+    rv = journal_commit() < 0 ? 8 : 1;
+    storage_destroy();
+  }
+  if (duplicates || snap_problems || (readonly && fixable)) {
+    rv = 4;
+  }
+  return rv;
+}
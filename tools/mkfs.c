@@ -0,0 +1,87 @@
+/**
+ * @file mkfs.c
+ *
+ * Creates an empty nufs image.
+ *
+ * Usage: mkfs.nufs [-f] [-s size] [-i inodes] image
+ *
+ * Does offline what mounting a missing image does implicitly: the image is
+ * created through the storage layer, so it gets the same layout and an
+ * empty journal. An existing, non-empty image is only overwritten with -f.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "storage.h"
+
+// Parse a byte count with an optional K, M, G or T suffix.
+static size_t parse_size(const char *text) {
+  char *end;
+  size_t size = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'T': case 't': size <<= 10; // fall through
+  case 'G': case 'g': size <<= 10; // fall through
+  case 'M': case 'm': size <<= 10; // fall through
+  case 'K': case 'k': size <<= 10;
+  }
+  return size;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: mkfs.nufs [-f] [-s size] [-i inodes] image\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int force = 0;
+  size_t size = 0;
+  int inodes = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "fs:i:")) != -1) {
+    switch (opt) {
+    case 'f':
+      force = 1;
+      break;
+    case 's':
+      size = parse_size(optarg);
+      break;
+    case 'i':
+      inodes = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+  }
+
+  // the storage layer only formats empty files
+  const char *image = argv[optind];
+  struct stat st;
+  if (stat(image, &st) == 0 && st.st_size > 0) {
+    if (!force) {
+      fprintf(stderr, "%s: already exists (use -f to overwrite)\n", image);
+      return 1;
+    }
+    if (truncate(image, 0) < 0) {
+      perror(image);
+      return 1;
+    }
+  }
+
+  if (storage_init(image, size, inodes) < 0) {
+    return 1;
+  }
+  superblock_t *sb = get_superblock();
+  printf("%s: %u blocks of %u bytes, %u inodes, %u journal blocks, "
+         "data from block %u\n",
+         image, sb->block_count, sb->block_size, sb->inode_count,
+         sb->journal_blocks, sb->data_start);
+  storage_destroy();
+  return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file snapshot.c
+ *
+ * Takes, deletes and lists snapshots of a mounted nufs file system.
+ *
+ * Usage: snapshot.nufs create|delete mountpoint name
+ *        snapshot.nufs list mountpoint
+ *
+ * Talks to the driver through the ioctls in nufs_ioctl.h. A snapshot is
+ * mounted read-only with -o snapshot=name.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+static void usage() {
+  fprintf(stderr, "usage: snapshot.nufs create|delete mountpoint name\n"
+                  "       snapshot.nufs list mountpoint\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+  const char *cmd = argv[1];
+  int list = !strcmp(cmd, "list");
+  if (!(list ? argc == 3
+             : argc == 4 && (!strcmp(cmd, "create") || !strcmp(cmd, "delete")))) {
+    usage();
+    return 1;
+  }
+
+  int fd = open(argv[2], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  int rv;
+  if (list) {
+    static nufs_snapshot_list_t snaps;
+    rv = ioctl(fd, NUFS_IOC_SNAP_LIST, &snaps);
+    for (uint32_t ii = 0; rv == 0 && ii < snaps.count; ++ii) {
+      char when[32];
+      time_t created = snaps.snapshots[ii].created;
+      strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+      printf("%s  %s\n", when, snaps.snapshots[ii].name);
+    }
+  } else {
+    nufs_snapshot_name_t arg;
+    memset(&arg, 0, sizeof(arg));
+    if (strlen(argv[3]) > SNAPSHOT_NAME_LENGTH) {
+      fprintf(stderr, "%s: name too long\n", argv[3]);
+      close(fd);
+      return 1;
+    }
+    strcpy(arg.name, argv[3]);
+    rv = ioctl(fd, !strcmp(cmd, "create") ? NUFS_IOC_SNAP_CREATE
+                                          : NUFS_IOC_SNAP_DELETE,
+               &arg);
+  }
+  if (rv < 0) {
+    perror(argv[3 - list]);
+  }
+  close(fd);
+  return rv < 0 ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file xxhash.c
+ *
+ * XXH64, following the xxHash specification.
+ */
+
+#include <string.h>
+
+#include "xxhash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Read little-endian words (every platform nufs runs on is little-endian).
+static uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Mix 8 bytes of input into an accumulator.
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  return rotl(acc, 31) * PRIME1;
+}
+
+// Fold an accumulator into the hash after the 32-byte stripes.
+static uint64_t merge(uint64_t hash, uint64_t acc) {
+  hash ^= round64(0, acc);
+  return hash * PRIME1 + PRIME4;
+}
+
+// Hash a buffer.
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+  uint64_t hash;
+
+  if (len >= 32) {
+    // four lanes over 32-byte stripes
+    uint64_t v1 = seed + PRIME1 + PRIME2;
+    uint64_t v2 = seed + PRIME2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME1;
+    do {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+    hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    hash = merge(hash, v1);
+    hash = merge(hash, v2);
+    hash = merge(hash, v3);
+    hash = merge(hash, v4);
+  } else {
+    hash = seed + PRIME5;
+  }
+  hash += len;
+
+  while (end - p >= 8) {
+    hash ^= round64(0, read64(p));
+    hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    hash ^= read32(p) * PRIME1;
+    hash = rotl(hash, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+  while (p < end) {
+    hash ^= *p++ * PRIME5;
+    hash = rotl(hash, 11) * PRIME1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
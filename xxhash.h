@@ -0,0 +1,27 @@
+/**
+ * @file xxhash.h
+ *
+ * The 64-bit xxHash (XXH64) of a buffer.
+ *
+ * A fast non-cryptographic hash, used to fingerprint blocks for
+ * deduplication. Equal hashes don't prove equal data, so callers compare
+ * the data too before relying on a match.
+ */
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Hash a buffer.
+ *
+ * @param data The data.
+ * @param len Length of the data.
+ * @param seed Seed of the hash (0 for the standard one).
+ *
+ * @return XXH64 of the data, the same as the reference implementation's.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif